@@ -9,8 +9,13 @@
 #include <fs.h>
 #include <dirent.h>
 #include <sys/wait.h>
+#include <time.h>
+
+// Seconds between two syncs by init, bounding how long written data may stay in memory when the disks are idle
+#define SYNC_INTERVAL 30
 
 static inline _syscall0(SYS_YIELD, int, sys_yield)
+static inline _syscall0(SYS_SYNC, int, sys_sync)
 static inline _syscall1(SYS_DUP, int, sys_dup, int, fd)
 static inline _syscall2(SYS_TRUNCATE_FD, int, sys_truncate_fd, int, fd, uint, size)
 static inline _syscall2(SYS_TRUNCATE_PATH, int, sys_truncate_path, const char*, path, uint, size)
@@ -206,8 +211,13 @@ int main(int argc, char* argv[]) {
 
     if(fork_ret) {
         // parent
+        time_t last_sync = time(NULL);
         while(1) {
             sys_yield();
+            if(time(NULL) - last_sync >= SYNC_INTERVAL) {
+                sys_sync();
+                last_sync = time(NULL);
+            }
         }
     } else {
         // child
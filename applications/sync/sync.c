@@ -0,0 +1,15 @@
+#include <syscall.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static inline _syscall0(SYS_SYNC, int, sys_sync)
+
+int main() {
+    int r = sys_sync();
+    if(r < 0) {
+        printf("sync error\n");
+        exit(1);
+    } else {
+        exit(0);
+    }
+}
@@ -0,0 +1,658 @@
+#include <string.h>
+#include <stdio.h>
+#include <common.h>
+#include <kernel/ahci.h>
+#include <kernel/pci.h>
+#include <kernel/paging.h>
+#include <kernel/heap.h>
+#include <kernel/lock.h>
+#include <kernel/process.h>
+#include <kernel/panic.h>
+#include <kernel/errno.h>
+#include <arch/i386/kernel/isr.h>
+#include <arch/i386/kernel/pic.h>
+
+// AHCI (Advanced Host Controller Interface) SATA driver
+// Ref: https://wiki.osdev.org/AHCI
+// Ref: Serial ATA AHCI 1.3.1 Specification
+//
+// Every port has a command list of up to 32 slots, so multiple commands can be outstanding.
+// If both the HBA and the drive support NCQ (Native Command Queuing), the READ/WRITE FPDMA QUEUED
+// commands are used and the drive may complete them out of order.
+//
+// Besides the synchronous routines, requests can be submitted asynchronously (see ahci_submit_sectors()),
+// their commands are issued in as many free slots as needed and completed from the IRQ,
+// so the block device queue keeps as many transfers outstanding as there are slots.
+
+// HBA (Host Bus Adapter) registers
+#define AHCI_CAP_SNCQ (1 << 30)
+#define AHCI_CAP_NCS(cap) ((((cap) >> 8) & 0x1F) + 1)
+#define AHCI_GHC_IE (1 << 1)
+#define AHCI_GHC_AE (1u << 31)
+
+// Port registers
+#define AHCI_PxCMD_ST (1 << 0)
+#define AHCI_PxCMD_FRE (1 << 4)
+#define AHCI_PxCMD_FR (1 << 14)
+#define AHCI_PxCMD_CR (1 << 15)
+
+#define AHCI_PxIS_DHRS (1 << 0) // Device to Host Register FIS
+#define AHCI_PxIS_PSS (1 << 1) // PIO Setup FIS
+#define AHCI_PxIS_SDBS (1 << 3) // Set Device Bits FIS, completion of NCQ commands
+#define AHCI_PxIS_ERRORS ((1 << 24) | (1 << 26) | (1 << 27) | (1 << 28) | (1 << 29) | (1 << 30))
+
+#define AHCI_SSTS_DET_PRESENT 3
+#define AHCI_SSTS_IPM_ACTIVE 1
+#define SATA_SIG_ATA 0x00000101
+
+#define FIS_TYPE_REG_H2D 0x27
+
+#define ATA_CMD_READ_DMA_EXT 0x25
+#define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_READ_FPDMA_QUEUED 0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED 0x61
+#define ATA_CMD_FLUSH_CACHE_EXT 0xEA
+#define ATA_CMD_IDENTIFY 0xEC
+
+#define ATA_DEVICE_LBA (1 << 6)
+#define ATA_DEVICE_FUA (1 << 7)
+
+// Physical regions per command, a command transfers at most AHCI_MAX_SECTORS_PER_CMD
+// so a non physically contiguous buffer needs at most 33 regions
+// (a multiple of 8, so that command tables stay 128 bytes aligned)
+#define AHCI_PRDT_ENTRIES 40
+#define AHCI_MAX_SECTORS_PER_CMD 256
+
+typedef volatile struct hba_port {
+    uint32_t clb; // command list base address, 1K aligned
+    uint32_t clbu;
+    uint32_t fb; // FIS receive area base address, 256 bytes aligned
+    uint32_t fbu;
+    uint32_t is; // interrupt status
+    uint32_t ie; // interrupt enable
+    uint32_t cmd;
+    uint32_t rsv0;
+    uint32_t tfd; // task file data
+    uint32_t sig;
+    uint32_t ssts; // SATA status
+    uint32_t sctl;
+    uint32_t serr;
+    uint32_t sact; // NCQ commands outstanding
+    uint32_t ci; // commands issued
+    uint32_t sntf;
+    uint32_t fbs;
+    uint32_t rsv1[11];
+    uint32_t vendor[4];
+} hba_port;
+
+typedef volatile struct hba_mem {
+    uint32_t cap;
+    uint32_t ghc;
+    uint32_t is;
+    uint32_t pi; // ports implemented
+    uint32_t vs;
+    uint32_t ccc_ctl;
+    uint32_t ccc_pts;
+    uint32_t em_loc;
+    uint32_t em_ctl;
+    uint32_t cap2;
+    uint32_t bohc;
+    uint8_t rsv[0xA0-0x2C];
+    uint8_t vendor[0x100-0xA0];
+    hba_port ports[32];
+} hba_mem;
+
+typedef struct ahci_cmd_header {
+    uint16_t flags; // bits 0-4: command FIS length in dwords, bit 6: write
+    uint16_t prdtl; // PRDT entry count
+    volatile uint32_t prdbc; // bytes transferred
+    uint32_t ctba; // command table base address, 128 bytes aligned
+    uint32_t ctbau;
+    uint32_t rsv[4];
+} __attribute__ ((packed)) ahci_cmd_header;
+
+#define AHCI_CMD_HEADER_WRITE (1 << 6)
+
+typedef struct ahci_prd_entry {
+    uint32_t dba; // data base address, word aligned
+    uint32_t dbau;
+    uint32_t rsv;
+    uint32_t dbc; // bits 0-21: byte count - 1, bit 31: interrupt on completion
+} __attribute__ ((packed)) ahci_prd_entry;
+
+typedef struct fis_reg_h2d {
+    uint8_t fis_type;
+    uint8_t flags; // bit 7: command (1) or control (0)
+    uint8_t command;
+    uint8_t feature_lo;
+    uint8_t lba0;
+    uint8_t lba1;
+    uint8_t lba2;
+    uint8_t device;
+    uint8_t lba3;
+    uint8_t lba4;
+    uint8_t lba5;
+    uint8_t feature_hi;
+    uint8_t count_lo;
+    uint8_t count_hi;
+    uint8_t icc;
+    uint8_t control;
+    uint8_t rsv[4];
+} __attribute__ ((packed)) fis_reg_h2d;
+
+typedef struct ahci_cmd_table {
+    uint8_t cfis[64];
+    uint8_t acmd[16];
+    uint8_t rsv[48];
+    ahci_prd_entry prdt[AHCI_PRDT_ENTRIES];
+} __attribute__ ((packed)) ahci_cmd_table;
+
+typedef struct ahci_drive {
+    hba_port* port;
+    uint32_t port_no;
+    ahci_cmd_header* cmd_list;
+    ahci_cmd_table* cmd_tables; // one per slot
+    uint32_t cmd_tables_phy_addr;
+    uint64_t sector_count;
+    bool ncq;
+    uint32_t slot_count; // queue depth
+    uint32_t slots_busy; // slots allocated to commands
+    volatile uint32_t slots_failed; // set when the port reports an error
+    uint32_t slots_async; // slots of asynchronous requests, completed from the IRQ
+    ahci_request* slot_reqs[32]; // asynchronous request of each slot in slots_async
+    yield_lock lk; // protecting slot allocation and issuing, released while sleeping
+} ahci_drive;
+
+static struct {
+    bool initialized;
+    hba_mem* hba;
+    ahci_drive drives[AHCI_MAX_DRIVES];
+    uint32_t drive_count;
+} ahci;
+
+static void ahci_stop_port(hba_port* port)
+{
+    port->cmd &= ~AHCI_PxCMD_ST;
+    while(port->cmd & AHCI_PxCMD_CR);
+    port->cmd &= ~AHCI_PxCMD_FRE;
+    while(port->cmd & AHCI_PxCMD_FR);
+}
+
+static void ahci_start_port(hba_port* port)
+{
+    while(port->cmd & AHCI_PxCMD_CR);
+    port->cmd |= AHCI_PxCMD_FRE;
+    port->cmd |= AHCI_PxCMD_ST;
+}
+
+// Acknowledge port interrupts, on error fail all outstanding commands and restart the port
+// Called from the IRQ handler, or when polling during kernel initialization
+static void ahci_port_interrupt(ahci_drive* d)
+{
+    uint32_t is = d->port->is;
+    d->port->is = is;
+    if(is & AHCI_PxIS_ERRORS) {
+        printf("AHCI: Port %u error, IS[0x%x], TFD[0x%x], SERR[0x%x]\n", d->port_no, is, d->port->tfd, d->port->serr);
+        // NCQ errors abort every outstanding command, the HBA clears PxCI/PxSACT when stopped
+        d->slots_failed |= d->slots_busy;
+        ahci_stop_port(d->port);
+        d->port->serr = 0xFFFFFFFF;
+        d->port->is = 0xFFFFFFFF;
+        ahci_start_port(d->port);
+    }
+}
+
+static void ahci_issue_next(ahci_drive* d, ahci_request* req, int slot);
+
+// Complete the commands of asynchronous requests that are done, d->lk shall be held
+// A slot is reused for the next command of its request, so a request never waits for a free slot
+// once issued. The lock is released while running the callbacks, so that they can submit further requests
+static void ahci_complete_async(ahci_drive* d)
+{
+    uint32_t done;
+    // commands failing to be issued show as done, check again
+    while((done = d->slots_async & ~(d->port->ci | d->port->sact)) != 0) {
+        for(uint32_t slot=0; slot<32; slot++) {
+            if(!(done & (1 << slot))) {
+                continue;
+            }
+            ahci_request* req = d->slot_reqs[slot];
+            if(d->slots_failed & (1 << slot)) {
+                req->failed = true;
+            }
+            if(!req->failed && req->issued < req->sector_count) {
+                ahci_issue_next(d, req, slot);
+                continue;
+            }
+            if(!req->failed && req->is_write && !d->ncq && !req->flushing && req->slots == (1u << slot)) {
+                // flush the drive cache once the last non-queued write is done
+                req->flushing = true;
+                ahci_issue_next(d, req, slot);
+                continue;
+            }
+            d->slot_reqs[slot] = NULL;
+            d->slots_async &= ~(1 << slot);
+            d->slots_busy &= ~(1 << slot);
+            req->slots &= ~(1 << slot);
+            if(req->slots == 0) {
+                release(&d->lk);
+                req->done(req, req->failed ? -1 : 0);
+                acquire(&d->lk);
+            }
+        }
+    }
+}
+
+static void ahci_irq_handler(trapframe* tf)
+{
+    UNUSED_ARG(tf);
+    uint32_t is = ahci.hba->is;
+    for(uint32_t i=0; i<ahci.drive_count; i++) {
+        ahci_drive* d = &ahci.drives[i];
+        if(is & (1 << d->port_no)) {
+            acquire(&d->lk);
+            ahci_port_interrupt(d);
+            ahci_complete_async(d);
+            release(&d->lk);
+            wakeup(d);
+        }
+    }
+    ahci.hba->is = is;
+}
+
+// Describe a virtually contiguous kernel buffer, merging physically contiguous pages
+//
+// return: number of PRDT entries used, negative if too fragmented
+static int ahci_build_prdt(ahci_cmd_table* table, void* buf, uint32_t byte_count)
+{
+    int n = 0;
+    uint32_t vaddr = (uint32_t) buf;
+    while(byte_count > 0) {
+        uint32_t size = PAGE_SIZE - (vaddr & (PAGE_SIZE - 1));
+        if(size > byte_count) {
+            size = byte_count;
+        }
+        uint32_t paddr = vaddr2paddr(curr_page_dir(), vaddr);
+        if(n > 0 && table->prdt[n-1].dba + table->prdt[n-1].dbc + 1 == paddr) {
+            table->prdt[n-1].dbc += size;
+        } else {
+            if(n == AHCI_PRDT_ENTRIES) {
+                return -1;
+            }
+            table->prdt[n] = (ahci_prd_entry) {.dba = paddr, .dbau = 0, .dbc = size - 1};
+            n++;
+        }
+        vaddr += size;
+        byte_count -= size;
+    }
+    return n;
+}
+
+static int ahci_alloc_slot(ahci_drive* d)
+{
+    for(uint32_t slot=0; slot<d->slot_count; slot++) {
+        if(!(d->slots_busy & (1 << slot))) {
+            d->slots_busy |= (1 << slot);
+            d->slots_failed &= ~(1 << slot);
+            return slot;
+        }
+    }
+    return -1;
+}
+
+// Fill the command slot and issue it to the drive
+//
+// return: zero = success, otherwise failed
+static int ahci_issue(ahci_drive* d, int slot, uint8_t command, uint64_t LBA, uint32_t sector_count, void* buf, uint32_t byte_count, bool is_write)
+{
+    ahci_cmd_header* header = &d->cmd_list[slot];
+    ahci_cmd_table* table = &d->cmd_tables[slot];
+    memset(table, 0, sizeof(ahci_cmd_table));
+
+    int prdtl = ahci_build_prdt(table, buf, byte_count);
+    if(prdtl < 0) {
+        return -1;
+    }
+    header->flags = (sizeof(fis_reg_h2d) / 4) | (is_write ? AHCI_CMD_HEADER_WRITE : 0);
+    header->prdtl = prdtl;
+    header->prdbc = 0;
+
+    bool queued = command == ATA_CMD_READ_FPDMA_QUEUED || command == ATA_CMD_WRITE_FPDMA_QUEUED;
+    fis_reg_h2d* fis = (fis_reg_h2d*) table->cfis;
+    fis->fis_type = FIS_TYPE_REG_H2D;
+    fis->flags = 0x80;
+    fis->command = command;
+    fis->device = ATA_DEVICE_LBA;
+    fis->lba0 = (uint8_t) LBA;
+    fis->lba1 = (uint8_t) (LBA >> 8);
+    fis->lba2 = (uint8_t) (LBA >> 16);
+    fis->lba3 = (uint8_t) (LBA >> 24);
+    fis->lba4 = (uint8_t) (LBA >> 32);
+    fis->lba5 = (uint8_t) (LBA >> 40);
+    if(queued) {
+        // sector count goes to the feature field, tag to the count field
+        fis->feature_lo = (uint8_t) sector_count;
+        fis->feature_hi = (uint8_t) (sector_count >> 8);
+        fis->count_lo = (uint8_t) (slot << 3);
+        if(is_write) {
+            // NCQ writes are not followed by a cache flush, force them to the media instead
+            fis->device |= ATA_DEVICE_FUA;
+        }
+        d->port->sact = (1 << slot);
+    } else {
+        fis->count_lo = (uint8_t) sector_count;
+        fis->count_hi = (uint8_t) (sector_count >> 8);
+    }
+    d->port->ci = (1 << slot);
+    return 0;
+}
+
+// Wait until some of the slots in *issued are done, d->lk shall be held
+//
+// return: zero = all completed commands succeeded, otherwise failed
+static int ahci_wait_any(ahci_drive* d, uint32_t* issued)
+{
+    uint32_t done;
+    while(1) {
+        done = *issued & ~(d->port->ci | d->port->sact);
+        if(done) {
+            break;
+        }
+        if(curr_proc() != NULL) {
+            sleep(d, &d->lk);
+        } else {
+            // polling during kernel initialization
+            ahci_port_interrupt(d);
+        }
+    }
+    int res = 0;
+    if(d->slots_failed & done) {
+        res = -1;
+    }
+    *issued &= ~done;
+    d->slots_busy &= ~done;
+    // other processes may be waiting for a free slot
+    wakeup(d);
+    return res;
+}
+
+static uint8_t ahci_rw_command(ahci_drive* d, bool is_write)
+{
+    if(d->ncq) {
+        return is_write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED;
+    }
+    return is_write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+}
+
+// Transfer sectors in commands of at most AHCI_MAX_SECTORS_PER_CMD, keeping as many outstanding as slots allow
+static int ahci_rw(ahci_drive* d, uint8_t* buf, uint64_t LBA, uint32_t sector_count, bool is_write)
+{
+    uint8_t command = ahci_rw_command(d, is_write);
+    int res = 0;
+    uint32_t issued = 0;
+    acquire(&d->lk);
+    while(sector_count > 0 || issued) {
+        if(sector_count > 0 && res == 0) {
+            int slot = ahci_alloc_slot(d);
+            if(slot >= 0) {
+                uint32_t count = sector_count < AHCI_MAX_SECTORS_PER_CMD ? sector_count : AHCI_MAX_SECTORS_PER_CMD;
+                if(ahci_issue(d, slot, command, LBA, count, buf, count*512, is_write) < 0) {
+                    d->slots_busy &= ~(1 << slot);
+                    res = -1;
+                    continue;
+                }
+                issued |= (1 << slot);
+                LBA += count;
+                sector_count -= count;
+                buf += count*512;
+                continue;
+            }
+            if(!issued) {
+                // all slots taken by other processes
+                sleep(d, &d->lk);
+                continue;
+            }
+        } else if(!issued) {
+            // stop issuing after an error
+            break;
+        }
+        if(ahci_wait_any(d, &issued) < 0) {
+            res = -1;
+        }
+    }
+
+    if(res == 0 && is_write && !d->ncq) {
+        int slot;
+        while((slot = ahci_alloc_slot(d)) < 0) {
+            sleep(d, &d->lk);
+        }
+        ahci_issue(d, slot, ATA_CMD_FLUSH_CACHE_EXT, 0, 0, NULL, 0, false);
+        issued = (1 << slot);
+        res = ahci_wait_any(d, &issued);
+    }
+    release(&d->lk);
+    return res;
+}
+
+static int ahci_identify(ahci_drive* d, uint16_t* identifier)
+{
+    acquire(&d->lk);
+    int slot = ahci_alloc_slot(d);
+    PANIC_ASSERT(slot >= 0);
+    int res = ahci_issue(d, slot, ATA_CMD_IDENTIFY, 0, 0, identifier, 512, false);
+    if(res == 0) {
+        uint32_t issued = (1 << slot);
+        res = ahci_wait_any(d, &issued);
+    } else {
+        d->slots_busy &= ~(1 << slot);
+    }
+    release(&d->lk);
+    return res;
+}
+
+static void ahci_init_port(uint32_t port_no)
+{
+    hba_port* port = &ahci.hba->ports[port_no];
+    uint32_t ssts = port->ssts;
+    if((ssts & 0x0F) != AHCI_SSTS_DET_PRESENT || ((ssts >> 8) & 0x0F) != AHCI_SSTS_IPM_ACTIVE) {
+        return;
+    }
+    if(port->sig != SATA_SIG_ATA) {
+        printf("AHCI: Port %u signature 0x%x not supported\n", port_no, port->sig);
+        return;
+    }
+    if(ahci.drive_count == AHCI_MAX_DRIVES) {
+        printf("AHCI: Too many drives, port %u ignored\n", port_no);
+        return;
+    }
+
+    ahci_drive* d = &ahci.drives[ahci.drive_count];
+    memset(d, 0, sizeof(*d));
+    d->port = port;
+    d->port_no = port_no;
+    d->slot_count = AHCI_CAP_NCS(ahci.hba->cap);
+
+    ahci_stop_port(port);
+
+    // Command list (1K) and received FIS (256 bytes) share a page
+    uint32_t phy_addr;
+    uint8_t* page = (uint8_t*) alloc_pages_consecutive_frames(curr_page_dir(), 1, true, &phy_addr);
+    memset(page, 0, PAGE_SIZE);
+    d->cmd_list = (ahci_cmd_header*) page;
+    port->clb = phy_addr;
+    port->clbu = 0;
+    port->fb = phy_addr + 1024;
+    port->fbu = 0;
+
+    uint32_t table_pages = PAGE_COUNT_FROM_BYTES(32*sizeof(ahci_cmd_table));
+    d->cmd_tables = (ahci_cmd_table*) alloc_pages_consecutive_frames(curr_page_dir(), table_pages, true, &d->cmd_tables_phy_addr);
+    memset(d->cmd_tables, 0, table_pages*PAGE_SIZE);
+    for(uint32_t slot=0; slot<32; slot++) {
+        d->cmd_list[slot].ctba = d->cmd_tables_phy_addr + slot*sizeof(ahci_cmd_table);
+        d->cmd_list[slot].ctbau = 0;
+    }
+
+    port->serr = 0xFFFFFFFF;
+    port->is = 0xFFFFFFFF;
+    port->ie = AHCI_PxIS_DHRS | AHCI_PxIS_PSS | AHCI_PxIS_SDBS | AHCI_PxIS_ERRORS;
+    ahci_start_port(port);
+
+    uint16_t* identifier = kmalloc(512);
+    if(ahci_identify(d, identifier) < 0) {
+        printf("AHCI: Port %u IDENTIFY failed\n", port_no);
+        kfree(identifier);
+        return;
+    }
+    if(identifier[83] & (1 << 10)) {
+        // LBA48 supported
+        d->sector_count = *(uint64_t*) &identifier[100];
+    } else {
+        d->sector_count = *(uint32_t*) &identifier[60];
+    }
+    if((ahci.hba->cap & AHCI_CAP_SNCQ) && (identifier[76] & (1 << 8))) {
+        d->ncq = true;
+        uint32_t depth = (identifier[75] & 0x1F) + 1;
+        if(depth < d->slot_count) {
+            d->slot_count = depth;
+        }
+    }
+    kfree(identifier);
+
+    printf("AHCI: Port %u SATA drive, %u sectors, NCQ[%u], queue depth %u\n",
+        port_no, (uint32_t) d->sector_count, d->ncq, d->slot_count);
+    ahci.drive_count++;
+}
+
+void init_ahci(uint8_t bus, uint8_t device, uint8_t function)
+{
+    if(ahci.initialized) {
+        // only support one AHCI controller
+        return;
+    }
+
+    uint16_t command = PCI_COMMAND(bus, device, function);
+    command |= PCI_COMMAND_BUS_MASTER | PCI_COMMAND_MEMORY_SPACE;
+    command &= ~PCI_COMMAND_INT_DISABLE;
+    PCI_W_COMMAND(bus, device, function, command);
+
+    // ABAR (AHCI Base Memory Register) is BAR5
+    uint32_t abar = PCI_BAR_5(bus, device, function) & ~0xF;
+    ahci.hba = (hba_mem*) pci_map_mmio(abar, sizeof(hba_mem));
+    if(ahci.hba == NULL) {
+        return;
+    }
+    ahci.hba->ghc |= AHCI_GHC_AE;
+    printf("AHCI: ABAR 0x%x, version 0x%x, %u command slots\n", abar, ahci.hba->vs, AHCI_CAP_NCS(ahci.hba->cap));
+
+    uint8_t irq = PCI_INT_LINE(bus, device, function);
+    register_shared_irq_handler(irq, ahci_irq_handler);
+    IRQ_clear_mask(irq);
+
+    uint32_t pi = ahci.hba->pi;
+    for(uint32_t port_no=0; port_no<32; port_no++) {
+        if(pi & (1 << port_no)) {
+            ahci_init_port(port_no);
+        }
+    }
+
+    ahci.hba->is = 0xFFFFFFFF;
+    ahci.hba->ghc |= AHCI_GHC_IE;
+    ahci.initialized = true;
+}
+
+uint32_t ahci_drive_count()
+{
+    return ahci.drive_count;
+}
+
+uint64_t ahci_sector_count(uint32_t drive)
+{
+    PANIC_ASSERT(drive < ahci.drive_count);
+    return ahci.drives[drive].sector_count;
+}
+
+// Read sectors from a SATA drive, buf shall be kernel memory
+//
+// return: zero = success, otherwise failed
+int ahci_read_sectors(uint32_t drive, void* buf, uint64_t LBA, uint32_t sector_count)
+{
+    PANIC_ASSERT(drive < ahci.drive_count);
+    return ahci_rw(&ahci.drives[drive], (uint8_t*) buf, LBA, sector_count, false);
+}
+
+// Write sectors to a SATA drive, buf shall be kernel memory
+//
+// return: zero = success, otherwise failed
+int ahci_write_sectors(uint32_t drive, const void* buf, uint64_t LBA, uint32_t sector_count)
+{
+    PANIC_ASSERT(drive < ahci.drive_count);
+    return ahci_rw(&ahci.drives[drive], (uint8_t*) buf, LBA, sector_count, true);
+}
+
+// Commands a drive can have outstanding at once
+uint32_t ahci_queue_depth(uint32_t drive)
+{
+    PANIC_ASSERT(drive < ahci.drive_count);
+    return ahci.drives[drive].slot_count;
+}
+
+// Issue the next command of an asynchronous request in the slot: a part of the transfer, or the cache flush
+// On failure the slot is still accounted to the request and completed right away, d->lk shall be held
+static void ahci_issue_next(ahci_drive* d, ahci_request* req, int slot)
+{
+    d->slot_reqs[slot] = req;
+    d->slots_async |= (1 << slot);
+    req->slots |= (1 << slot);
+    int res;
+    if(req->flushing) {
+        res = ahci_issue(d, slot, ATA_CMD_FLUSH_CACHE_EXT, 0, 0, NULL, 0, false);
+    } else {
+        uint32_t count = req->sector_count - req->issued;
+        if(count > AHCI_MAX_SECTORS_PER_CMD) {
+            count = AHCI_MAX_SECTORS_PER_CMD;
+        }
+        res = ahci_issue(d, slot, ahci_rw_command(d, req->is_write), req->LBA + req->issued, count,
+            (uint8_t*) req->buf + req->issued*512, count*512, req->is_write);
+        req->issued += count;
+    }
+    if(res < 0) {
+        // never issued, so the slot is not busy at the port and shows as done
+        req->failed = true;
+    }
+}
+
+// Start a transfer and return without waiting for it, its commands are issued in as many free slots as needed
+// req->done is called from interrupt context once finished, req->buf shall be kernel memory
+// since the transfer may complete in another process
+//
+// return: zero = started, -EAGAIN if no command slot is free, otherwise failed
+int ahci_submit_sectors(ahci_request* req)
+{
+    PANIC_ASSERT(req->drive < ahci.drive_count);
+    PANIC_ASSERT(req->sector_count > 0);
+    ahci_drive* d = &ahci.drives[req->drive];
+    acquire(&d->lk);
+    int slot = ahci_alloc_slot(d);
+    if(slot < 0) {
+        release(&d->lk);
+        return -EAGAIN;
+    }
+    req->issued = 0;
+    req->slots = 0;
+    req->failed = false;
+    req->flushing = false;
+    ahci_issue_next(d, req, slot);
+    if(req->failed) {
+        d->slot_reqs[slot] = NULL;
+        d->slots_async &= ~(1 << slot);
+        d->slots_busy &= ~(1 << slot);
+        release(&d->lk);
+        return -1;
+    }
+    // a later command failing to be issued is completed along with the outstanding ones
+    while(!req->failed && req->issued < req->sector_count && (slot = ahci_alloc_slot(d)) >= 0) {
+        ahci_issue_next(d, req, slot);
+    }
+    release(&d->lk);
+    return 0;
+}
@@ -10,6 +10,7 @@
 #include <kernel/timer.h>
 #include <kernel/keyboard.h>
 #include <kernel/video.h>
+#include <kernel/ata.h>
 
 
 // x86-32 architecture specific initialization sequence
@@ -51,6 +52,9 @@ void initialize_architecture(uint32_t mbt_physical_addr) {
     // initialize keyboard interrupt handler
     init_keyboard();
 
+    // Register ATA IRQ handler and enable drive interrupts
+    init_ata();
+
     // Enable interruptions (it was disabled by the bootloader)
     // Commenting out, because here we not yet ready to do process/context switching based on PIT interrupt
     // We will enable interrupt when entering user mode
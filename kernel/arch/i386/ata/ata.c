@@ -1,9 +1,17 @@
+#include <string.h>
+#include <stdio.h>
 #include <kernel/ata.h>
 #include <kernel/lock.h>
 #include <kernel/process.h>
+#include <kernel/paging.h>
+#include <kernel/pci.h>
+#include <kernel/cpu.h>
+#include <kernel/panic.h>
 #include <arch/i386/kernel/port_io.h>
+#include <arch/i386/kernel/isr.h>
+#include <arch/i386/kernel/pic.h>
 
-// 28 bit ATA PIO disk driver
+// 28 bit ATA PIO disk driver, for the four drives on the primary and secondary IDE channels
 // From http://learnitonweb.com/2020/05/22/12-developing-an-operating-system-tutorial-episode-6-ata-pio-driver-osdev/
 // Source - https://wiki.osdev.org/ATA_PIO_Mode#x86_Directions
 
@@ -24,34 +32,129 @@ ERR: a 1 indicates that an error occured. An error code has been placed in the e
 #define STATUS_DF 0x20
 #define STATUS_ERR 0x01
 
-static yield_lock ata_lock;
+// Task file registers, offset from the I/O base of the channel
+#define ATA_REG_DATA 0
+#define ATA_REG_SECCOUNT 2
+#define ATA_REG_LBA_LO 3
+#define ATA_REG_LBA_MID 4
+#define ATA_REG_LBA_HI 5
+#define ATA_REG_DRIVE 6
+#define ATA_REG_STATUS 7 // reading
+#define ATA_REG_COMMAND 7 // writing
 
-static void ATA_wait_BSY();
-static void ATA_wait_DRQ();
-static void ATA_delay_400ns();
+// Bus Master IDE registers, offset from the I/O base in BAR4 (plus 8 for the secondary channel)
+// Ref: https://wiki.osdev.org/ATA/ATAPI_using_DMA
+#define BMIDE_COMMAND 0x0
+#define BMIDE_STATUS 0x2
+#define BMIDE_PRDT 0x4
 
-// Read sectors from the primary ATA device using 28bit PIO method 
+#define BMIDE_CMD_START 0x01
+// Direction is from the bus master's point of view, set for disk => memory (reading)
+#define BMIDE_CMD_READ 0x08
+
+#define BMIDE_STATUS_ACTIVE 0x01
+#define BMIDE_STATUS_ERR 0x02
+#define BMIDE_STATUS_IRQ 0x04
+
+// ATA commands
+#define ATA_CMD_READ_DMA 0xC8
+#define ATA_CMD_WRITE_DMA 0xCA
+#define ATA_CMD_CACHE_FLUSH 0xE7
+
+// Physical Region Descriptor, one entry of the PRD table
+// A region shall not cross a 64KiB boundary
+typedef struct prd_entry {
+    uint32_t phy_addr;
+    uint16_t byte_count; // 0 means 64KiB
+    uint16_t flags;
+} __attribute__ ((packed)) prd_entry;
+
+#define PRD_END_OF_TABLE 0x8000
+
+// One DMA command can transfer at most 256 sectors
+#define ATA_DMA_MAX_SECTORS 256
+#define ATA_DMA_BUF_SIZE (ATA_DMA_MAX_SECTORS*512)
+
+// A drive number is 0 to 3: primary master/slave, then secondary master/slave
+#define ATA_CHANNEL_COUNT 2
+#define ATA_DRIVE_CHANNEL(drive) (&ata_channels[(drive) >> 1])
+#define ATA_DRIVE_IS_SLAVE(drive) ((drive) & 1)
+
+// DMA commands of a channel are queued and run one after another, each step completed by the channel IRQ,
+// so callers do not have to wait for the drive (see submit_sectors_ATA_DMA())
+// The channel is lent to PIO commands in between, see ATA_channel_acquire()
+typedef struct ATA_DMA_engine {
+    bool available;
+    uint16_t bmide_base;
+    prd_entry* prdt;
+    uint32_t prdt_phy_addr;
+    uint8_t* buf; // physically contiguous bounce buffer
+    uint32_t buf_phy_addr;
+    ATA_DMA_request* active; // request being transferred
+    ATA_DMA_request* queue_head; // requests waiting for the channel
+    ATA_DMA_request* queue_tail;
+    uint32_t chunk; // sectors of the DMA command in progress
+    bool flushing; // cache flush issued after the last chunk of a write
+} ATA_DMA_engine;
+
+// Commands are issued with interrupt disabled, and the issuing process sleeps
+// until the IRQ handler flags the completion, so the CPU is free for other processes
+// The two channels are independent, each with its own lock and DMA queue,
+// so drives on different channels transfer at the same time
+typedef struct ATA_channel {
+    uint16_t io_base; // task file registers
+    uint16_t control; // Device Control Register, writing 0 clears nIEN to enable drive interrupts
+    uint8_t irq; // raised when a command (or one sector of a PIO command) completes
+    sleep_lock lk; // serializing commands on the channel, not disabling interrupt while held
+    volatile uint cmd_pending; // a command has been issued and is waiting for IRQ
+    volatile uint irq_received;
+    ATA_DMA_engine dma;
+} ATA_channel;
+
+static ATA_channel ata_channels[ATA_CHANNEL_COUNT] = {
+    {.io_base = 0x1F0, .control = 0x3F6, .irq = 14},
+    {.io_base = 0x170, .control = 0x376, .irq = 15}
+};
+
+static void ATA_wait_BSY(ATA_channel* ch);
+static void ATA_wait_DRQ(ATA_channel* ch);
+static void ATA_delay_400ns(ATA_channel* ch);
+static void ATA_issue_begin(ATA_channel* ch);
+static void ATA_issue_end(ATA_channel* ch);
+static void ATA_wait_IRQ(ATA_channel* ch);
+static void ata_primary_irq_handler(trapframe* tf);
+static void ata_secondary_irq_handler(trapframe* tf);
+static void ATA_channel_acquire(ATA_channel* ch);
+static void ATA_channel_release(ATA_channel* ch);
+static void ATA_DMA_kick(ATA_channel* ch);
+static void ATA_DMA_step(ATA_channel* ch);
+static void ATA_DMA_poll(ATA_channel* ch);
+
+// Read sectors from an ATA device using 28bit PIO method 
 //
+// drive: 0 to 3, primary master/slave then secondary master/slave
 // target: a buffer at least sector_count*512 bytes long 
 // LBA: 0-based Linear Block Address, 28bit LBA shall be between 0 to 0x0FFFFFFF
 // sector_count: How many sectors you want to read. A sectorcount of 0 means 256 sectors = 128K
 //
-static void read_sectors_ATA_28bit_PIO(bool slave, uint16_t* target, uint32_t LBA, uint8_t sector_count) {
-    acquire(&ata_lock);
+static void read_sectors_ATA_28bit_PIO(uint8_t drive, uint16_t* target, uint32_t LBA, uint8_t sector_count) {
+    ATA_channel* ch = ATA_DRIVE_CHANNEL(drive);
+    ATA_channel_acquire(ch);
+    ATA_issue_begin(ch);
 
-    ATA_wait_BSY();
-    // Send 0xE0 for the "master" or 0xF0 for the "slave", ORed with the highest 4 bits of the LBA to port 0x1F6: outb(0x1F6, 0xE0 | (slavebit << 4) | ((LBA >> 24) & 0x0F))
-    outb(0x1F6, 0xE0 | (slave << 4) | ((LBA >> 24) & 0xF));
+    ATA_wait_BSY(ch);
+    // Send 0xE0 for the "master" or 0xF0 for the "slave", ORed with the highest 4 bits of the LBA to the drive register (0x1F6 for primary channel)
+    outb(ch->io_base + ATA_REG_DRIVE, 0xE0 | (ATA_DRIVE_IS_SLAVE(drive) << 4) | ((LBA >> 24) & 0xF));
     // Send the sectorcount to port 0x1F2: outb(0x1F2, (unsigned char) count)
-    outb(0x1F2, sector_count);
+    outb(ch->io_base + ATA_REG_SECCOUNT, sector_count);
     // Send the low 8 bits of the LBA to port 0x1F3: outb(0x1F3, (unsigned char) LBA))
-    outb(0x1F3, (uint8_t)LBA);
+    outb(ch->io_base + ATA_REG_LBA_LO, (uint8_t)LBA);
     // Send the next 8 bits of the LBA to port 0x1F4: outb(0x1F4, (unsigned char)(LBA >> 8))
-    outb(0x1F4, (uint8_t)(LBA >> 8));
+    outb(ch->io_base + ATA_REG_LBA_MID, (uint8_t)(LBA >> 8));
     // Send the next 8 bits of the LBA to port 0x1F5: outb(0x1F5, (unsigned char)(LBA >> 16))
-    outb(0x1F5, (uint8_t)(LBA >> 16));
+    outb(ch->io_base + ATA_REG_LBA_HI, (uint8_t)(LBA >> 16));
     // Send the "READ SECTORS" command (0x20) to port 0x1F7: outb(0x1F7, 0x20)
-    outb(0x1F7, 0x20); //Send the read command
+    outb(ch->io_base + ATA_REG_COMMAND, 0x20); //Send the read command
     
     int count;
     if(sector_count == 0) {
@@ -61,28 +164,28 @@ static void read_sectors_ATA_28bit_PIO(bool slave, uint16_t* target, uint32_t LB
     }
 
     for (int j = 0;j < count;j++) {
-        // Poll for status
-        ATA_delay_400ns();
-        ATA_wait_BSY();
-        ATA_wait_DRQ();
+        // The drive raises IRQ when each sector is ready to be read
+        ATA_wait_IRQ(ch);
+        ATA_wait_DRQ(ch);
         // Transfer 256 16-bit values, a uint16_t at a time, into your buffer from I/O port 0x1F0. (In assembler, REP INSW works well for this.)
         for (int i = 0;i < 256;i++)
-            target[i] = inw(0x1F0);
+            target[i] = inw(ch->io_base + ATA_REG_DATA);
         target += 256;
     }
 
-    release(&ata_lock);
+    ATA_issue_end(ch);
+    ATA_channel_release(ch);
 }
 
-void read_sectors_ATA_PIO(bool slave, void* buf, uint32_t LBA, uint32_t sector_count)
+void read_sectors_ATA_PIO(uint8_t drive, void* buf, uint32_t LBA, uint32_t sector_count)
 {
     while(sector_count) {
         if(sector_count < 256) {
-            read_sectors_ATA_28bit_PIO(slave, (uint16_t*) buf, LBA, sector_count);
+            read_sectors_ATA_28bit_PIO(drive, (uint16_t*) buf, LBA, sector_count);
             return;
         } else {
             // read 256 sectors
-            read_sectors_ATA_28bit_PIO(slave, (uint16_t*) buf, LBA, 0);
+            read_sectors_ATA_28bit_PIO(drive, (uint16_t*) buf, LBA, 0);
             LBA += 256;
             sector_count -= 256;
             buf += 256*512;
@@ -90,23 +193,26 @@ void read_sectors_ATA_PIO(bool slave, void* buf, uint32_t LBA, uint32_t sector_c
     }
 }
 
-// Write sectors to the primary ATA device using 28bit PIO method 
+// Write sectors to an ATA device using 28bit PIO method 
 // 
+// drive: 0 to 3, primary master/slave then secondary master/slave
 // LBA: 0-based Linear Block Address, 28bit LBA shall be between 0 to 0x0FFFFFFF
 // sector_count: How many sectors you want to write
 // source: a buffer whose length is sector_count*512 bytes 
 //
-static void write_sectors_ATA_28bit_PIO(bool slave, uint32_t LBA, uint8_t sector_count, uint16_t* source) {
-    acquire(&ata_lock);
-
-    ATA_wait_BSY();
-    outb(0x1F6, 0xE0 | (slave << 4) | ((LBA >> 24) & 0xF));
-    outb(0x1F2, sector_count);
-    outb(0x1F3, (uint8_t)LBA);
-    outb(0x1F4, (uint8_t)(LBA >> 8));
-    outb(0x1F5, (uint8_t)(LBA >> 16));
+static void write_sectors_ATA_28bit_PIO(uint8_t drive, uint32_t LBA, uint8_t sector_count, uint16_t* source) {
+    ATA_channel* ch = ATA_DRIVE_CHANNEL(drive);
+    ATA_channel_acquire(ch);
+    ATA_issue_begin(ch);
+
+    ATA_wait_BSY(ch);
+    outb(ch->io_base + ATA_REG_DRIVE, 0xE0 | (ATA_DRIVE_IS_SLAVE(drive) << 4) | ((LBA >> 24) & 0xF));
+    outb(ch->io_base + ATA_REG_SECCOUNT, sector_count);
+    outb(ch->io_base + ATA_REG_LBA_LO, (uint8_t)LBA);
+    outb(ch->io_base + ATA_REG_LBA_MID, (uint8_t)(LBA >> 8));
+    outb(ch->io_base + ATA_REG_LBA_HI, (uint8_t)(LBA >> 16));
     // To write sectors in 28 bit PIO mode, send command "WRITE SECTORS" (0x30) to the Command port
-    outb(0x1F7, 0x30); //Send the write command
+    outb(ch->io_base + ATA_REG_COMMAND, 0x30); //Send the write command
 
     int count;
     if(sector_count == 0) {
@@ -116,31 +222,35 @@ static void write_sectors_ATA_28bit_PIO(bool slave, uint32_t LBA, uint8_t sector
     }
 
     for (int j = 0;j < count;j++) {
-        ATA_wait_BSY();
-        ATA_wait_DRQ();
+        ATA_wait_BSY(ch);
+        ATA_wait_DRQ(ch);
         for (int i = 0;i < 256;i++) {
             // Do not use REP OUTSW to transfer data. There must be a tiny delay between each OUTSW output uint16_t. A jmp $+2 size of delay
-            outw(0x1F0, source[i]);
+            outw(ch->io_base + ATA_REG_DATA, source[i]);
             io_wait();
         }
         source += 256;
+        // The drive raises IRQ when each sector is written
+        ATA_wait_IRQ(ch);
     }
 
     // Make sure to do a Cache Flush (ATA command 0xE7) after each write command completes.
-    outb(0x1F7, 0xE7);
+    outb(ch->io_base + ATA_REG_COMMAND, ATA_CMD_CACHE_FLUSH);
+    ATA_wait_IRQ(ch);
 
-    release(&ata_lock);
+    ATA_issue_end(ch);
+    ATA_channel_release(ch);
 }
 
-void write_sectors_ATA_PIO(bool slave, const void* buf, uint32_t LBA, uint32_t sector_count)
+void write_sectors_ATA_PIO(uint8_t drive, const void* buf, uint32_t LBA, uint32_t sector_count)
 {
     while(sector_count) {
         if(sector_count < 256) {
-            write_sectors_ATA_28bit_PIO(slave, LBA, sector_count, (uint16_t*) buf);
+            write_sectors_ATA_28bit_PIO(drive, LBA, sector_count, (uint16_t*) buf);
             return;
         } else {
             // read 256 sectors
-            write_sectors_ATA_28bit_PIO(slave, LBA, 0, (uint16_t*) buf);
+            write_sectors_ATA_28bit_PIO(drive, LBA, 0, (uint16_t*) buf);
             LBA += 256;
             sector_count -= 256;
             buf += 256*512;
@@ -148,32 +258,358 @@ void write_sectors_ATA_PIO(bool slave, const void* buf, uint32_t LBA, uint32_t s
     }
 }
 
+// Enable interrupt driven completion for both channels
+void init_ata()
+{
+    register_interrupt_handler(IRQ_TO_INTERRUPT(ata_channels[0].irq), ata_primary_irq_handler);
+    register_interrupt_handler(IRQ_TO_INTERRUPT(ata_channels[1].irq), ata_secondary_irq_handler);
+    for(int i=0; i<ATA_CHANNEL_COUNT; i++) {
+        IRQ_clear_mask(ata_channels[i].irq);
+        outb(ata_channels[i].control, 0);
+    }
+}
+
+// Set up the PCI IDE controller for bus master DMA
+// Only channels in compatibility mode (ports 0x1F0-0x1F7 and 0x170-0x177) are driven
+void init_ata_dma(uint8_t bus, uint8_t device, uint8_t function)
+{
+    static bool controller_found = false;
+    if(controller_found) {
+        // only support one IDE controller
+        return;
+    }
+    controller_found = true;
+
+    uint32_t bar4 = PCI_BAR_4(bus, device, function);
+    if(!(bar4 & 1)) {
+        printf("ATA DMA: BAR4 is not I/O space, DMA disabled\n");
+        return;
+    }
+
+    uint16_t command = PCI_COMMAND(bus,device,function);
+    command |= PCI_COMMAND_BUS_MASTER; // Enable PCI Bus Mastering
+    PCI_W_COMMAND(bus, device, function, command);
+
+    uint8_t prog_if = PCI_PROG_IF(bus, device, function);
+    for(int i=0; i<ATA_CHANNEL_COUNT; i++) {
+        ATA_DMA_engine* dma = &ata_channels[i].dma;
+        // bit 0 (primary) / bit 2 (secondary) set means the channel is in PCI native mode, ports not at the legacy address
+        if(prog_if & (1 << (2*i))) {
+            printf("ATA DMA: Channel %d in native mode, DMA disabled\n", i);
+            continue;
+        }
+        dma->bmide_base = ((bar4 & ~0x3) & 0xFFFF) + 8*i;
+        // PRDT shall be 4 bytes aligned and not cross 64KiB boundary, a page satisfies both
+        dma->prdt = (prd_entry*) alloc_pages_consecutive_frames(curr_page_dir(), 1, true, &dma->prdt_phy_addr);
+        memset(dma->prdt, 0, PAGE_SIZE);
+        dma->buf = (uint8_t*) alloc_pages_consecutive_frames(curr_page_dir(), PAGE_COUNT_FROM_BYTES(ATA_DMA_BUF_SIZE), true, &dma->buf_phy_addr);
+        dma->available = true;
+
+        printf("ATA DMA: Channel %d Bus Master IDE base I/O port: 0x%x\n", i, dma->bmide_base);
+    }
+}
+
+// Fill the PRD table to describe a physically contiguous buffer
+static void ATA_build_prdt(ATA_DMA_engine* dma, uint32_t phy_addr, uint32_t byte_count)
+{
+    uint idx = 0;
+    while(byte_count > 0) {
+        // split the region at 64KiB boundaries
+        uint32_t region_size = 0x10000 - (phy_addr & 0xFFFF);
+        if(region_size > byte_count) {
+            region_size = byte_count;
+        }
+        dma->prdt[idx] = (prd_entry) {
+            .phy_addr = phy_addr,
+            .byte_count = (uint16_t) region_size,
+            .flags = 0
+        };
+        phy_addr += region_size;
+        byte_count -= region_size;
+        idx++;
+    }
+    dma->prdt[idx-1].flags = PRD_END_OF_TABLE;
+}
+
+// Take the channel for a PIO command, waiting for the DMA request in progress to finish
+// Queued DMA requests are held back until ATA_channel_release()
+static void ATA_channel_acquire(ATA_channel* ch)
+{
+    acquire_sleep(&ch->lk);
+    push_cli();
+    while(ch->dma.active != NULL) {
+        if(curr_proc() != NULL) {
+            sleep(&ch->dma, NULL);
+        } else {
+            ATA_DMA_poll(ch);
+        }
+    }
+    pop_cli();
+}
+
+static void ATA_channel_release(ATA_channel* ch)
+{
+    release_sleep(&ch->lk);
+    push_cli();
+    ATA_DMA_kick(ch);
+    pop_cli();
+}
+
+// Wait for BSY to clear without yielding, usable in interrupt context
+static void ATA_spin_BSY(ATA_channel* ch)
+{
+    while(inb(ch->io_base + ATA_REG_STATUS) & STATUS_BSY);
+}
+
+// Issue the next chunk (up to ATA_DMA_MAX_SECTORS sectors) of the active request
+// Interrupt shall be disabled
+static void ATA_DMA_start_chunk(ATA_channel* ch)
+{
+    ATA_DMA_engine* dma = &ch->dma;
+    ATA_DMA_request* req = dma->active;
+    uint32_t remaining = req->sector_count - req->progress;
+    dma->chunk = remaining < ATA_DMA_MAX_SECTORS ? remaining : ATA_DMA_MAX_SECTORS;
+    uint32_t LBA = req->LBA + req->progress;
+    if(req->is_write) {
+        memmove(dma->buf, (uint8_t*) req->buf + req->progress*512, dma->chunk*512);
+    }
+
+    ATA_build_prdt(dma, dma->buf_phy_addr, dma->chunk*512);
+
+    // Stop bus master, set PRDT and direction, clear interrupt & error bits
+    outb(dma->bmide_base + BMIDE_COMMAND, 0);
+    outl(dma->bmide_base + BMIDE_PRDT, dma->prdt_phy_addr);
+    outb(dma->bmide_base + BMIDE_COMMAND, req->is_write ? 0 : BMIDE_CMD_READ);
+    uint8_t bm_status = inb(dma->bmide_base + BMIDE_STATUS);
+    outb(dma->bmide_base + BMIDE_STATUS, (bm_status & 0x60) | BMIDE_STATUS_ERR | BMIDE_STATUS_IRQ);
+
+    ATA_spin_BSY(ch);
+    outb(ch->io_base + ATA_REG_DRIVE, 0xE0 | (ATA_DRIVE_IS_SLAVE(req->drive) << 4) | ((LBA >> 24) & 0xF));
+    outb(ch->io_base + ATA_REG_SECCOUNT, (uint8_t) dma->chunk); // 256 is sent as 0
+    outb(ch->io_base + ATA_REG_LBA_LO, (uint8_t)LBA);
+    outb(ch->io_base + ATA_REG_LBA_MID, (uint8_t)(LBA >> 8));
+    outb(ch->io_base + ATA_REG_LBA_HI, (uint8_t)(LBA >> 16));
+    outb(ch->io_base + ATA_REG_COMMAND, req->is_write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA);
+
+    // Start the bus master
+    outb(dma->bmide_base + BMIDE_COMMAND, (req->is_write ? 0 : BMIDE_CMD_READ) | BMIDE_CMD_START);
+}
+
+// Start the next queued request if the channel is free, interrupt shall be disabled
+static void ATA_DMA_kick(ATA_channel* ch)
+{
+    ATA_DMA_engine* dma = &ch->dma;
+    if(dma->active != NULL || dma->queue_head == NULL || ch->lk.locked) {
+        return;
+    }
+    dma->active = dma->queue_head;
+    dma->queue_head = dma->active->next;
+    if(dma->queue_head == NULL) {
+        dma->queue_tail = NULL;
+    }
+    dma->active->next = NULL;
+    dma->flushing = false;
+    ATA_DMA_start_chunk(ch);
+}
+
+static void ATA_DMA_finish(ATA_channel* ch, int result)
+{
+    ATA_DMA_request* req = ch->dma.active;
+    ch->dma.active = NULL;
+    req->result = result;
+    req->finished = true;
+    // the callback may submit the next request, possibly reusing req
+    if(req->done != NULL) {
+        req->done(req, result);
+    }
+    wakeup(&ch->dma);
+    ATA_DMA_kick(ch);
+}
+
+// Advance the active request after the drive signaled completion of a step,
+// called from the IRQ handler or when polling, interrupt shall be disabled
+static void ATA_DMA_step(ATA_channel* ch)
+{
+    ATA_DMA_engine* dma = &ch->dma;
+    ATA_DMA_request* req = dma->active;
+    if(dma->flushing) {
+        // Reading the status register acknowledges the interrupt on the drive side
+        uint8_t status = inb(ch->io_base + ATA_REG_STATUS);
+        if(status & STATUS_BSY) {
+            return;
+        }
+        ATA_DMA_finish(ch, (status & (STATUS_ERR | STATUS_DF)) ? -1 : 0);
+        return;
+    }
+
+    uint8_t bm_status = inb(dma->bmide_base + BMIDE_STATUS);
+    if((bm_status & BMIDE_STATUS_ACTIVE) && !(bm_status & (BMIDE_STATUS_IRQ | BMIDE_STATUS_ERR))) {
+        // not from this transfer
+        return;
+    }
+    uint8_t status = inb(ch->io_base + ATA_REG_STATUS);
+    if(status & STATUS_BSY) {
+        return;
+    }
+    // Stop the bus master and acknowledge the interrupt/error bits
+    // Bits 5 and 6 (drive DMA capable) are read/write, keep them
+    outb(dma->bmide_base + BMIDE_COMMAND, 0);
+    outb(dma->bmide_base + BMIDE_STATUS, (bm_status & 0x60) | BMIDE_STATUS_ERR | BMIDE_STATUS_IRQ);
+    if((bm_status & BMIDE_STATUS_ERR) || (status & (STATUS_ERR | STATUS_DF))) {
+        ATA_DMA_finish(ch, -1);
+        return;
+    }
+
+    if(!req->is_write) {
+        memmove((uint8_t*) req->buf + req->progress*512, dma->buf, dma->chunk*512);
+    }
+    req->progress += dma->chunk;
+    if(req->progress < req->sector_count) {
+        ATA_DMA_start_chunk(ch);
+    } else if(req->is_write) {
+        // Make sure to do a Cache Flush after each write command completes
+        dma->flushing = true;
+        outb(ch->io_base + ATA_REG_COMMAND, ATA_CMD_CACHE_FLUSH);
+    } else {
+        ATA_DMA_finish(ch, 0);
+    }
+}
+
+// Check the active request without waiting for IRQ (no process to sleep during kernel initialization)
+static void ATA_DMA_poll(ATA_channel* ch)
+{
+    if(ch->dma.active != NULL) {
+        ATA_DMA_step(ch);
+    }
+}
+
+// Queue a DMA transfer on the channel of req->drive and return without waiting for it
+// req->done (if any) is called from interrupt context once the transfer finished,
+// req->buf shall be kernel memory since the transfer may complete in another process
+//
+// return: zero = queued, otherwise DMA not available
+int submit_sectors_ATA_DMA(ATA_DMA_request* req)
+{
+    PANIC_ASSERT(req->drive < ATA_DRIVE_COUNT);
+    ATA_channel* ch = ATA_DRIVE_CHANNEL(req->drive);
+    ATA_DMA_engine* dma = &ch->dma;
+    if(!dma->available) {
+        return -1;
+    }
+    PANIC_ASSERT(req->sector_count > 0);
+    push_cli();
+    req->finished = false;
+    req->result = 0;
+    req->progress = 0;
+    req->next = NULL;
+    if(dma->queue_tail != NULL) {
+        dma->queue_tail->next = req;
+    } else {
+        dma->queue_head = req;
+    }
+    dma->queue_tail = req;
+    ATA_DMA_kick(ch);
+    pop_cli();
+    return 0;
+}
+
+// Wait for a submitted DMA transfer to finish
+//
+// return: zero = success, otherwise failed
+int wait_sectors_ATA_DMA(ATA_DMA_request* req)
+{
+    ATA_channel* ch = ATA_DRIVE_CHANNEL(req->drive);
+    push_cli();
+    while(!req->finished) {
+        if(curr_proc() != NULL) {
+            sleep(&ch->dma, NULL);
+        } else {
+            ATA_DMA_poll(ch);
+        }
+    }
+    pop_cli();
+    return req->result;
+}
+
+// Read sectors from an ATA device using bus master DMA
+//
+// return: zero = success, otherwise failed (caller may retry with PIO)
+int read_sectors_ATA_DMA(uint8_t drive, void* buf, uint32_t LBA, uint32_t sector_count)
+{
+    ATA_DMA_request req = {.drive = drive, .is_write = false, .buf = buf, .LBA = LBA, .sector_count = sector_count};
+    if(sector_count == 0) {
+        return 0;
+    }
+    if(submit_sectors_ATA_DMA(&req) != 0) {
+        return -1;
+    }
+    return wait_sectors_ATA_DMA(&req);
+}
+
+// Write sectors to an ATA device using bus master DMA
+//
+// return: zero = success, otherwise failed (caller may retry with PIO)
+int write_sectors_ATA_DMA(uint8_t drive, const void* buf, uint32_t LBA, uint32_t sector_count)
+{
+    ATA_DMA_request req = {.drive = drive, .is_write = true, .buf = (void*) buf, .LBA = LBA, .sector_count = sector_count};
+    if(sector_count == 0) {
+        return 0;
+    }
+    if(submit_sectors_ATA_DMA(&req) != 0) {
+        return -1;
+    }
+    return wait_sectors_ATA_DMA(&req);
+}
+
+// Check if a drive can be driven by bus master DMA
+// Ref: IDENTIFY word 49 bit 8 (DMA supported)
+bool ATA_DMA_supported(uint8_t drive)
+{
+    if(!ATA_DRIVE_CHANNEL(drive)->dma.available) {
+        return false;
+    }
+    uint16_t identifier[256];
+    if(ATA_Identify(drive, identifier) != 0) {
+        return false;
+    }
+    return (identifier[49] & (1 << 8)) != 0;
+}
+
 // Execute ATA PIO IDENTIFY command
 // Ref: https://wiki.osdev.org/ATA_PIO_Mode#IDENTIFY_command
 // 
+// drive: 0 to 3, primary master/slave then secondary master/slave
 // target: a memory location to store the returned 512 bytes structure
 // 
 // return: zero = success, otherwise failed
 // 
-int8_t ATA_Identify(bool slave, uint16_t* target) {
+int8_t ATA_Identify(uint8_t drive, uint16_t* target) {
     int return_val;
+    ATA_channel* ch = ATA_DRIVE_CHANNEL(drive);
+
+    // IDENTIFY is only issued during initialization, poll instead of waiting for IRQ
+    ATA_channel_acquire(ch);
 
-    acquire(&ata_lock);
+    // A floating bus (no controller or no drive on the channel) reads 0xFF and would never clear BSY
+    if (inb(ch->io_base + ATA_REG_STATUS) == 0xFF) {
+        return_val = -1;
+        goto ret;
+    }
 
-    ATA_wait_BSY();
+    ATA_wait_BSY(ch);
     // select a target drive by sending 0xA0 for the master drive, or 0xB0 for the slave, to the "drive select" IO port (0x1F6)
-    outb(0x1F6, 0xA0 | (slave << 4));
+    outb(ch->io_base + ATA_REG_DRIVE, 0xA0 | (ATA_DRIVE_IS_SLAVE(drive) << 4));
     // Then set the Sectorcount, LBAlo, LBAmid, and LBAhi IO ports to 0 (port 0x1F2 to 0x1F5)
-    outb(0x1F2, 0);
-    outb(0x1F3, 0);
-    outb(0x1F4, 0);
-    outb(0x1F5, 0);
+    outb(ch->io_base + ATA_REG_SECCOUNT, 0);
+    outb(ch->io_base + ATA_REG_LBA_LO, 0);
+    outb(ch->io_base + ATA_REG_LBA_MID, 0);
+    outb(ch->io_base + ATA_REG_LBA_HI, 0);
     // Then send the IDENTIFY command (0xEC) to the Command IO port (0x1F7
-    outb(0x1F7, 0xEC);
+    outb(ch->io_base + ATA_REG_COMMAND, 0xEC);
 
     // Then read the Status port (0x1F7) again. If the value read is 0, the drive does not exist.
-    ATA_delay_400ns();
-    uint8_t status = inb(0x1F7);
+    ATA_delay_400ns(ch);
+    uint8_t status = inb(ch->io_base + ATA_REG_STATUS);
     if (status == 0) {
         return_val = -1;
         goto ret;
@@ -181,38 +617,38 @@ int8_t ATA_Identify(bool slave, uint16_t* target) {
     // For any other value: poll the Status port (0x1F7) until bit 7 (BSY, value = 0x80) clears.
     // Because of some ATAPI drives that do not follow spec, at this point you need to check the LBAmid and LBAhi ports (0x1F4 and 0x1F5) 
     // to see if they are non-zero. If so, the drive is not ATA, and you should stop polling.
-    while (inb(0x1F7) & STATUS_BSY) {
-        if (inb(0x1F4) != 0 || inb(0x1F5) != 0) {
+    while (inb(ch->io_base + ATA_REG_STATUS) & STATUS_BSY) {
+        if (inb(ch->io_base + ATA_REG_LBA_MID) != 0 || inb(ch->io_base + ATA_REG_LBA_HI) != 0) {
             return_val = -2;
             goto ret;
         }
     };
 
     // Otherwise, continue polling one of the Status ports until bit 3 (DRQ, value = 8) sets, or until bit 0 (ERR, value = 1) sets.
-    ATA_wait_DRQ();
+    ATA_wait_DRQ(ch);
 
     // At that point, if ERR is clear, the data is ready to read from the Data port (0x1F0). Read 256 16-bit values, and store them.
-    if ((inb(0x1F7) & STATUS_ERR)) {
+    if ((inb(ch->io_base + ATA_REG_STATUS) & STATUS_ERR)) {
         return_val = -3;
         goto ret;
     };
     for (int i = 0;i < 256;i++) {
-        target[i] = inw(0x1F0);
+        target[i] = inw(ch->io_base + ATA_REG_DATA);
     }
     
     return_val = 0;
 
 ret:
-    release(&ata_lock);
+    ATA_channel_release(ch);
     return return_val;
 }
 
 // Get count of all sectors available to address using a 28bit LBA
 //
 // return: number of 28bit LBA available
-int32_t get_total_28bit_sectors(bool slave) {
+int32_t get_total_28bit_sectors(uint8_t drive) {
     uint16_t identifier[256];
-    int8_t ret = ATA_Identify(slave, identifier);
+    int8_t ret = ATA_Identify(drive, identifier);
     if (ret != 0) {
         return ret;
     }
@@ -225,11 +661,11 @@ int32_t get_total_28bit_sectors(bool slave) {
 
 // Nedd to add 400ns delays before all the status registers are up to date
 // https://wiki.osdev.org/ATA_PIO_Mode#400ns_delays
-static void ATA_delay_400ns() {
-    inb(0x1F7);
-    inb(0x1F7);
-    inb(0x1F7);
-    inb(0x1F7);
+static void ATA_delay_400ns(ATA_channel* ch) {
+    inb(ch->io_base + ATA_REG_STATUS);
+    inb(ch->io_base + ATA_REG_STATUS);
+    inb(ch->io_base + ATA_REG_STATUS);
+    inb(ch->io_base + ATA_REG_STATUS);
 }
 
 // How to poll (waiting for the drive to be ready to transfer data): 
@@ -237,15 +673,69 @@ static void ATA_delay_400ns() {
 //      and bit 3 (DRQ, value = 8) sets 
 //  -- or until bit 0 (ERR, value = 1) or bit 5 (DF, value = 0x20) sets. 
 //  If neither error bit is set, the device is ready right then.
-static void ATA_wait_BSY() {
+// Begin issuing a command, interrupt is disabled until ATA_issue_end()
+// so the completion IRQ cannot fire before the issuing process goes to sleep
+static void ATA_issue_begin(ATA_channel* ch) {
+    push_cli();
+    ch->irq_received = 0;
+    ch->cmd_pending = 1;
+}
+
+static void ATA_issue_end(ATA_channel* ch) {
+    ch->cmd_pending = 0;
+    pop_cli();
+}
+
+// Wait for the drive to complete the current step of the issued command
+// Sleep until the channel IRQ if possible, otherwise (no process during kernel initialization) poll
+static void ATA_wait_IRQ(ATA_channel* ch) {
+    if(curr_proc() != NULL) {
+        while(!ch->irq_received) {
+            sleep(ch, NULL);
+        }
+        ch->irq_received = 0;
+    } else {
+        ATA_delay_400ns(ch);
+    }
+    ATA_wait_BSY(ch);
+}
+
+static void ATA_channel_irq(ATA_channel* ch) {
+    if(ch->dma.active != NULL) {
+        ATA_DMA_step(ch);
+        return;
+    }
+    // Reading the status register acknowledges the interrupt on the drive side
+    inb(ch->io_base + ATA_REG_STATUS);
+    if(ch->dma.available) {
+        uint8_t bm_status = inb(ch->dma.bmide_base + BMIDE_STATUS);
+        outb(ch->dma.bmide_base + BMIDE_STATUS, (bm_status & 0x60) | BMIDE_STATUS_IRQ);
+    }
+    if(ch->cmd_pending) {
+        ch->irq_received = 1;
+        wakeup(ch);
+    }
+}
+
+static void ata_primary_irq_handler(trapframe* tf) {
+    UNUSED_ARG(tf);
+    ATA_channel_irq(&ata_channels[0]);
+}
+
+static void ata_secondary_irq_handler(trapframe* tf) {
+    UNUSED_ARG(tf);
+    ATA_channel_irq(&ata_channels[1]);
+}
+
+static void ATA_wait_BSY(ATA_channel* ch) {
     //Wait for BSY to be 0
-    while (inb(0x1F7) & STATUS_BSY) {
+    while (inb(ch->io_base + ATA_REG_STATUS) & STATUS_BSY) {
         yield();
     };
 }
-static void ATA_wait_DRQ() {
+static void ATA_wait_DRQ(ATA_channel* ch) {
     //Wait fot DRQ or ERR to be 1
-    while (!(inb(0x1F7) & (STATUS_RDY | STATUS_ERR))) {
+    while (!(inb(ch->io_base + ATA_REG_STATUS) & (STATUS_RDY | STATUS_ERR))) {
         yield();
     };
 }
@@ -8,6 +8,7 @@
 #include <arch/i386/kernel/port_io.h>
 #include <arch/i386/kernel/pic.h>
 #include <kernel/cpu.h>
+#include <kernel/panic.h>
 
 
 // Ref: https://github.com/cfenollosa/os-tutorial/blob/master/23-fixes
@@ -139,6 +140,32 @@ void register_interrupt_handler(uint8_t n, interrupt_handler handler) {
     interrupt_handlers[n] = handler;
 }
 
+// PCI devices may share an IRQ line, every handler registered for the line is called
+// so the handlers shall check whether their device raised the interrupt
+#define MAX_SHARED_IRQ_HANDLERS 4
+static interrupt_handler shared_irq_handlers[16][MAX_SHARED_IRQ_HANDLERS];
+
+static void shared_irq_handler(trapframe* r) {
+    uint8_t irq_no = (uint8_t)r->err;
+    for(int i=0; i<MAX_SHARED_IRQ_HANDLERS; i++) {
+        if(shared_irq_handlers[irq_no][i] != 0) {
+            shared_irq_handlers[irq_no][i](r);
+        }
+    }
+}
+
+void register_shared_irq_handler(uint8_t irq_no, interrupt_handler handler) {
+    PANIC_ASSERT(irq_no < 16);
+    for(int i=0; i<MAX_SHARED_IRQ_HANDLERS; i++) {
+        if(shared_irq_handlers[irq_no][i] == 0) {
+            shared_irq_handlers[irq_no][i] = handler;
+            interrupt_handlers[IRQ_TO_INTERRUPT(irq_no)] = shared_irq_handler;
+            return;
+        }
+    }
+    PANIC("Too many handlers sharing an IRQ");
+}
+
 void irq_handler(trapframe* r) {
     uint8_t irq_no = (uint8_t)r->err; // err_code is the IRQ number for IRQs, see interrupt.asm
     /* After every interrupt we need to send an EOI to the PICs
@@ -0,0 +1,605 @@
+#include <string.h>
+#include <stdio.h>
+#include <common.h>
+#include <kernel/nvme.h>
+#include <kernel/pci.h>
+#include <kernel/paging.h>
+#include <kernel/heap.h>
+#include <kernel/lock.h>
+#include <kernel/process.h>
+#include <kernel/panic.h>
+#include <arch/i386/kernel/isr.h>
+#include <arch/i386/kernel/pic.h>
+
+// NVMe (NVM Express) driver
+// Ref: NVM Express Base Specification 1.4
+// Ref: https://wiki.osdev.org/NVMe
+//
+// The controller is driven through an admin queue pair, used at initialization only,
+// and one I/O queue pair shared by all namespaces. Commands of one transfer are written
+// to the submission queue as a batch and the tail doorbell is rung once.
+// Transfers over two memory pages are described by a PRP (Physical Region Page) list.
+// Asynchronous transfers (see nvme_submit_sectors()) are refilled from the interrupt
+// as command identifiers free up, so the block device queue keeps the I/O queue busy.
+
+// Controller registers
+#define NVME_REG_CAP 0x00
+#define NVME_REG_VS 0x08
+#define NVME_REG_CC 0x14
+#define NVME_REG_CSTS 0x1C
+#define NVME_REG_AQA 0x24
+#define NVME_REG_ASQ 0x28
+#define NVME_REG_ACQ 0x30
+#define NVME_REG_DOORBELL 0x1000
+
+#define NVME_CAP_MQES(cap) ((uint32_t) ((cap) & 0xFFFF)) // max queue entries, zero based
+#define NVME_CAP_DSTRD(cap) ((uint32_t) (((cap) >> 32) & 0xF)) // doorbell stride
+
+#define NVME_CC_EN (1 << 0)
+#define NVME_CC_IOSQES (6 << 16) // 64 bytes submission queue entry
+#define NVME_CC_IOCQES (4 << 20) // 16 bytes completion queue entry
+#define NVME_CSTS_RDY (1 << 0)
+#define NVME_CSTS_CFS (1 << 1)
+
+// Admin commands
+#define NVME_ADMIN_CREATE_SQ 0x01
+#define NVME_ADMIN_CREATE_CQ 0x05
+#define NVME_ADMIN_IDENTIFY 0x06
+#define NVME_IDENTIFY_NAMESPACE 0
+#define NVME_IDENTIFY_CONTROLLER 1
+
+// NVM I/O commands
+#define NVME_CMD_FLUSH 0x00
+#define NVME_CMD_WRITE 0x01
+#define NVME_CMD_READ 0x02
+
+#define NVME_QUEUE_PHYS_CONTIG (1 << 0)
+#define NVME_CQ_IRQ_ENABLED (1 << 1)
+
+#define NVME_ADMIN_QUEUE_SIZE 16
+#define NVME_IO_QUEUE_SIZE 64
+
+// A command transfers at most NVME_MAX_SECTORS_PER_CMD,
+// so a buffer not page aligned spans at most 33 pages, 32 of which go to the PRP list
+#define NVME_MAX_SECTORS_PER_CMD 256
+#define NVME_PRP_LIST_ENTRIES 32
+// Most asynchronous transfers in progress
+#define NVME_MAX_QUEUE_DEPTH 32
+
+typedef struct nvme_sqe {
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t cid; // command identifier
+    uint32_t nsid;
+    uint64_t rsv;
+    uint64_t mptr;
+    uint64_t prp1;
+    uint64_t prp2;
+    uint32_t cdw10;
+    uint32_t cdw11;
+    uint32_t cdw12;
+    uint32_t cdw13;
+    uint32_t cdw14;
+    uint32_t cdw15;
+} __attribute__ ((packed)) nvme_sqe;
+
+typedef volatile struct nvme_cqe {
+    uint32_t dw0;
+    uint32_t dw1;
+    uint16_t sq_head;
+    uint16_t sq_id;
+    uint16_t cid;
+    uint16_t status; // bit 0: phase tag, bit 1-15: status field
+} __attribute__ ((packed)) nvme_cqe;
+
+typedef struct nvme_queue {
+    uint16_t qid;
+    uint16_t size;
+    nvme_sqe* sq;
+    nvme_cqe* cq;
+    uint32_t sq_phy_addr;
+    uint32_t cq_phy_addr;
+    uint16_t sq_tail;
+    uint16_t cq_head;
+    uint16_t cq_phase;
+    volatile uint32_t* sq_doorbell;
+    volatile uint32_t* cq_doorbell;
+    // Transfer of each outstanding command, indexed by command identifier
+    // at most size-1 commands are outstanding so the submission queue never overflows
+    nvme_request* reqs[NVME_IO_QUEUE_SIZE];
+    uint64_t* prp_lists; // NVME_PRP_LIST_ENTRIES per command identifier
+    uint32_t prp_lists_phy_addr;
+} nvme_queue;
+
+typedef struct nvme_namespace {
+    uint32_t nsid;
+    uint64_t sector_count;
+} nvme_namespace;
+
+static struct {
+    bool initialized;
+    uint8_t* regs;
+    uint32_t doorbell_stride;
+    uint32_t max_sectors; // per command
+    bool volatile_write_cache;
+    nvme_queue admin_queue;
+    nvme_queue io_queue;
+    nvme_namespace namespaces[NVME_MAX_NAMESPACES];
+    uint32_t namespace_count;
+    nvme_request* async; // asynchronous transfers in progress
+    yield_lock lk; // protecting both queues, released while sleeping
+} nvme;
+
+#define NVME_REG32(offset) (*(volatile uint32_t*) (nvme.regs + (offset)))
+#define NVME_REG64(offset) (*(volatile uint64_t*) (nvme.regs + (offset)))
+
+static void nvme_init_queue(nvme_queue* q, uint16_t qid, uint16_t size)
+{
+    memset(q, 0, sizeof(*q));
+    q->qid = qid;
+    q->size = size;
+    PANIC_ASSERT(size*sizeof(nvme_sqe) <= PAGE_SIZE);
+    q->sq = (nvme_sqe*) alloc_pages_consecutive_frames(curr_page_dir(), 1, true, &q->sq_phy_addr);
+    q->cq = (nvme_cqe*) alloc_pages_consecutive_frames(curr_page_dir(), 1, true, &q->cq_phy_addr);
+    memset(q->sq, 0, PAGE_SIZE);
+    memset((void*) q->cq, 0, PAGE_SIZE);
+    q->cq_phase = 1;
+    q->sq_doorbell = (volatile uint32_t*) (nvme.regs + NVME_REG_DOORBELL + (2*qid)*nvme.doorbell_stride);
+    q->cq_doorbell = (volatile uint32_t*) (nvme.regs + NVME_REG_DOORBELL + (2*qid + 1)*nvme.doorbell_stride);
+    uint32_t prp_pages = PAGE_COUNT_FROM_BYTES(size*NVME_PRP_LIST_ENTRIES*sizeof(uint64_t));
+    q->prp_lists = (uint64_t*) alloc_pages_consecutive_frames(curr_page_dir(), prp_pages, true, &q->prp_lists_phy_addr);
+}
+
+// Retire commands posted to the completion queue, nvme.lk shall be held
+static void nvme_process_cq(nvme_queue* q)
+{
+    bool advanced = false;
+    while((q->cq[q->cq_head].status & 1) == q->cq_phase) {
+        nvme_cqe* e = &q->cq[q->cq_head];
+        nvme_request* req = q->reqs[e->cid];
+        if(e->status >> 1) {
+            printf("NVMe: Queue %u command %u failed, status 0x%x\n", q->qid, e->cid, e->status >> 1);
+            req->result = -1;
+        }
+        req->pending--;
+        q->reqs[e->cid] = NULL;
+        q->cq_head++;
+        if(q->cq_head == q->size) {
+            q->cq_head = 0;
+            q->cq_phase ^= 1;
+        }
+        advanced = true;
+    }
+    if(advanced) {
+        *q->cq_doorbell = q->cq_head;
+    }
+}
+
+static void nvme_advance();
+
+static void nvme_irq_handler(trapframe* tf)
+{
+    UNUSED_ARG(tf);
+    acquire(&nvme.lk);
+    nvme_process_cq(&nvme.admin_queue);
+    nvme_process_cq(&nvme.io_queue);
+    nvme_advance();
+    release(&nvme.lk);
+    wakeup(&nvme);
+}
+
+// Wait for any command to complete, nvme.lk shall be held
+static void nvme_wait()
+{
+    if(curr_proc() != NULL) {
+        sleep(&nvme, &nvme.lk);
+    } else {
+        // polling during kernel initialization
+        nvme_process_cq(&nvme.admin_queue);
+        nvme_process_cq(&nvme.io_queue);
+        nvme_advance();
+    }
+}
+
+// Fill in PRP entries for a dword aligned kernel buffer of at most NVME_MAX_SECTORS_PER_CMD sectors
+static void nvme_build_prp(nvme_queue* q, uint16_t cid, nvme_sqe* cmd, void* buf, uint32_t byte_count)
+{
+    uint32_t vaddr = (uint32_t) buf;
+    cmd->prp1 = vaddr2paddr(curr_page_dir(), vaddr);
+    cmd->prp2 = 0;
+    uint32_t first = PAGE_SIZE - (vaddr & (PAGE_SIZE - 1));
+    if(byte_count <= first) {
+        return;
+    }
+    vaddr += first;
+    uint32_t n_pages = PAGE_COUNT_FROM_BYTES(byte_count - first);
+    if(n_pages == 1) {
+        cmd->prp2 = vaddr2paddr(curr_page_dir(), vaddr);
+        return;
+    }
+    PANIC_ASSERT(n_pages <= NVME_PRP_LIST_ENTRIES);
+    uint64_t* list = &q->prp_lists[cid*NVME_PRP_LIST_ENTRIES];
+    for(uint32_t i=0; i<n_pages; i++) {
+        list[i] = vaddr2paddr(curr_page_dir(), vaddr + i*PAGE_SIZE);
+    }
+    cmd->prp2 = q->prp_lists_phy_addr + cid*NVME_PRP_LIST_ENTRIES*sizeof(uint64_t);
+}
+
+// Place a command in the submission queue, the doorbell is rung by nvme_ring()
+//
+// return: zero = success, -1 if no command identifier is free
+static int nvme_submit(nvme_queue* q, nvme_sqe* cmd, void* buf, uint32_t byte_count, nvme_request* req)
+{
+    int cid = -1;
+    for(uint16_t i=0; i<q->size-1; i++) {
+        if(q->reqs[i] == NULL) {
+            cid = i;
+            break;
+        }
+    }
+    if(cid < 0) {
+        return -1;
+    }
+    cmd->cid = cid;
+    if(byte_count > 0) {
+        nvme_build_prp(q, cid, cmd, buf, byte_count);
+    }
+    q->reqs[cid] = req;
+    req->pending++;
+    q->sq[q->sq_tail] = *cmd;
+    q->sq_tail = (q->sq_tail + 1) % q->size;
+    return 0;
+}
+
+static void nvme_ring(nvme_queue* q)
+{
+    asm volatile("" ::: "memory");
+    *q->sq_doorbell = q->sq_tail;
+}
+
+// Issue one command and wait for it, nvme.lk shall be held
+static int nvme_exec(nvme_queue* q, nvme_sqe* cmd, void* buf, uint32_t byte_count)
+{
+    nvme_request req = {.pending = 0, .result = 0};
+    while(nvme_submit(q, cmd, buf, byte_count, &req) < 0) {
+        nvme_wait();
+    }
+    nvme_ring(q);
+    while(req.pending > 0) {
+        nvme_wait();
+    }
+    return req.result;
+}
+
+// Data buffer of a transfer, dword aligned as PRP entries shall be
+static uint8_t* nvme_req_buf(nvme_request* req)
+{
+    if(req->bounce != NULL) {
+        return (uint8_t*) (((uint32_t) req->bounce + 3) & ~3);
+    }
+    return req->buf;
+}
+
+// Submit as many commands of the transfer as command identifiers allow: data while sectors are left,
+// then the cache flush after writes, nvme.lk shall be held
+//
+// return: number of commands submitted
+static uint32_t nvme_fill(nvme_request* req)
+{
+    nvme_queue* q = &nvme.io_queue;
+    uint32_t submitted = 0;
+    while(req->issued < req->sector_count) {
+        uint32_t count = req->sector_count - req->issued;
+        if(count > nvme.max_sectors) {
+            count = nvme.max_sectors;
+        }
+        uint64_t LBA = req->LBA + req->issued;
+        nvme_sqe cmd = {0};
+        cmd.opcode = req->is_write ? NVME_CMD_WRITE : NVME_CMD_READ;
+        cmd.nsid = req->nsid;
+        cmd.cdw10 = (uint32_t) LBA;
+        cmd.cdw11 = (uint32_t) (LBA >> 32);
+        cmd.cdw12 = count - 1;
+        if(nvme_submit(q, &cmd, nvme_req_buf(req) + req->issued*512, count*512, req) < 0) {
+            return submitted;
+        }
+        submitted++;
+        req->issued += count;
+    }
+    if(req->is_write && nvme.volatile_write_cache && req->result == 0 && req->pending == 0 && !req->flushing) {
+        nvme_sqe cmd = {0};
+        cmd.opcode = NVME_CMD_FLUSH;
+        cmd.nsid = req->nsid;
+        if(nvme_submit(q, &cmd, NULL, 0, req) == 0) {
+            req->flushing = true;
+            submitted++;
+        }
+    }
+    return submitted;
+}
+
+// Whether all commands of the transfer are done
+static bool nvme_finished(nvme_request* req)
+{
+    if(req->pending > 0 || req->issued < req->sector_count) {
+        return false;
+    }
+    return req->result != 0 || !req->is_write || !nvme.volatile_write_cache || req->flushing;
+}
+
+// Refill the I/O queue with commands of asynchronous transfers and finish the ones done
+// nvme.lk shall be held, it is released while running the callbacks
+static void nvme_advance()
+{
+    uint32_t submitted = 0;
+    nvme_request** pp = &nvme.async;
+    while(*pp != NULL) {
+        nvme_request* req = *pp;
+        submitted += nvme_fill(req);
+        if(!nvme_finished(req)) {
+            pp = &req->next;
+            continue;
+        }
+        *pp = req->next;
+        if(req->bounce != NULL) {
+            if(!req->is_write && req->result == 0) {
+                memmove(req->buf, nvme_req_buf(req), req->sector_count*512);
+            }
+            kfree(req->bounce);
+        }
+        if(submitted > 0) {
+            nvme_ring(&nvme.io_queue);
+            submitted = 0;
+        }
+        release(&nvme.lk);
+        req->done(req, req->result);
+        acquire(&nvme.lk);
+        // the list may have changed meanwhile
+        pp = &nvme.async;
+    }
+    if(submitted > 0) {
+        nvme_ring(&nvme.io_queue);
+    }
+}
+
+// Transfer sectors in commands of at most nvme.max_sectors, refilling the queue as commands complete
+static int nvme_rw(nvme_namespace* ns, uint8_t* buf, uint64_t LBA, uint32_t sector_count, bool is_write)
+{
+    if((uint32_t) buf & 3) {
+        // PRP entries shall be dword aligned
+        uint8_t* bounce = kmalloc(sector_count*512 + 3);
+        uint8_t* aligned = (uint8_t*) (((uint32_t) bounce + 3) & ~3);
+        if(is_write) {
+            memmove(aligned, buf, sector_count*512);
+        }
+        int res = nvme_rw(ns, aligned, LBA, sector_count, is_write);
+        if(!is_write) {
+            memmove(buf, aligned, sector_count*512);
+        }
+        kfree(bounce);
+        return res;
+    }
+
+    nvme_request req = {.is_write = is_write, .buf = buf, .LBA = LBA, .sector_count = sector_count, .nsid = ns->nsid};
+    acquire(&nvme.lk);
+    while(1) {
+        if(nvme_fill(&req) > 0) {
+            nvme_ring(&nvme.io_queue);
+        }
+        if(nvme_finished(&req)) {
+            break;
+        }
+        nvme_wait();
+    }
+    release(&nvme.lk);
+    return req.result;
+}
+
+static int nvme_identify(uint32_t nsid, uint32_t cns, void* page)
+{
+    nvme_sqe cmd = {0};
+    cmd.opcode = NVME_ADMIN_IDENTIFY;
+    cmd.nsid = nsid;
+    cmd.cdw10 = cns;
+    return nvme_exec(&nvme.admin_queue, &cmd, page, PAGE_SIZE);
+}
+
+static int nvme_create_io_queue(nvme_queue* q)
+{
+    nvme_sqe cmd = {0};
+    cmd.opcode = NVME_ADMIN_CREATE_CQ;
+    cmd.prp1 = q->cq_phy_addr;
+    cmd.cdw10 = ((q->size - 1) << 16) | q->qid;
+    cmd.cdw11 = NVME_CQ_IRQ_ENABLED | NVME_QUEUE_PHYS_CONTIG;
+    int res = nvme_exec(&nvme.admin_queue, &cmd, NULL, 0);
+    if(res != 0) {
+        return res;
+    }
+    cmd = (nvme_sqe) {0};
+    cmd.opcode = NVME_ADMIN_CREATE_SQ;
+    cmd.prp1 = q->sq_phy_addr;
+    cmd.cdw10 = ((q->size - 1) << 16) | q->qid;
+    cmd.cdw11 = (q->qid << 16) | NVME_QUEUE_PHYS_CONTIG;
+    return nvme_exec(&nvme.admin_queue, &cmd, NULL, 0);
+}
+
+static void nvme_add_namespace(uint32_t nsid, uint8_t* identify)
+{
+    uint64_t nsze = *(uint64_t*) &identify[0];
+    if(nsze == 0) {
+        // inactive namespace
+        return;
+    }
+    uint8_t flbas = identify[26] & 0x0F;
+    uint8_t lbads = identify[128 + 4*flbas + 2];
+    if(lbads != 9) {
+        printf("NVMe: Namespace %u LBA size %u not supported\n", nsid, 1 << lbads);
+        return;
+    }
+    if(nvme.namespace_count == NVME_MAX_NAMESPACES) {
+        printf("NVMe: Too many namespaces, namespace %u ignored\n", nsid);
+        return;
+    }
+    nvme.namespaces[nvme.namespace_count++] = (nvme_namespace) {.nsid = nsid, .sector_count = nsze};
+    printf("NVMe: Namespace %u, %u sectors\n", nsid, (uint32_t) nsze);
+}
+
+void init_nvme(uint8_t bus, uint8_t device, uint8_t function)
+{
+    if(nvme.initialized) {
+        // only support one NVMe controller
+        return;
+    }
+
+    uint16_t command = PCI_COMMAND(bus, device, function);
+    command |= PCI_COMMAND_BUS_MASTER | PCI_COMMAND_MEMORY_SPACE;
+    command &= ~PCI_COMMAND_INT_DISABLE;
+    PCI_W_COMMAND(bus, device, function, command);
+
+    // 64-bit memory space BAR0/BAR1, shall be located below 4GiB
+    uint32_t bar0 = PCI_BAR_0(bus, device, function) & ~0xF;
+    if(PCI_BAR_1(bus, device, function) != 0) {
+        printf("NVMe: BAR above 4GiB not supported\n");
+        return;
+    }
+    nvme.regs = (uint8_t*) pci_map_mmio(bar0, PAGE_SIZE);
+    if(nvme.regs == NULL) {
+        return;
+    }
+    uint64_t cap = NVME_REG64(NVME_REG_CAP);
+    nvme.doorbell_stride = 4 << NVME_CAP_DSTRD(cap);
+    if(pci_map_mmio(bar0, NVME_REG_DOORBELL + 4*nvme.doorbell_stride) == 0) {
+        nvme.regs = NULL;
+        return;
+    }
+
+    // Reset the controller and set up the admin queue
+    NVME_REG32(NVME_REG_CC) &= ~NVME_CC_EN;
+    while(NVME_REG32(NVME_REG_CSTS) & NVME_CSTS_RDY);
+    nvme_init_queue(&nvme.admin_queue, 0, NVME_ADMIN_QUEUE_SIZE);
+    NVME_REG32(NVME_REG_AQA) = ((NVME_ADMIN_QUEUE_SIZE - 1) << 16) | (NVME_ADMIN_QUEUE_SIZE - 1);
+    NVME_REG64(NVME_REG_ASQ) = nvme.admin_queue.sq_phy_addr;
+    NVME_REG64(NVME_REG_ACQ) = nvme.admin_queue.cq_phy_addr;
+    NVME_REG32(NVME_REG_CC) = NVME_CC_IOSQES | NVME_CC_IOCQES | NVME_CC_EN;
+    uint32_t csts;
+    while(!((csts = NVME_REG32(NVME_REG_CSTS)) & (NVME_CSTS_RDY | NVME_CSTS_CFS)));
+    if(csts & NVME_CSTS_CFS) {
+        printf("NVMe: Controller fatal status\n");
+        return;
+    }
+
+    uint32_t io_queue_size = NVME_IO_QUEUE_SIZE;
+    if(io_queue_size > NVME_CAP_MQES(cap) + 1) {
+        io_queue_size = NVME_CAP_MQES(cap) + 1;
+    }
+    nvme_init_queue(&nvme.io_queue, 1, io_queue_size);
+
+    uint8_t irq = PCI_INT_LINE(bus, device, function);
+    register_shared_irq_handler(irq, nvme_irq_handler);
+    IRQ_clear_mask(irq);
+
+    uint8_t* identify = (uint8_t*) alloc_pages_consecutive_frames(curr_page_dir(), 1, true, NULL);
+    acquire(&nvme.lk);
+    if(nvme_identify(0, NVME_IDENTIFY_CONTROLLER, identify) != 0) {
+        printf("NVMe: IDENTIFY controller failed\n");
+        goto ret;
+    }
+    uint8_t mdts = identify[77];
+    uint32_t nn = *(uint32_t*) &identify[516];
+    nvme.volatile_write_cache = identify[525] & 1;
+    nvme.max_sectors = NVME_MAX_SECTORS_PER_CMD;
+    if(mdts > 0 && mdts < 5) {
+        // MDTS is in units of the minimum memory page size, 4KiB
+        nvme.max_sectors = (PAGE_SIZE/512) << mdts;
+    }
+
+    if(nvme_create_io_queue(&nvme.io_queue) != 0) {
+        printf("NVMe: Creating I/O queue failed\n");
+        goto ret;
+    }
+    for(uint32_t nsid=1; nsid<=nn && nvme.namespace_count < NVME_MAX_NAMESPACES; nsid++) {
+        if(nvme_identify(nsid, NVME_IDENTIFY_NAMESPACE, identify) == 0) {
+            nvme_add_namespace(nsid, identify);
+        }
+    }
+    printf("NVMe: BAR 0x%x, version 0x%x, I/O queue size %u, VWC[%u]\n",
+        bar0, NVME_REG32(NVME_REG_VS), io_queue_size, nvme.volatile_write_cache);
+    nvme.initialized = true;
+
+ret:
+    release(&nvme.lk);
+    dealloc_pages(curr_page_dir(), PAGE_INDEX_FROM_VADDR((uint32_t) identify), 1);
+}
+
+uint32_t nvme_namespace_count()
+{
+    return nvme.namespace_count;
+}
+
+uint64_t nvme_sector_count(uint32_t ns)
+{
+    PANIC_ASSERT(ns < nvme.namespace_count);
+    return nvme.namespaces[ns].sector_count;
+}
+
+// Read sectors from a NVMe namespace, buf shall be kernel memory
+//
+// return: zero = success, otherwise failed
+int nvme_read_sectors(uint32_t ns, void* buf, uint64_t LBA, uint32_t sector_count)
+{
+    PANIC_ASSERT(ns < nvme.namespace_count);
+    return nvme_rw(&nvme.namespaces[ns], (uint8_t*) buf, LBA, sector_count, false);
+}
+
+// Write sectors to a NVMe namespace, buf shall be kernel memory
+//
+// return: zero = success, otherwise failed
+int nvme_write_sectors(uint32_t ns, const void* buf, uint64_t LBA, uint32_t sector_count)
+{
+    PANIC_ASSERT(ns < nvme.namespace_count);
+    return nvme_rw(&nvme.namespaces[ns], (uint8_t*) buf, LBA, sector_count, true);
+}
+
+// Transfers taken at once through nvme_submit_sectors(), shared by all namespaces
+uint32_t nvme_queue_depth()
+{
+    uint32_t depth = nvme.io_queue.size - 1;
+    return depth < NVME_MAX_QUEUE_DEPTH ? depth : NVME_MAX_QUEUE_DEPTH;
+}
+
+// Start a transfer and return without waiting for it, its commands are submitted
+// as command identifiers free up. req->done is called from interrupt context once finished,
+// req->buf shall be kernel memory since the transfer may complete in another process
+//
+// return: zero = started, otherwise failed
+int nvme_submit_sectors(uint32_t ns, nvme_request* req)
+{
+    PANIC_ASSERT(ns < nvme.namespace_count);
+    PANIC_ASSERT(req->done != NULL);
+    req->nsid = nvme.namespaces[ns].nsid;
+    req->bounce = NULL;
+    if((uint32_t) req->buf & 3) {
+        // PRP entries shall be dword aligned
+        req->bounce = kmalloc(req->sector_count*512 + 3);
+        if(req->is_write) {
+            memmove(nvme_req_buf(req), req->buf, req->sector_count*512);
+        }
+    }
+    req->issued = 0;
+    req->pending = 0;
+    req->result = 0;
+    req->flushing = false;
+    req->next = NULL;
+    acquire(&nvme.lk);
+    // appended, so that transfers waiting for command identifiers are refilled in order
+    nvme_request** pp = &nvme.async;
+    while(*pp != NULL) {
+        pp = &(*pp)->next;
+    }
+    *pp = req;
+    if(nvme_fill(req) > 0) {
+        nvme_ring(&nvme.io_queue);
+    }
+    release(&nvme.lk);
+    return 0;
+}
@@ -31,9 +31,11 @@ typedef struct page
    uint32_t present    : 1;   // Page present in memory
    uint32_t rw         : 1;   // Read-only if clear, readwrite if set
    uint32_t user       : 1;   // Supervisor level only if clear
+   uint32_t write_through  : 1;   // Write-through caching if set, write-back otherwise
+   uint32_t cache_disabled : 1;   // The page will not be cached if set
    uint32_t accessed   : 1;   // Has the page been accessed since last refresh?
    uint32_t dirty      : 1;   // Has the page been written to since last refresh?
-   uint32_t unused     : 7;   // Amalgamation of unused and reserved bits
+   uint32_t unused     : 5;   // Amalgamation of unused and reserved bits
    uint32_t frame      : 20;  // Frame address (shifted right 12 bits)
 } __attribute__((packed)) page_t;
 
@@ -478,6 +480,27 @@ uint32_t change_page_rw_attr(pde* page_dir, uint32_t page_index, bool is_writeab
     return VADDR_FROM_PAGE_INDEX(page_index);
 }
 
+// Disable (or re-enable) caching of a mapped page, e.g. for memory mapped I/O
+uint32_t change_page_cache_attr(pde* page_dir, uint32_t page_index, bool is_uncached)
+{
+    uint32_t page_dir_idx = page_index / PAGE_TABLE_SIZE;
+    uint32_t page_table_idx = page_index % PAGE_TABLE_SIZE;
+    
+    PANIC_ASSERT(page_dir[page_dir_idx].present);
+    page_t* page_table = get_page_table(page_dir, page_dir_idx, false);
+    
+    page_table[page_table_idx].write_through = is_uncached;
+    page_table[page_table_idx].cache_disabled = is_uncached;
+
+    return_page_table(page_dir, page_table);
+
+    if(is_curr_page_dir(page_dir)) {
+        flush_tlb(VADDR_FROM_PAGE_INDEX(page_index));
+    }
+
+    return VADDR_FROM_PAGE_INDEX(page_index);
+}
+
 uint32_t vaddr2paddr(pde* page_dir, uint32_t vaddr)
 {
     uint32_t page_index = PAGE_INDEX_FROM_VADDR(vaddr);
@@ -4,6 +4,11 @@
 #include <kernel/pci.h>
 #include <arch/i386/kernel/port_io.h>
 #include <kernel/rtl8139.h>
+#include <kernel/ata.h>
+#include <kernel/ahci.h>
+#include <kernel/virtio_blk.h>
+#include <kernel/nvme.h>
+#include <kernel/paging.h>
 
 // Ref: https://wiki.osdev.org/PCI
 
@@ -77,6 +82,31 @@ void pci_write_reg(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset
     
 }
 
+// Identity map a memory mapped I/O region (e.g. memory space BAR) into kernel space if not yet mapped
+// Pages are mapped uncached, since device registers must not be served from (or buffered in) the CPU cache
+//
+// return: virtual address of the region, 0 if part of it is already mapped to other frames
+uint32_t pci_map_mmio(uint32_t phy_addr, uint32_t size)
+{
+    uint32_t first_page = PAGE_INDEX_FROM_VADDR(phy_addr);
+    uint32_t last_page = PAGE_INDEX_FROM_VADDR(phy_addr + size - 1);
+    for(uint32_t page = first_page; page <= last_page; page++) {
+        uint32_t vaddr = VADDR_FROM_PAGE_INDEX(page);
+        if(is_vaddr_accessible(curr_page_dir(), vaddr, true, false)) {
+            if(vaddr2paddr(curr_page_dir(), vaddr) != vaddr) {
+                printf("PCI: MMIO 0x%x already mapped to other memory\n", vaddr);
+                return 0;
+            }
+            change_page_rw_attr(curr_page_dir(), page, true);
+        } else {
+            uint32_t frame_idx = page;
+            map_pages_at(curr_page_dir(), page, 1, &frame_idx, true, true, true);
+        }
+        change_page_cache_attr(curr_page_dir(), page, true);
+    }
+    return phy_addr;
+}
+
 static void init_pci_device(uint8_t bus, uint8_t device, uint8_t function)
 {
     uint16_t vendor_id = PCI_VENDER_ID(bus, device, function);
@@ -91,6 +121,27 @@ static void init_pci_device(uint8_t bus, uint8_t device, uint8_t function)
     if(vendor_id == 0x10EC && PCI_DEVICE_ID == 0x8139) {
         init_rtl8139(bus, device, function);
     }
+    if(vendor_id == 0x1AF4 && PCI_DEVICE_ID == 0x1001) {
+        // Transitional virtio block device
+        init_virtio_blk(bus, device, function);
+    }
+
+    // Devices recognized by class code
+    uint8_t base_class = PCI_BASE_CLASS(bus, device, function);
+    uint8_t sub_class = PCI_SUB_CLASS(bus, device, function);
+    uint8_t prog_if = PCI_PROG_IF(bus, device, function);
+    if(base_class == 0x01 && sub_class == 0x01 && (prog_if & 0x80)) {
+        // IDE controller supporting bus mastering
+        init_ata_dma(bus, device, function);
+    }
+    if(base_class == 0x01 && sub_class == 0x06 && prog_if == 0x01) {
+        // SATA controller in AHCI mode
+        init_ahci(bus, device, function);
+    }
+    if(base_class == 0x01 && sub_class == 0x08 && prog_if == 0x02) {
+        // NVM Express controller
+        init_nvme(bus, device, function);
+    }
 }
 
 static void pci_check_function(uint8_t bus, uint8_t device, uint8_t function) {
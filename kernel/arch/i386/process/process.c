@@ -171,9 +171,11 @@ void scheduler()
     // pretend it was yielded from another process
     acquire(&process_table.lk);
     while(1) {
+        uint scheduled = 0;
         for(p = process_table.proc; p < &process_table.proc[N_PROCESS]; p++){
             if(p->state != PROC_STATE_RUNNABLE)
                 continue;
+            scheduled = 1;
 
             // Holding the process table lock when leaving and entering the scheduler
             // Enter with lock because we are entering scheduler's loop of process_table
@@ -194,6 +196,13 @@ void scheduler()
             // printf("Switched back from process %u\n", p->pid);
             cpu->current_process = NULL;
         }
+        if(!scheduled) {
+            // All processes are sleeping, wait for an interrupt (e.g. disk IRQ) to wake one of them up
+            // IRQ handlers shall only call wakeup(), which does not acquire the process table lock
+            enable_interrupt();
+            halt();
+            disable_interrupt();
+        }
     }
 }
 
@@ -325,6 +334,10 @@ void yield()
     // PANIC_ASSERT(!is_interrupt_enabled());
 
     proc* p = curr_proc();
+    if(p == NULL) {
+        // e.g. timer IRQ when the scheduler is idle
+        return;
+    }
 
     if(!p->no_schedule) {
         acquire(&process_table.lk);
@@ -338,6 +351,54 @@ void yield()
 
 }
 
+// Ref: xv6/proc.c
+// Put the current process to sleep on chan until wakeup(chan) is called
+// If lk is not NULL, it is released while sleeping and re-acquired before returning
+// Caller shall check its wake up condition with interrupt disabled (or lk held),
+//   otherwise the wakeup can happen before sleeping and be lost
+void sleep(void* chan, yield_lock* lk)
+{
+    proc* p = curr_proc();
+    PANIC_ASSERT(p != NULL);
+
+    acquire(&process_table.lk);
+    if(lk != NULL) {
+        release(lk);
+    }
+    p->sleep_chan = chan;
+    p->state = PROC_STATE_SLEEPING;
+
+    // The interrupt nesting level belongs to this process, save it for resuming
+    // and switch away with only the process table lock counted, same as yield()
+    cpu* c = curr_cpu();
+    int cli_count = c->cli_count;
+    int orig_if_flag = c->orig_if_flag;
+    c->cli_count = 1;
+    switch_kernel_context(&p->context, c->scheduler_context);
+    c->cli_count = cli_count;
+    c->orig_if_flag = orig_if_flag;
+
+    p->sleep_chan = NULL;
+    release(&process_table.lk);
+    if(lk != NULL) {
+        acquire(lk);
+    }
+}
+
+// Wake up all processes sleeping on chan
+// Can be called from interrupt handlers, so it does not acquire the process table lock
+// (may be holding by the interrupted process); on a single CPU disabling interrupt is enough
+void wakeup(void* chan)
+{
+    push_cli();
+    for(proc* p = process_table.proc; p < &process_table.proc[N_PROCESS]; p++) {
+        if(p->state == PROC_STATE_SLEEPING && p->sleep_chan == chan) {
+            p->state = PROC_STATE_RUNNABLE;
+        }
+    }
+    pop_cli();
+}
+
 // From Newlib sys/wait.h
 /* A status looks like:
     <1 byte info> <1 byte code>
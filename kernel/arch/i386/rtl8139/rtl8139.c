@@ -166,7 +166,7 @@ void init_rtl8139(uint8_t bus, uint8_t device, uint8_t function)
     // Get interrupt line
     uint8_t irq = PCI_INT_LINE(bus,device,function);
     printf("RTL8139 is using IRQ(%u)\n", irq);
-    register_interrupt_handler(IRQ_TO_INTERRUPT(irq), rtl8139_irq_handler);
+    register_shared_irq_handler(irq, rtl8139_irq_handler);
     IRQ_clear_mask(irq);
 
     // Enable Receive and Transmitter
@@ -259,6 +259,12 @@ int sys_get_file_offset(trapframe* r)
     }
 }
 
+int sys_sync(trapframe* r)
+{
+    UNUSED_ARG(r);
+    return fs_sync();
+}
+
 int sys_dup(trapframe* r)
 {
     int32_t handle = *(int*) (r->esp + 4);
@@ -320,6 +326,20 @@ int sys_truncate_fd(trapframe* r)
     }
 }
 
+int sys_fallocate_fd(trapframe* r)
+{
+    int handle = *(int*) (r->esp + 4);
+    uint offset = *(uint*) (r->esp + 8);
+    uint len = *(uint*) (r->esp + 12);
+    struct handle_map* pmap = get_handle(handle);
+    if(pmap == NULL) return -1;
+    if(pmap->type == HANDLE_TYPE_FILE) {
+        return fs_fallocate(NULL, offset, len, pmap->grd);
+    } else {
+        return -1;
+    }
+}
+
 int sys_get_pid(trapframe* r)
 {
     UNUSED_ARG(r);
@@ -669,6 +689,12 @@ void syscall_handler(trapframe* r)
     case SYS_GET_FILE_OFFSET:
         r->eax = sys_get_file_offset(r);
         break;
+    case SYS_SYNC:
+        r->eax = sys_sync(r);
+        break;
+    case SYS_FALLOCATE_FD:
+        r->eax = sys_fallocate_fd(r);
+        break;
     case SYS_BRK:
         r->eax = sys_brk(r);
         break;
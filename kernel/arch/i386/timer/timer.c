@@ -2,6 +2,7 @@
 #include <kernel/time.h>
 #include <kernel/process.h>
 #include <kernel/lock.h>
+#include <kernel/cpu.h>
 #include <arch/i386/kernel/cpu.h>
 #include <arch/i386/kernel/isr.h>
 #include <arch/i386/kernel/port_io.h>
@@ -99,3 +100,17 @@ void init_timer(uint32_t freq, uint32_t tick_between_process_switch) {
     timer_freq = freq;
     tick_between_call_to_scheduler = tick_between_process_switch;
 }
+
+// Ticks since the timer started
+uint64_t timer_ticks() {
+    // a 64-bit read is not atomic against the IRQ
+    push_cli();
+    uint64_t t = tick;
+    pop_cli();
+    return t;
+}
+
+// Ticks per second
+uint32_t timer_frequency() {
+    return timer_freq;
+}
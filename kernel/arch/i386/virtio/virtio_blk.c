@@ -0,0 +1,560 @@
+#include <string.h>
+#include <stdio.h>
+#include <common.h>
+#include <kernel/virtio_blk.h>
+#include <kernel/pci.h>
+#include <kernel/paging.h>
+#include <kernel/heap.h>
+#include <kernel/lock.h>
+#include <kernel/process.h>
+#include <kernel/panic.h>
+#include <arch/i386/kernel/port_io.h>
+#include <arch/i386/kernel/isr.h>
+#include <arch/i386/kernel/pic.h>
+
+// VirtIO block device driver (legacy PCI interface)
+// Ref: Virtual I/O Device (VIRTIO) Version 1.1, 4.1.4.8 Legacy Interfaces and 5.2 Block Device
+// Ref: https://wiki.osdev.org/Virtio
+//
+// Requests are chained into descriptors of the single virtqueue (header, data pages, status).
+// As many requests as free descriptors allow are made available before notifying the device,
+// so a large transfer costs one I/O port write (VM exit) rather than one per sector or register.
+// The device reports completion through the used ring and an interrupt.
+// Asynchronous transfers (see virtio_blk_submit_sectors()) are refilled from the interrupt
+// as descriptors free up, so the block device queue keeps several transfers in the virtqueue.
+
+// Legacy register offsets in the I/O space BAR0
+#define VIRTIO_PCI_DEVICE_FEATURES 0x00
+#define VIRTIO_PCI_GUEST_FEATURES 0x04
+#define VIRTIO_PCI_QUEUE_PFN 0x08
+#define VIRTIO_PCI_QUEUE_SIZE 0x0C
+#define VIRTIO_PCI_QUEUE_SELECT 0x0E
+#define VIRTIO_PCI_QUEUE_NOTIFY 0x10
+#define VIRTIO_PCI_STATUS 0x12
+#define VIRTIO_PCI_ISR 0x13 // reading acknowledges the interrupt
+#define VIRTIO_PCI_CONFIG 0x14 // device specific configuration, as MSI-X is not enabled
+
+#define VIRTIO_STATUS_ACKNOWLEDGE 1
+#define VIRTIO_STATUS_DRIVER 2
+#define VIRTIO_STATUS_DRIVER_OK 4
+#define VIRTIO_STATUS_FAILED 128
+
+#define VIRTIO_ISR_QUEUE 1
+
+// Block device feature bits and configuration
+#define VIRTIO_BLK_F_SEG_MAX (1 << 2)
+#define VIRTIO_BLK_F_RO (1 << 5)
+#define VIRTIO_BLK_F_FLUSH (1 << 9)
+#define VIRTIO_BLK_CFG_CAPACITY 0x00
+#define VIRTIO_BLK_CFG_SEG_MAX 0x0C
+
+#define VIRTIO_BLK_T_IN 0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_T_FLUSH 4
+#define VIRTIO_BLK_S_OK 0
+
+#define VIRTQ_DESC_F_NEXT 1
+#define VIRTQ_DESC_F_WRITE 2 // buffer is written by the device
+#define VIRTQ_USED_F_NO_NOTIFY 1
+
+// A request transfers at most VIRTIO_BLK_MAX_SECTORS_PER_REQ,
+// so a non physically contiguous buffer needs at most 33 data segments
+#define VIRTIO_BLK_MAX_SECTORS_PER_REQ 256
+#define VIRTIO_BLK_MAX_SEGS_PER_REQ 33
+// Most asynchronous transfers in progress per drive
+#define VIRTIO_BLK_MAX_QUEUE_DEPTH 32
+
+// Keep the compiler from reordering ring accesses, x86 does not reorder stores with other stores
+#define virtq_barrier() asm volatile("" ::: "memory")
+
+typedef struct virtq_desc {
+    uint64_t addr; // physical address
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} __attribute__ ((packed)) virtq_desc;
+
+typedef struct virtq_avail {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];
+} __attribute__ ((packed)) virtq_avail;
+
+typedef struct virtq_used_elem {
+    uint32_t id; // head descriptor of the completed chain
+    uint32_t len;
+} __attribute__ ((packed)) virtq_used_elem;
+
+typedef volatile struct virtq_used {
+    uint16_t flags;
+    uint16_t idx;
+    virtq_used_elem ring[];
+} __attribute__ ((packed)) virtq_used;
+
+typedef struct virtio_blk_req_hdr {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+} __attribute__ ((packed)) virtio_blk_req_hdr;
+
+typedef struct virtio_blk_drive {
+    uint16_t iobase;
+    uint8_t irq;
+    uint64_t sector_count;
+    bool read_only;
+    bool flush; // device has a write cache to be flushed
+    uint32_t seg_max; // data segments per request
+    uint16_t queue_size;
+    virtq_desc* desc;
+    virtq_avail* avail;
+    virtq_used* used;
+    uint16_t avail_idx; // avail->idx not yet published to the device
+    uint16_t last_used_idx;
+    uint16_t free_head; // free descriptors linked by the next field
+    uint16_t free_count;
+    // Header and status of each request, indexed by its head descriptor
+    virtio_blk_req_hdr* hdrs;
+    volatile uint8_t* statuses;
+    uint32_t hdrs_phy_addr;
+    uint32_t statuses_phy_addr;
+    virtio_blk_request** reqs; // transfer of each request, indexed by its head descriptor
+    virtio_blk_request* async; // asynchronous transfers in progress
+    yield_lock lk; // protecting the virtqueue, released while sleeping
+} virtio_blk_drive;
+
+static struct {
+    virtio_blk_drive drives[VIRTIO_BLK_MAX_DRIVES];
+    uint32_t drive_count;
+    uint16_t irq_registered; // bitmap of IRQ lines the handler is registered to
+} vblk;
+
+static uint16_t virtq_alloc_desc(virtio_blk_drive* d)
+{
+    PANIC_ASSERT(d->free_count > 0);
+    uint16_t idx = d->free_head;
+    d->free_head = d->desc[idx].next;
+    d->free_count--;
+    return idx;
+}
+
+static void virtq_free_chain(virtio_blk_drive* d, uint16_t head)
+{
+    uint16_t idx = head;
+    while(1) {
+        uint16_t flags = d->desc[idx].flags;
+        uint16_t next = d->desc[idx].next;
+        d->desc[idx].next = d->free_head;
+        d->free_head = idx;
+        d->free_count++;
+        if(!(flags & VIRTQ_DESC_F_NEXT)) {
+            break;
+        }
+        idx = next;
+    }
+}
+
+static void virtio_blk_advance(virtio_blk_drive* d);
+
+// Retire requests the device has put in the used ring, then carry on with asynchronous transfers
+// d->lk shall be held, it is released while running the callbacks of finished transfers
+static void virtio_blk_collect(virtio_blk_drive* d)
+{
+    while(d->last_used_idx != d->used->idx) {
+        virtq_barrier();
+        volatile virtq_used_elem* e = &d->used->ring[d->last_used_idx % d->queue_size];
+        uint16_t head = (uint16_t) e->id;
+        virtio_blk_request* req = d->reqs[head];
+        if(d->statuses[head] != VIRTIO_BLK_S_OK) {
+            req->result = -1;
+        }
+        req->pending--;
+        d->reqs[head] = NULL;
+        virtq_free_chain(d, head);
+        d->last_used_idx++;
+    }
+    virtio_blk_advance(d);
+}
+
+static void virtio_blk_irq_handler(trapframe* tf)
+{
+    UNUSED_ARG(tf);
+    for(uint32_t i=0; i<vblk.drive_count; i++) {
+        virtio_blk_drive* d = &vblk.drives[i];
+        if(inb(d->iobase + VIRTIO_PCI_ISR) & VIRTIO_ISR_QUEUE) {
+            acquire(&d->lk);
+            virtio_blk_collect(d);
+            release(&d->lk);
+            wakeup(d);
+        }
+    }
+}
+
+// Chain a request into free descriptors: header, data segments of buf, status
+//
+// return: bytes of buf the request covers (zero for flush), -1 if not enough free descriptors,
+//         -2 if the buffer cannot be described
+static int virtio_blk_add_req(virtio_blk_drive* d, uint32_t type, uint64_t LBA, uint8_t* buf, uint32_t byte_count, virtio_blk_request* req)
+{
+    if(byte_count > VIRTIO_BLK_MAX_SECTORS_PER_REQ*512) {
+        byte_count = VIRTIO_BLK_MAX_SECTORS_PER_REQ*512;
+    }
+
+    // Split the buffer at physical discontinuities
+    uint32_t seg_addr[VIRTIO_BLK_MAX_SEGS_PER_REQ];
+    uint32_t seg_len[VIRTIO_BLK_MAX_SEGS_PER_REQ];
+    uint32_t n_seg = 0;
+    uint32_t covered = 0;
+    uint32_t vaddr = (uint32_t) buf;
+    while(covered < byte_count) {
+        uint32_t size = PAGE_SIZE - (vaddr & (PAGE_SIZE - 1));
+        if(size > byte_count - covered) {
+            size = byte_count - covered;
+        }
+        uint32_t paddr = vaddr2paddr(curr_page_dir(), vaddr);
+        if(n_seg > 0 && seg_addr[n_seg-1] + seg_len[n_seg-1] == paddr) {
+            seg_len[n_seg-1] += size;
+        } else {
+            if(n_seg == d->seg_max) {
+                break;
+            }
+            seg_addr[n_seg] = paddr;
+            seg_len[n_seg] = size;
+            n_seg++;
+        }
+        vaddr += size;
+        covered += size;
+    }
+    // A request shall cover whole sectors
+    uint32_t excess = covered % 512;
+    covered -= excess;
+    while(excess > 0) {
+        uint32_t cut = excess < seg_len[n_seg-1] ? excess : seg_len[n_seg-1];
+        seg_len[n_seg-1] -= cut;
+        excess -= cut;
+        if(seg_len[n_seg-1] == 0) {
+            n_seg--;
+        }
+    }
+    if(byte_count > 0 && covered == 0) {
+        return -2;
+    }
+    if(d->free_count < n_seg + 2) {
+        return -1;
+    }
+
+    uint16_t head = virtq_alloc_desc(d);
+    d->hdrs[head] = (virtio_blk_req_hdr) {.type = type, .reserved = 0, .sector = LBA};
+    d->statuses[head] = 0xFF;
+    d->desc[head] = (virtq_desc) {
+        .addr = d->hdrs_phy_addr + head*sizeof(virtio_blk_req_hdr),
+        .len = sizeof(virtio_blk_req_hdr),
+        .flags = VIRTQ_DESC_F_NEXT
+    };
+    uint16_t prev = head;
+    for(uint32_t i=0; i<n_seg; i++) {
+        uint16_t idx = virtq_alloc_desc(d);
+        d->desc[idx] = (virtq_desc) {
+            .addr = seg_addr[i],
+            .len = seg_len[i],
+            .flags = VIRTQ_DESC_F_NEXT | (type == VIRTIO_BLK_T_IN ? VIRTQ_DESC_F_WRITE : 0)
+        };
+        d->desc[prev].next = idx;
+        prev = idx;
+    }
+    uint16_t idx = virtq_alloc_desc(d);
+    d->desc[idx] = (virtq_desc) {
+        .addr = d->statuses_phy_addr + head,
+        .len = 1,
+        .flags = VIRTQ_DESC_F_WRITE
+    };
+    d->desc[prev].next = idx;
+
+    d->reqs[head] = req;
+    req->pending++;
+    d->avail->ring[d->avail_idx % d->queue_size] = head;
+    d->avail_idx++;
+    return covered;
+}
+
+// Publish all requests added since the last kick and notify the device once
+static void virtio_blk_kick(virtio_blk_drive* d)
+{
+    virtq_barrier();
+    d->avail->idx = d->avail_idx;
+    virtq_barrier();
+    if(!(d->used->flags & VIRTQ_USED_F_NO_NOTIFY)) {
+        outw(d->iobase + VIRTIO_PCI_QUEUE_NOTIFY, 0);
+    }
+}
+
+// Wait for any request to complete, d->lk shall be held
+static void virtio_blk_wait(virtio_blk_drive* d)
+{
+    if(curr_proc() != NULL) {
+        sleep(d, &d->lk);
+    } else {
+        // polling during kernel initialization
+        virtio_blk_collect(d);
+    }
+}
+
+// Add as many requests of the transfer as free descriptors allow: data while sectors are left,
+// then the cache flush after writes, d->lk shall be held
+//
+// return: number of requests added
+static uint32_t virtio_blk_fill(virtio_blk_drive* d, virtio_blk_request* req)
+{
+    uint32_t type = req->is_write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    uint32_t added = 0;
+    while(req->issued < req->sector_count && req->result == 0) {
+        uint32_t offset = req->issued*512;
+        int bytes = virtio_blk_add_req(d, type, req->LBA + req->issued, req->buf + offset, req->sector_count*512 - offset, req);
+        if(bytes == -1) {
+            // virtqueue full
+            return added;
+        }
+        if(bytes < 0) {
+            req->result = -1;
+            break;
+        }
+        added++;
+        req->issued += bytes / 512;
+    }
+    if(req->is_write && d->flush && req->result == 0 && req->pending == 0 && !req->flushing) {
+        if(virtio_blk_add_req(d, VIRTIO_BLK_T_FLUSH, 0, NULL, 0, req) >= 0) {
+            req->flushing = true;
+            added++;
+        }
+    }
+    return added;
+}
+
+// Whether all requests of the transfer are done
+static bool virtio_blk_finished(virtio_blk_drive* d, virtio_blk_request* req)
+{
+    if(req->pending > 0) {
+        return false;
+    }
+    if(req->result != 0) {
+        return true;
+    }
+    return req->issued == req->sector_count && (!req->is_write || !d->flush || req->flushing);
+}
+
+// Refill the virtqueue with requests of asynchronous transfers and finish the ones done
+// d->lk shall be held, it is released while running the callbacks
+static void virtio_blk_advance(virtio_blk_drive* d)
+{
+    uint32_t added = 0;
+    virtio_blk_request** pp = &d->async;
+    while(*pp != NULL) {
+        virtio_blk_request* req = *pp;
+        added += virtio_blk_fill(d, req);
+        if(!virtio_blk_finished(d, req)) {
+            pp = &req->next;
+            continue;
+        }
+        *pp = req->next;
+        if(added > 0) {
+            virtio_blk_kick(d);
+            added = 0;
+        }
+        release(&d->lk);
+        req->done(req, req->result);
+        acquire(&d->lk);
+        // the list may have changed meanwhile
+        pp = &d->async;
+    }
+    if(added > 0) {
+        virtio_blk_kick(d);
+    }
+}
+
+// Transfer sectors, refilling the virtqueue with new requests as earlier ones complete
+static int virtio_blk_rw(virtio_blk_drive* d, uint8_t* buf, uint64_t LBA, uint32_t sector_count, bool is_write)
+{
+    if(is_write && d->read_only) {
+        return -1;
+    }
+    virtio_blk_request req = {.is_write = is_write, .buf = buf, .LBA = LBA, .sector_count = sector_count};
+
+    acquire(&d->lk);
+    while(1) {
+        if(virtio_blk_fill(d, &req) > 0) {
+            virtio_blk_kick(d);
+        }
+        if(virtio_blk_finished(d, &req)) {
+            break;
+        }
+        virtio_blk_wait(d);
+    }
+    release(&d->lk);
+    return req.result;
+}
+
+void init_virtio_blk(uint8_t bus, uint8_t device, uint8_t function)
+{
+    if(vblk.drive_count == VIRTIO_BLK_MAX_DRIVES) {
+        printf("VirtIO-Blk: Too many drives, device ignored\n");
+        return;
+    }
+    uint32_t bar0 = PCI_BAR_0(bus, device, function);
+    if(!(bar0 & 1)) {
+        printf("VirtIO-Blk: BAR0 not in I/O space, legacy interface not available\n");
+        return;
+    }
+
+    uint16_t command = PCI_COMMAND(bus, device, function);
+    command |= PCI_COMMAND_IO_SPACE | PCI_COMMAND_BUS_MASTER;
+    command &= ~PCI_COMMAND_INT_DISABLE;
+    PCI_W_COMMAND(bus, device, function, command);
+
+    virtio_blk_drive* d = &vblk.drives[vblk.drive_count];
+    memset(d, 0, sizeof(*d));
+    d->iobase = bar0 & ~0x3;
+    d->irq = PCI_INT_LINE(bus, device, function);
+
+    // Reset and feature negotiation
+    outb(d->iobase + VIRTIO_PCI_STATUS, 0);
+    outb(d->iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+    outb(d->iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+    uint32_t features = inl(d->iobase + VIRTIO_PCI_DEVICE_FEATURES);
+    features &= VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_RO | VIRTIO_BLK_F_FLUSH;
+    outl(d->iobase + VIRTIO_PCI_GUEST_FEATURES, features);
+
+    uint16_t cfg = d->iobase + VIRTIO_PCI_CONFIG;
+    d->sector_count = inl(cfg + VIRTIO_BLK_CFG_CAPACITY) | ((uint64_t) inl(cfg + VIRTIO_BLK_CFG_CAPACITY + 4) << 32);
+    d->read_only = features & VIRTIO_BLK_F_RO;
+    d->flush = features & VIRTIO_BLK_F_FLUSH;
+    d->seg_max = VIRTIO_BLK_MAX_SEGS_PER_REQ;
+    if(features & VIRTIO_BLK_F_SEG_MAX) {
+        uint32_t seg_max = inl(cfg + VIRTIO_BLK_CFG_SEG_MAX);
+        if(seg_max > 0 && seg_max < d->seg_max) {
+            d->seg_max = seg_max;
+        }
+    }
+
+    // Legacy devices dictate the queue size, the used ring starts at the next page after the available ring
+    outw(d->iobase + VIRTIO_PCI_QUEUE_SELECT, 0);
+    d->queue_size = inw(d->iobase + VIRTIO_PCI_QUEUE_SIZE);
+    if(d->queue_size == 0) {
+        printf("VirtIO-Blk: Queue not available\n");
+        outb(d->iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+        return;
+    }
+    uint32_t qsz = d->queue_size;
+    uint32_t used_offset = PAGE_COUNT_FROM_BYTES(sizeof(virtq_desc)*qsz + sizeof(uint16_t)*(3 + qsz))*PAGE_SIZE;
+    uint32_t ring_pages = PAGE_COUNT_FROM_BYTES(used_offset) + PAGE_COUNT_FROM_BYTES(sizeof(uint16_t)*3 + sizeof(virtq_used_elem)*qsz);
+    uint32_t ring_phy_addr;
+    uint8_t* ring = (uint8_t*) alloc_pages_consecutive_frames(curr_page_dir(), ring_pages, true, &ring_phy_addr);
+    memset(ring, 0, ring_pages*PAGE_SIZE);
+    d->desc = (virtq_desc*) ring;
+    d->avail = (virtq_avail*) (ring + sizeof(virtq_desc)*qsz);
+    d->used = (virtq_used*) (ring + used_offset);
+    for(uint32_t i=0; i<qsz; i++) {
+        d->desc[i].next = i + 1;
+    }
+    d->free_head = 0;
+    d->free_count = qsz;
+
+    uint32_t req_pages = PAGE_COUNT_FROM_BYTES((sizeof(virtio_blk_req_hdr) + 1)*qsz);
+    d->hdrs = (virtio_blk_req_hdr*) alloc_pages_consecutive_frames(curr_page_dir(), req_pages, true, &d->hdrs_phy_addr);
+    d->statuses = (uint8_t*) (d->hdrs + qsz);
+    d->statuses_phy_addr = d->hdrs_phy_addr + sizeof(virtio_blk_req_hdr)*qsz;
+    d->reqs = kmalloc(sizeof(virtio_blk_request*)*qsz);
+    memset(d->reqs, 0, sizeof(virtio_blk_request*)*qsz);
+
+    outl(d->iobase + VIRTIO_PCI_QUEUE_PFN, ring_phy_addr / PAGE_SIZE);
+
+    if(!(vblk.irq_registered & (1 << d->irq))) {
+        register_shared_irq_handler(d->irq, virtio_blk_irq_handler);
+        IRQ_clear_mask(d->irq);
+        vblk.irq_registered |= (1 << d->irq);
+    }
+    outb(d->iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+
+    printf("VirtIO-Blk: I/O 0x%x, IRQ %u, %u sectors, queue size %u, RO[%u], FLUSH[%u]\n",
+        d->iobase, d->irq, (uint32_t) d->sector_count, d->queue_size, d->read_only, d->flush);
+    vblk.drive_count++;
+}
+
+uint32_t virtio_blk_drive_count()
+{
+    return vblk.drive_count;
+}
+
+uint64_t virtio_blk_sector_count(uint32_t drive)
+{
+    PANIC_ASSERT(drive < vblk.drive_count);
+    return vblk.drives[drive].sector_count;
+}
+
+bool virtio_blk_read_only(uint32_t drive)
+{
+    PANIC_ASSERT(drive < vblk.drive_count);
+    return vblk.drives[drive].read_only;
+}
+
+// Read sectors from a virtio block device, buf shall be kernel memory
+//
+// return: zero = success, otherwise failed
+int virtio_blk_read_sectors(uint32_t drive, void* buf, uint64_t LBA, uint32_t sector_count)
+{
+    PANIC_ASSERT(drive < vblk.drive_count);
+    return virtio_blk_rw(&vblk.drives[drive], (uint8_t*) buf, LBA, sector_count, false);
+}
+
+// Write sectors to a virtio block device, buf shall be kernel memory
+//
+// return: zero = success, otherwise failed
+int virtio_blk_write_sectors(uint32_t drive, const void* buf, uint64_t LBA, uint32_t sector_count)
+{
+    PANIC_ASSERT(drive < vblk.drive_count);
+    return virtio_blk_rw(&vblk.drives[drive], (uint8_t*) buf, LBA, sector_count, true);
+}
+
+// Transfers a drive takes at once through virtio_blk_submit_sectors()
+uint32_t virtio_blk_queue_depth(uint32_t drive)
+{
+    PANIC_ASSERT(drive < vblk.drive_count);
+    // a request of physically contiguous data takes 3 descriptors
+    uint32_t depth = vblk.drives[drive].queue_size / 3;
+    return depth < VIRTIO_BLK_MAX_QUEUE_DEPTH ? depth : VIRTIO_BLK_MAX_QUEUE_DEPTH;
+}
+
+// Start a transfer and return without waiting for it, its requests are added to the virtqueue
+// as descriptors free up. req->done is called from interrupt context once finished,
+// req->buf shall be kernel memory since the transfer may complete in another process
+//
+// return: zero = started, otherwise failed
+int virtio_blk_submit_sectors(uint32_t drive, virtio_blk_request* req)
+{
+    PANIC_ASSERT(drive < vblk.drive_count);
+    PANIC_ASSERT(req->done != NULL);
+    virtio_blk_drive* d = &vblk.drives[drive];
+    if(req->is_write && d->read_only) {
+        return -1;
+    }
+    req->issued = 0;
+    req->pending = 0;
+    req->result = 0;
+    req->flushing = false;
+    req->next = NULL;
+    acquire(&d->lk);
+    // appended, so that transfers waiting for descriptors are refilled in order
+    virtio_blk_request** pp = &d->async;
+    while(*pp != NULL) {
+        pp = &(*pp)->next;
+    }
+    *pp = req;
+    if(virtio_blk_fill(d, req) > 0) {
+        virtio_blk_kick(d);
+    }
+    if(req->result != 0 && req->pending == 0) {
+        *pp = NULL;
+        release(&d->lk);
+        return -1;
+    }
+    release(&d->lk);
+    return 0;
+}
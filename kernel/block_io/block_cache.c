@@ -0,0 +1,1111 @@
+#include <kernel/block_io.h>
+#include <kernel/heap.h>
+#include <kernel/lock.h>
+#include <kernel/process.h>
+#include <kernel/errno.h>
+#include <kernel/panic.h>
+#include <kernel/paging.h>
+#include <kernel/timer.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+
+// Write-back buffer cache for block storage
+//
+// Each cached block is looked up by (device_id, LBA) through a hash table and kept in a LRU list.
+// When the memory budget is reached, the least recently used buffer is recycled,
+// after being written back to the device if it is dirty.
+// Otherwise dirty buffers are written back by block_cache_sync(), or by the next cache operation
+// once they have been dirty for BLOCK_CACHE_DIRTY_EXPIRE seconds.
+//
+// Sequential reads are detected per stream (a few streams per device, so interleaved
+// files are each followed) and the blocks following them are prefetched with a window
+// doubling on every sequential read. A prefetch following a missed read is submitted
+// together with it and merged into the same transfer; otherwise it is submitted
+// asynchronously and inserted into the cache by a later call once done, so the device
+// reads ahead while the reader works on the cached blocks.
+//
+// Scatter-gather transfers go straight between the device (or cache) and segments holding
+// whole blocks in kernel memory. Partial blocks and user memory, which the device may
+// finish transferring while another address space is active, go through a staging buffer.
+// They are built on storage->read_blocks/write_blocks, so also serve storages not routed
+// through the cache (RAM disks).
+//
+// The cache lock only protects the structures and is dropped during device I/O, so operations
+// of several processes on the same device reach its queue together, to be merged and ordered there.
+// Device transfers in flight are tracked so that they stay coherent with the cache:
+// - A buffer being written back is busy, it is neither changed nor recycled until the write finishes
+// - Writes of a block reach the device in order, a write waits for the ones in flight overlapping it
+// - Data read from the device is only cached if no write to the same blocks finished or was
+//   in flight meanwhile, since it could be older than the blocks written
+
+#define BLOCK_CACHE_HASH_SIZE 1024
+
+// Larger requests bypass the cache, so that bulk transfer (e.g. loading the whole FAT)
+// does not evict everything else
+#define BLOCK_CACHE_MAX_CACHED_BLOCKS 64
+
+// Sequential streams followed per device
+#define BLOCK_CACHE_RA_STREAMS 4
+// Readahead window in blocks, starting from min and doubling up to max
+#define BLOCK_CACHE_RA_MIN_WINDOW 8
+#define BLOCK_CACHE_RA_DEFAULT_MAX_WINDOW 128
+// Asynchronous prefetches outstanding at once
+#define BLOCK_CACHE_RA_INFLIGHT 4
+
+// Blocks staged at once for segments not transferred directly
+// Larger than BLOCK_CACHE_MAX_CACHED_BLOCKS, so bulk transfers of user memory still go to the device
+// as large requests bypassing the cache
+#define BLOCK_CACHE_VEC_STAGE_BLOCKS 128
+
+// Seconds a buffer stays dirty before being written back
+#define BLOCK_CACHE_DIRTY_EXPIRE 5
+
+typedef struct ra_stream {
+    uint32_t next_LBA; // the LBA a sequential read would start at
+    uint32_t window; // 0 until the stream is sequential
+    uint32_t last_used;
+} ra_stream;
+
+// A device transfer in flight
+typedef struct dev_io {
+    uint32_t LBA;
+    uint32_t block_count;
+    bool is_write;
+    bool stale; // a read overlapped by a write that finished meanwhile
+    struct dev_io* next;
+} dev_io;
+
+typedef struct ra_inflight {
+    block_storage* storage;
+    block_request req;
+    dev_io io;
+    bool submitted; // false while being handed to the device, it cannot be waited for yet
+    bool retired; // taken out of its slot, and its blocks cached if still fresh
+    uint32_t refs; // held by its slot (until retired) and by the processes waiting for it
+} ra_inflight;
+
+// Position in a segment list
+typedef struct seg_cursor {
+    const block_segment* segs;
+    uint32_t seg_count;
+    uint32_t idx;
+    uint32_t off; // bytes passed in segs[idx]
+} seg_cursor;
+
+typedef struct block_buf {
+    uint32_t device_id;
+    uint32_t LBA;
+    uint32_t size;
+    bool dirty;
+    bool busy; // being written back
+    bool readahead; // prefetched and not yet read
+    uint32_t dirty_seq; // cache.dirty_seq when the buffer became dirty
+    uint64_t dirty_tick; // timer tick when the buffer became dirty
+    uint8_t* data;
+    struct block_buf* hash_next;
+    struct block_buf* lru_prev; // more recently used
+    struct block_buf* lru_next; // less recently used
+} block_buf;
+
+static struct {
+    sleep_lock lk; // protecting the structures below, not held during device I/O
+    yield_lock wait_lk; // for sleeping until buffers or transfers in flight change, see wait_cache()
+    block_buf* hash[BLOCK_CACHE_HASH_SIZE];
+    block_buf* lru_head; // most recently used
+    block_buf* lru_tail; // least recently used
+    uint32_t budget; // bytes
+    uint32_t used; // bytes of block data held
+    uint32_t dirty_seq; // counting buffers becoming dirty
+    uint64_t writeback_tick; // next timer tick to look for expired dirty buffers
+    block_cache_stats stats;
+    // per-device state below is indexed by the storage slot (see get_block_storage_slot())
+    dev_io* io[MAX_STORAGE_DEV_COUNT]; // transfers in flight
+    ra_stream streams[MAX_STORAGE_DEV_COUNT][BLOCK_CACHE_RA_STREAMS];
+    uint32_t ra_max_window;
+    uint32_t ra_tick;
+    ra_inflight* inflight[MAX_STORAGE_DEV_COUNT][BLOCK_CACHE_RA_INFLIGHT]; // NULL if the slot is free
+    uint32_t inflight_next[MAX_STORAGE_DEV_COUNT]; // slot to reuse when all are taken
+} cache = {.budget = BLOCK_CACHE_DEFAULT_BUDGET, .ra_max_window = BLOCK_CACHE_RA_DEFAULT_MAX_WINDOW};
+
+static inline uint32_t hash_idx(uint32_t device_id, uint32_t LBA)
+{
+    return (LBA ^ (device_id * 2654435761u)) % BLOCK_CACHE_HASH_SIZE;
+}
+
+static block_buf* lookup(uint32_t device_id, uint32_t LBA)
+{
+    block_buf* b = cache.hash[hash_idx(device_id, LBA)];
+    while(b != NULL) {
+        if(b->device_id == device_id && b->LBA == LBA) {
+            return b;
+        }
+        b = b->hash_next;
+    }
+    return NULL;
+}
+
+static void hash_remove(block_buf* b)
+{
+    block_buf** pp = &cache.hash[hash_idx(b->device_id, b->LBA)];
+    while(*pp != b) {
+        pp = &(*pp)->hash_next;
+    }
+    *pp = b->hash_next;
+}
+
+static void lru_remove(block_buf* b)
+{
+    if(b->lru_prev != NULL) {
+        b->lru_prev->lru_next = b->lru_next;
+    } else {
+        cache.lru_head = b->lru_next;
+    }
+    if(b->lru_next != NULL) {
+        b->lru_next->lru_prev = b->lru_prev;
+    } else {
+        cache.lru_tail = b->lru_prev;
+    }
+    b->lru_prev = NULL;
+    b->lru_next = NULL;
+}
+
+static void lru_push_front(block_buf* b)
+{
+    b->lru_prev = NULL;
+    b->lru_next = cache.lru_head;
+    if(cache.lru_head != NULL) {
+        cache.lru_head->lru_prev = b;
+    } else {
+        cache.lru_tail = b;
+    }
+    cache.lru_head = b;
+}
+
+static void touch(block_buf* b)
+{
+    if(cache.lru_head != b) {
+        lru_remove(b);
+        lru_push_front(b);
+    }
+}
+
+static void mark_dirty(block_buf* b)
+{
+    if(!b->dirty) {
+        b->dirty = true;
+        b->dirty_seq = ++cache.dirty_seq;
+        b->dirty_tick = timer_ticks();
+    }
+}
+
+// Sleep until a busy buffer or a transfer in flight finishes, the cache lock is dropped meanwhile
+// wait_lk is taken before dropping the cache lock, so a wakeup_cache() in between is not lost
+static void wait_cache()
+{
+    acquire(&cache.wait_lk);
+    release_sleep(&cache.lk);
+    sleep(&cache.wait_lk, &cache.wait_lk);
+    release(&cache.wait_lk);
+    acquire_sleep(&cache.lk);
+}
+
+static void wakeup_cache()
+{
+    acquire(&cache.wait_lk);
+    wakeup(&cache.wait_lk);
+    release(&cache.wait_lk);
+}
+
+static inline bool overlaps(uint32_t LBA1, uint32_t count1, uint32_t LBA2, uint32_t count2)
+{
+    return LBA1 < LBA2 + count2 && LBA2 < LBA1 + count1;
+}
+
+static void io_begin(block_storage* storage, dev_io* io, uint32_t LBA, uint32_t block_count, bool is_write)
+{
+    dev_io** head = &cache.io[get_block_storage_slot(storage)];
+    *io = (dev_io) {.LBA = LBA, .block_count = block_count, .is_write = is_write, .next = *head};
+    *head = io;
+}
+
+// A finished write makes the overlapping reads in flight stale
+static void io_end(block_storage* storage, dev_io* io)
+{
+    dev_io** pp = &cache.io[get_block_storage_slot(storage)];
+    while(*pp != io) {
+        pp = &(*pp)->next;
+    }
+    *pp = io->next;
+    if(io->is_write) {
+        for(dev_io* o = cache.io[get_block_storage_slot(storage)]; o != NULL; o = o->next) {
+            if(!o->is_write && overlaps(o->LBA, o->block_count, io->LBA, io->block_count)) {
+                o->stale = true;
+            }
+        }
+        wakeup_cache();
+    }
+}
+
+static bool io_write_in_flight(block_storage* storage, uint32_t LBA, uint32_t block_count)
+{
+    for(dev_io* o = cache.io[get_block_storage_slot(storage)]; o != NULL; o = o->next) {
+        if(o->is_write && overlaps(o->LBA, o->block_count, LBA, block_count)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Whether blocks read by the transfer can be cached: no write to them finished or is in flight since it started
+static bool io_fresh(block_storage* storage, dev_io* io)
+{
+    return !io->stale && !io_write_in_flight(storage, io->LBA, io->block_count);
+}
+
+// Write blocks to the device once the writes in flight overlapping them are done, the cache lock is dropped meanwhile
+static int64_t dev_write(block_storage* storage, uint32_t LBA, uint32_t block_count, const void* buff)
+{
+    while(io_write_in_flight(storage, LBA, block_count)) {
+        wait_cache();
+    }
+    dev_io io;
+    io_begin(storage, &io, LBA, block_count, true);
+    release_sleep(&cache.lk);
+    int64_t res = block_io_write(storage, LBA, block_count, buff);
+    acquire_sleep(&cache.lk);
+    io_end(storage, &io);
+    return res;
+}
+
+// Write a dirty buffer back, it is busy meanwhile
+static int write_back(block_buf* b)
+{
+    block_storage* storage = get_block_storage(b->device_id);
+    PANIC_ASSERT(storage != NULL);
+    b->busy = true;
+    int64_t res = dev_write(storage, b->LBA, 1, b->data);
+    b->busy = false;
+    wakeup_cache();
+    if(res != b->size) {
+        return -EIO;
+    }
+    b->dirty = false;
+    cache.stats.writebacks++;
+    return 0;
+}
+
+// Free a buffer, which must not be busy
+static void discard(block_buf* b)
+{
+    lru_remove(b);
+    hash_remove(b);
+    cache.used -= b->size;
+    kfree(b->data);
+    kfree(b);
+}
+
+// Recycle least recently used buffers until another `size` bytes fit in the budget
+// Dirty buffers are written back first, busy ones skipped
+//
+// return: zero = success, otherwise failed to write back a dirty buffer or not enough buffers to recycle
+static int shrink(uint32_t size)
+{
+    block_buf* victim = cache.lru_tail;
+    while(victim != NULL && cache.used + size > cache.budget) {
+        if(victim->busy) {
+            victim = victim->lru_prev;
+            continue;
+        }
+        if(victim->dirty) {
+            if(write_back(victim) < 0) {
+                return -EIO;
+            }
+            // the cache lock was dropped, other buffers may have gone
+            victim = cache.lru_tail;
+            continue;
+        }
+        block_buf* prev = victim->lru_prev;
+        discard(victim);
+        cache.stats.evictions++;
+        victim = prev;
+    }
+    return cache.used + size > cache.budget ? -1 : 0;
+}
+
+// Allocate and insert a buffer for the block, to be filled by the caller
+// Making room may drop the cache lock, so the block is checked again afterwards
+//
+// io: the read that brought the data in, NULL for data written by the caller
+// return: NULL if no room can be made, the block got cached meanwhile, or the data read is no longer fresh
+static block_buf* insert(block_storage* storage, uint32_t LBA, dev_io* io)
+{
+    if(storage->block_size > cache.budget || shrink(storage->block_size) < 0) {
+        return NULL;
+    }
+    if(lookup(storage->device_id, LBA) != NULL || (io != NULL && !io_fresh(storage, io))) {
+        return NULL;
+    }
+    block_buf* b = kmalloc(sizeof(block_buf));
+    *b = (block_buf) {
+        .device_id = storage->device_id,
+        .LBA = LBA,
+        .size = storage->block_size,
+        .dirty = false,
+        .data = kmalloc(storage->block_size)
+    };
+    uint32_t idx = hash_idx(b->device_id, LBA);
+    b->hash_next = cache.hash[idx];
+    cache.hash[idx] = b;
+    lru_push_front(b);
+    cache.used += b->size;
+    return b;
+}
+
+// Cache blocks read by io, blocks cached meanwhile by other operations are newer and kept
+// For a demand read (not readahead), data is updated with these newer blocks
+static void fill(block_storage* storage, dev_io* io, uint32_t LBA, uint32_t block_count, uint8_t* data, bool readahead)
+{
+    for(uint32_t k=0; k<block_count; k++) {
+        uint8_t* d = data + k*storage->block_size;
+        block_buf* b = lookup(storage->device_id, LBA + k);
+        if(b == NULL) {
+            b = insert(storage, LBA + k, io);
+            if(b != NULL) {
+                memmove(b->data, d, b->size);
+                b->readahead = readahead;
+                if(readahead) {
+                    cache.stats.readahead_blocks++;
+                }
+                continue;
+            }
+            b = lookup(storage->device_id, LBA + k);
+        }
+        if(b != NULL && !readahead) {
+            memmove(d, b->data, b->size);
+        }
+    }
+}
+
+// Track the read in the stream it continues, or start a new stream replacing the least recently used one
+//
+// return: readahead window in blocks, 0 if the read is not sequential
+static uint32_t ra_update(block_storage* storage, uint32_t LBA, uint32_t block_count)
+{
+    ra_stream* streams = cache.streams[get_block_storage_slot(storage)];
+    ra_stream* s = NULL;
+    for(uint32_t i=0; i<BLOCK_CACHE_RA_STREAMS; i++) {
+        if(streams[i].last_used != 0 && streams[i].next_LBA == LBA) {
+            s = &streams[i];
+            break;
+        }
+    }
+    if(s != NULL) {
+        s->window = s->window == 0 ? BLOCK_CACHE_RA_MIN_WINDOW : s->window*2;
+        if(s->window > cache.ra_max_window) {
+            s->window = cache.ra_max_window;
+        }
+        cache.stats.readahead_window = s->window;
+    } else {
+        s = &streams[0];
+        for(uint32_t i=1; i<BLOCK_CACHE_RA_STREAMS; i++) {
+            if(streams[i].last_used < s->last_used) {
+                s = &streams[i];
+            }
+        }
+        s->window = 0;
+    }
+    s->next_LBA = LBA + block_count;
+    s->last_used = ++cache.ra_tick;
+    return s->window;
+}
+
+// Prefetch slots of the storage
+static ra_inflight** ra_slots(block_storage* storage)
+{
+    return cache.inflight[get_block_storage_slot(storage)];
+}
+
+// Find the outstanding prefetch covering the block
+//
+// submitted_only: skip prefetches not handed to the device yet
+static ra_inflight* ra_covering(block_storage* storage, uint32_t LBA, bool submitted_only)
+{
+    for(uint32_t i=0; i<BLOCK_CACHE_RA_INFLIGHT; i++) {
+        ra_inflight* f = ra_slots(storage)[i];
+        if(f != NULL && (f->submitted || !submitted_only) && LBA >= f->req.LBA && LBA < f->req.LBA + f->req.block_count) {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+// Block cached or being prefetched
+static bool present(block_storage* storage, uint32_t LBA)
+{
+    return lookup(storage->device_id, LBA) != NULL || ra_covering(storage, LBA, false) != NULL;
+}
+
+// Decide the blocks to prefetch after a sequential read ending at `end`
+// Prefetch is issued once less than half of the window ahead is cached,
+// so that it is done in large transfers rather than a few blocks per read
+//
+// return: number of blocks to prefetch starting from *start
+static uint32_t ra_range(block_storage* storage, uint32_t end, uint32_t window, uint32_t* start)
+{
+    if(end + window > storage->block_count) {
+        window = storage->block_count - end;
+    }
+    uint32_t i = 0;
+    while(i < window && present(storage, end + i)) {
+        i++;
+    }
+    if(i == window || i >= window/2) {
+        return 0;
+    }
+    uint32_t n = 1;
+    while(i + n < window && !present(storage, end + i + n)) {
+        n++;
+    }
+    *start = end + i;
+    return n;
+}
+
+static void ra_put(ra_inflight* f)
+{
+    if(--f->refs == 0) {
+        kfree(f);
+    }
+}
+
+// Take a finished prefetch out of its slot and cache its blocks
+static void ra_retire(ra_inflight* f)
+{
+    ra_inflight** slots = ra_slots(f->storage);
+    for(uint32_t i=0; i<BLOCK_CACHE_RA_INFLIGHT; i++) {
+        if(slots[i] == f) {
+            slots[i] = NULL;
+        }
+    }
+    f->retired = true;
+    if(f->req.result == (int64_t) f->req.block_count*f->storage->block_size) {
+        fill(f->storage, &f->io, f->req.LBA, f->req.block_count, f->req.buff, true);
+    }
+    io_end(f->storage, &f->io);
+    kfree(f->req.buff);
+    // the reference of the slot
+    ra_put(f);
+}
+
+static void ra_wait(ra_inflight* f)
+{
+    f->refs++;
+    release_sleep(&cache.lk);
+    block_io_wait(f->storage, &f->req, 1);
+    acquire_sleep(&cache.lk);
+    if(!f->retired) {
+        ra_retire(f);
+    }
+    ra_put(f);
+}
+
+// Retire prefetches of the storage that have finished without waiting for the others
+static void ra_reap(block_storage* storage)
+{
+    for(uint32_t i=0; i<BLOCK_CACHE_RA_INFLIGHT; i++) {
+        ra_inflight* f = ra_slots(storage)[i];
+        if(f != NULL && f->submitted && block_io_poll(&f->req)) {
+            ra_retire(f);
+        }
+    }
+}
+
+// Start an asynchronous prefetch
+static void ra_submit(block_storage* storage, uint32_t LBA, uint32_t block_count)
+{
+    ra_inflight** slots = ra_slots(storage);
+    uint32_t slot;
+    while(1) {
+        for(slot=0; slot<BLOCK_CACHE_RA_INFLIGHT; slot++) {
+            if(slots[slot] == NULL) {
+                break;
+            }
+        }
+        if(slot < BLOCK_CACHE_RA_INFLIGHT) {
+            break;
+        }
+        uint32_t* next = &cache.inflight_next[get_block_storage_slot(storage)];
+        ra_inflight* f = slots[*next];
+        *next = (*next + 1) % BLOCK_CACHE_RA_INFLIGHT;
+        if(!f->submitted) {
+            // being submitted by another process, leave the prefetch to it
+            return;
+        }
+        ra_wait(f);
+        if(present(storage, LBA)) {
+            // prefetched by another process meanwhile
+            return;
+        }
+    }
+
+    ra_inflight* f = kmalloc(sizeof(ra_inflight));
+    *f = (ra_inflight) {
+        .storage = storage,
+        .req = {
+            .LBA = LBA,
+            .block_count = block_count,
+            .is_write = false,
+            .buff = kmalloc(block_count*storage->block_size)
+        },
+        .refs = 1
+    };
+    io_begin(storage, &f->io, LBA, block_count, false);
+    slots[slot] = f;
+    release_sleep(&cache.lk);
+    block_io_submit_async(storage, &f->req, 1);
+    acquire_sleep(&cache.lk);
+    f->submitted = true;
+}
+
+static int64_t bypass_read(block_storage* storage, uint8_t* buff, uint32_t LBA, uint32_t block_count)
+{
+    dev_io io;
+    io_begin(storage, &io, LBA, block_count, false);
+    release_sleep(&cache.lk);
+    int64_t res = block_io_read(storage, buff, LBA, block_count);
+    acquire_sleep(&cache.lk);
+    io_end(storage, &io);
+    if(res != (int64_t) block_count*storage->block_size) {
+        return -1;
+    }
+    // cached blocks are at least as new as the device
+    for(uint32_t i=0; i<block_count; i++) {
+        block_buf* b = lookup(storage->device_id, LBA + i);
+        if(b != NULL) {
+            memmove(buff + i*storage->block_size, b->data, b->size);
+        }
+    }
+    cache.stats.misses += block_count;
+    return res;
+}
+
+static int64_t bypass_write(block_storage* storage, uint32_t LBA, uint32_t block_count, const uint8_t* buff)
+{
+    // drop cached copies, which are all overwritten
+    // done before the write, so that a write back of an older copy cannot overtake it
+    uint32_t i = 0;
+    while(i < block_count) {
+        block_buf* b = lookup(storage->device_id, LBA + i);
+        if(b != NULL && b->busy) {
+            wait_cache();
+            continue;
+        }
+        if(b != NULL) {
+            discard(b);
+        }
+        i++;
+    }
+    int64_t res = dev_write(storage, LBA, block_count, buff);
+    if(res != (int64_t) block_count*storage->block_size) {
+        return -1;
+    }
+    return res;
+}
+
+// Write back the buffers of the storage that became dirty up to seq, as well as the ones in flight
+// Dirty buffers are submitted as one batch, so the device queue can sort them and merge adjacent ones into large writes
+static int sync_storage(block_storage* storage, uint32_t seq)
+{
+    int res = 0;
+    while(res == 0) {
+        uint32_t count = 0;
+        bool in_flight = false;
+        for(block_buf* b = cache.lru_head; b != NULL; b = b->lru_next) {
+            if(b->dirty && b->device_id == storage->device_id && (int32_t) (b->dirty_seq - seq) <= 0) {
+                if(b->busy || io_write_in_flight(storage, b->LBA, 1)) {
+                    in_flight = true;
+                } else {
+                    count++;
+                }
+            }
+        }
+        if(count == 0) {
+            if(!in_flight) {
+                break;
+            }
+            wait_cache();
+            continue;
+        }
+
+        block_request* reqs = kmalloc(count*sizeof(block_request));
+        block_buf** bufs = kmalloc(count*sizeof(block_buf*));
+        dev_io* ios = kmalloc(count*sizeof(dev_io));
+        uint32_t i = 0;
+        for(block_buf* b = cache.lru_head; b != NULL && i < count; b = b->lru_next) {
+            if(b->dirty && b->device_id == storage->device_id && (int32_t) (b->dirty_seq - seq) <= 0
+                && !b->busy && !io_write_in_flight(storage, b->LBA, 1)) {
+                reqs[i] = (block_request) {.LBA = b->LBA, .block_count = 1, .is_write = true, .buff = b->data};
+                io_begin(storage, &ios[i], b->LBA, 1, true);
+                b->busy = true;
+                bufs[i] = b;
+                i++;
+            }
+        }
+        release_sleep(&cache.lk);
+        if(block_io_submit(storage, reqs, count) < 0) {
+            res = -EIO;
+        }
+        acquire_sleep(&cache.lk);
+        for(i=0; i<count; i++) {
+            io_end(storage, &ios[i]);
+            bufs[i]->busy = false;
+            if(reqs[i].result == bufs[i]->size) {
+                bufs[i]->dirty = false;
+                cache.stats.writebacks++;
+            }
+        }
+        kfree(reqs);
+        kfree(bufs);
+        kfree(ios);
+    }
+    return res;
+}
+
+// Write back the buffers dirty for longer than BLOCK_CACHE_DIRTY_EXPIRE seconds, looking at most once a second
+// Failed ones stay dirty and are retried next time
+static void writeback_expired()
+{
+    uint64_t now = timer_ticks();
+    uint32_t freq = timer_frequency();
+    if(freq == 0 || now < cache.writeback_tick) {
+        return;
+    }
+    cache.writeback_tick = now + freq;
+    for(uint32_t i=0; i<MAX_STORAGE_DEV_COUNT; i++) {
+        block_storage* storage = get_block_storage_at(i);
+        if(storage == NULL) {
+            continue;
+        }
+        // buffers become dirty in the order of dirty_seq, so the expired ones are those
+        // up to the last expired
+        bool expired = false;
+        uint32_t seq = 0;
+        for(block_buf* b = cache.lru_head; b != NULL; b = b->lru_next) {
+            if(b->dirty && b->device_id == storage->device_id
+                && b->dirty_tick + (uint64_t) BLOCK_CACHE_DIRTY_EXPIRE*freq <= now
+                && (!expired || (int32_t) (b->dirty_seq - seq) > 0)) {
+                seq = b->dirty_seq;
+                expired = true;
+            }
+        }
+        if(expired) {
+            sync_storage(storage, seq);
+        }
+    }
+}
+
+int64_t block_cache_read_blocks(block_storage* storage, void* buff, uint32_t LBA, uint32_t block_count)
+{
+    if(LBA >= storage->block_count || LBA + block_count > storage->block_count) {
+        return -1;
+    }
+
+    acquire_sleep(&cache.lk);
+    ra_reap(storage);
+    writeback_expired();
+
+    int64_t res = (int64_t) block_count*storage->block_size;
+    uint8_t* dst = (uint8_t*) buff;
+    uint8_t* ra_buf = NULL;
+    uint32_t ra_window = ra_update(storage, LBA, block_count);
+    if(block_count > BLOCK_CACHE_MAX_CACHED_BLOCKS) {
+        res = bypass_read(storage, dst, LBA, block_count);
+        goto ret;
+    }
+
+    uint32_t ra_start = 0;
+    uint32_t ra_count = 0;
+    if(ra_window > 0) {
+        ra_count = ra_range(storage, LBA + block_count, ra_window, &ra_start);
+    }
+    uint32_t i = 0;
+    while(i < block_count) {
+        block_buf* b = lookup(storage->device_id, LBA + i);
+        if(b != NULL) {
+            memmove(dst + i*storage->block_size, b->data, b->size);
+            touch(b);
+            cache.stats.hits++;
+            if(b->readahead) {
+                b->readahead = false;
+                cache.stats.readahead_hits++;
+            }
+            i++;
+            continue;
+        }
+        ra_inflight* f = ra_covering(storage, LBA + i, true);
+        if(f != NULL) {
+            // being prefetched, the block is cached once done (unless no room)
+            ra_wait(f);
+            continue;
+        }
+        // read consecutive missing blocks from the device at once
+        uint32_t n = 1;
+        while(i + n < block_count && !present(storage, LBA + i + n)) {
+            n++;
+        }
+        block_request reqs[2] = {
+            {.LBA = LBA + i, .block_count = n, .is_write = false, .buff = dst + i*storage->block_size},
+            {.LBA = ra_start, .block_count = ra_count, .is_write = false, .buff = ra_buf}
+        };
+        dev_io ios[2];
+        // submit the prefetch along with the last missing run, so they are merged if adjacent
+        uint32_t req_count = (ra_count > 0 && i + n == block_count) ? 2 : 1;
+        if(req_count == 2) {
+            ra_buf = kmalloc(ra_count*storage->block_size);
+            reqs[1].buff = ra_buf;
+        }
+        for(uint32_t k=0; k<req_count; k++) {
+            io_begin(storage, &ios[k], reqs[k].LBA, reqs[k].block_count, false);
+        }
+        release_sleep(&cache.lk);
+        int batch_res = block_io_submit(storage, reqs, req_count);
+        acquire_sleep(&cache.lk);
+        if(reqs[0].result != (int64_t) n*storage->block_size) {
+            for(uint32_t k=0; k<req_count; k++) {
+                io_end(storage, &ios[k]);
+            }
+            res = -1;
+            goto ret;
+        }
+        cache.stats.misses += n;
+        fill(storage, &ios[0], LBA + i, n, dst + i*storage->block_size, false);
+        io_end(storage, &ios[0]);
+        if(req_count == 2) {
+            if(batch_res == 0) {
+                fill(storage, &ios[1], ra_start, ra_count, ra_buf, true);
+            }
+            io_end(storage, &ios[1]);
+            ra_count = 0;
+        }
+        i += n;
+    }
+
+    if(ra_count > 0) {
+        // the read was served from the cache, prefetch in the background
+        ra_submit(storage, ra_start, ra_count);
+    }
+
+ret:
+    if(ra_buf != NULL) {
+        kfree(ra_buf);
+    }
+    release_sleep(&cache.lk);
+    return res;
+}
+
+int64_t block_cache_write_blocks(block_storage* storage, uint32_t LBA, uint32_t block_count, const void* buff)
+{
+    if(LBA >= storage->block_count || LBA + block_count > storage->block_count) {
+        return -1;
+    }
+
+    acquire_sleep(&cache.lk);
+    ra_reap(storage);
+    writeback_expired();
+
+    int64_t res = (int64_t) block_count*storage->block_size;
+    const uint8_t* src = (const uint8_t*) buff;
+    if(block_count > BLOCK_CACHE_MAX_CACHED_BLOCKS) {
+        res = bypass_write(storage, LBA, block_count, src);
+        goto ret;
+    }
+
+    uint32_t i = 0;
+    while(i < block_count) {
+        block_buf* b = lookup(storage->device_id, LBA + i);
+        if(b == NULL) {
+            b = insert(storage, LBA + i, NULL);
+        }
+        if(b == NULL && (b = lookup(storage->device_id, LBA + i)) == NULL) {
+            // write through if no room in the cache
+            if(dev_write(storage, LBA + i, 1, src + i*storage->block_size) != storage->block_size) {
+                res = -1;
+                goto ret;
+            }
+            i++;
+            continue;
+        }
+        if(b->busy) {
+            // being written back, the data shall not change until done
+            wait_cache();
+            continue;
+        }
+        memmove(b->data, src + i*storage->block_size, b->size);
+        mark_dirty(b);
+        touch(b);
+        i++;
+    }
+
+ret:
+    release_sleep(&cache.lk);
+    return res;
+}
+
+// Total size of the segments in blocks
+//
+// return: zero = success, otherwise the size is not a multiple of the block size
+static int vec_block_count(block_storage* storage, const block_segment* segs, uint32_t seg_count, uint32_t* block_count)
+{
+    uint64_t size = 0;
+    for(uint32_t i=0; i<seg_count; i++) {
+        size += segs[i].size;
+    }
+    if(size % storage->block_size != 0 || size / storage->block_size > storage->block_count) {
+        return -1;
+    }
+    *block_count = size / storage->block_size;
+    return 0;
+}
+
+static void seg_skip_empty(seg_cursor* c)
+{
+    while(c->idx < c->seg_count && c->off == c->segs[c->idx].size) {
+        c->idx++;
+        c->off = 0;
+    }
+}
+
+// Advance the cursor by size bytes, copying them to (to_segs) or from the segments if buff is not NULL
+//
+// return: bytes passed in skipped segments
+static uint32_t seg_move(seg_cursor* c, uint8_t* buff, uint32_t size, bool to_segs)
+{
+    uint32_t skipped = 0;
+    uint32_t done = 0;
+    while(done < size) {
+        seg_skip_empty(c);
+        const block_segment* s = &c->segs[c->idx];
+        uint32_t n = s->size - c->off;
+        if(n > size - done) {
+            n = size - done;
+        }
+        if(s->buff == NULL) {
+            skipped += n;
+        } else if(buff != NULL) {
+            if(to_segs) {
+                memmove((uint8_t*) s->buff + c->off, buff + done, n);
+            } else {
+                memmove(buff + done, (uint8_t*) s->buff + c->off, n);
+            }
+        }
+        c->off += n;
+        done += n;
+    }
+    return skipped;
+}
+
+// Number of leading blocks lying entirely in skipped segments, the cursor is advanced past them
+static uint32_t seg_skip_blocks(block_storage* storage, seg_cursor* c, uint32_t max)
+{
+    uint32_t n = 0;
+    while(n < max) {
+        seg_cursor t = *c;
+        if(seg_move(&t, NULL, storage->block_size, false) != storage->block_size) {
+            break;
+        }
+        *c = t;
+        n++;
+    }
+    return n;
+}
+
+// Whole blocks the device can transfer directly at the cursor
+static uint32_t seg_direct_blocks(block_storage* storage, seg_cursor* c)
+{
+    seg_skip_empty(c);
+    const block_segment* s = &c->segs[c->idx];
+    if(s->buff == NULL || (uint32_t) s->buff < (uint32_t) MAP_MEM_PA_ZERO_TO) {
+        return 0;
+    }
+    return (s->size - c->off) / storage->block_size;
+}
+
+// Number of blocks to stage at the cursor, up to the next block transferred directly or skipped
+static uint32_t seg_stage_blocks(block_storage* storage, const seg_cursor* c, uint32_t max)
+{
+    if(max > BLOCK_CACHE_VEC_STAGE_BLOCKS) {
+        max = BLOCK_CACHE_VEC_STAGE_BLOCKS;
+    }
+    seg_cursor t = *c;
+    uint32_t n = 0;
+    do {
+        seg_move(&t, NULL, storage->block_size, false);
+        n++;
+        if(n < max) {
+            seg_cursor u = t;
+            if(seg_direct_blocks(storage, &u) > 0 || seg_skip_blocks(storage, &u, 1) > 0) {
+                break;
+            }
+        }
+    } while(n < max);
+    return n;
+}
+
+// Size of the staging buffer for a transfer of block_count blocks
+static uint32_t vec_stage_blocks(uint32_t block_count)
+{
+    return block_count < BLOCK_CACHE_VEC_STAGE_BLOCKS ? block_count : BLOCK_CACHE_VEC_STAGE_BLOCKS;
+}
+
+// Read blocks from LBA scattering them into the segments in order
+// Blocks lying entirely in skipped segments are not read
+//
+// return: bytes covered by the segments, negative on error
+int64_t block_cache_read_blocks_vec(block_storage* storage, const block_segment* segs, uint32_t seg_count, uint32_t LBA)
+{
+    uint32_t block_count;
+    if(vec_block_count(storage, segs, seg_count, &block_count) < 0) {
+        return -1;
+    }
+
+    int64_t res = (int64_t) block_count*storage->block_size;
+    seg_cursor c = {.segs = segs, .seg_count = seg_count};
+    uint8_t* stage = NULL;
+    uint32_t i = 0;
+    while(i < block_count) {
+        uint32_t n = seg_skip_blocks(storage, &c, block_count - i);
+        if(n > 0) {
+            i += n;
+            continue;
+        }
+        n = seg_direct_blocks(storage, &c);
+        if(n > 0) {
+            uint8_t* dst = (uint8_t*) c.segs[c.idx].buff + c.off;
+            if(storage->read_blocks(storage, dst, LBA + i, n) != (int64_t) n*storage->block_size) {
+                res = -1;
+                break;
+            }
+            c.off += n*storage->block_size;
+        } else {
+            n = seg_stage_blocks(storage, &c, block_count - i);
+            if(stage == NULL) {
+                stage = kmalloc(vec_stage_blocks(block_count)*storage->block_size);
+            }
+            if(storage->read_blocks(storage, stage, LBA + i, n) != (int64_t) n*storage->block_size) {
+                res = -1;
+                break;
+            }
+            seg_move(&c, stage, n*storage->block_size, true);
+        }
+        i += n;
+    }
+    if(stage != NULL) {
+        kfree(stage);
+    }
+    return res;
+}
+
+// Write blocks from LBA gathering them from the segments in order
+// Bytes in skipped segments keep the content on the device, so a write can cover part of a block
+//
+// return: bytes covered by the segments, negative on error
+int64_t block_cache_write_blocks_vec(block_storage* storage, uint32_t LBA, const block_segment* segs, uint32_t seg_count)
+{
+    uint32_t block_count;
+    if(vec_block_count(storage, segs, seg_count, &block_count) < 0) {
+        return -1;
+    }
+
+    int64_t res = (int64_t) block_count*storage->block_size;
+    seg_cursor c = {.segs = segs, .seg_count = seg_count};
+    uint8_t* stage = NULL;
+    uint32_t i = 0;
+    while(i < block_count) {
+        uint32_t n = seg_skip_blocks(storage, &c, block_count - i);
+        if(n > 0) {
+            i += n;
+            continue;
+        }
+        n = seg_direct_blocks(storage, &c);
+        if(n > 0) {
+            const uint8_t* src = (const uint8_t*) c.segs[c.idx].buff + c.off;
+            if(storage->write_blocks(storage, LBA + i, n, src) != (int64_t) n*storage->block_size) {
+                res = -1;
+                break;
+            }
+            c.off += n*storage->block_size;
+        } else {
+            n = seg_stage_blocks(storage, &c, block_count - i);
+            if(stage == NULL) {
+                stage = kmalloc(vec_stage_blocks(block_count)*storage->block_size);
+            }
+            // only partially written blocks need reading, to keep the rest as on the device
+            seg_cursor t = c;
+            for(uint32_t k = 0; k < n && res >= 0; k++) {
+                if(seg_move(&t, NULL, storage->block_size, false) > 0
+                    && storage->read_blocks(storage, stage + k*storage->block_size, LBA + i + k, 1) != storage->block_size) {
+                    res = -1;
+                }
+            }
+            if(res < 0) {
+                break;
+            }
+            seg_move(&c, stage, n*storage->block_size, false);
+            if(storage->write_blocks(storage, LBA + i, n, stage) != (int64_t) n*storage->block_size) {
+                res = -1;
+                break;
+            }
+        }
+        i += n;
+    }
+    if(stage != NULL) {
+        kfree(stage);
+    }
+    return res;
+}
+
+// Write all dirty buffers of a device back
+// Blocks written before the call are on the device once it returns, so it also serves as a write barrier
+//
+// device_id: 0 for all devices
+// return: zero = success, otherwise failed
+int block_cache_sync(uint32_t device_id)
+{
+    int res = 0;
+    for(uint32_t i=0; i<MAX_STORAGE_DEV_COUNT; i++) {
+        block_storage* storage = get_block_storage_at(i);
+        if(storage == NULL || (device_id != 0 && storage->device_id != device_id)) {
+            continue;
+        }
+        acquire_sleep(&cache.lk);
+        if(sync_storage(storage, cache.dirty_seq) < 0) {
+            res = -EIO;
+        }
+        release_sleep(&cache.lk);
+    }
+    return res;
+}
+
+// Set the memory budget of the cache, recycling buffers if currently over the budget
+void block_cache_set_budget(uint32_t bytes)
+{
+    acquire_sleep(&cache.lk);
+    cache.budget = bytes;
+    shrink(0);
+    release_sleep(&cache.lk);
+}
+
+// Set the largest readahead window in blocks, 0 disables readahead
+void block_cache_set_readahead(uint32_t max_window)
+{
+    acquire_sleep(&cache.lk);
+    cache.ra_max_window = max_window;
+    release_sleep(&cache.lk);
+}
+
+void block_cache_get_stats(block_cache_stats* stats)
+{
+    acquire_sleep(&cache.lk);
+    *stats = cache.stats;
+    release_sleep(&cache.lk);
+}
@@ -1,19 +1,62 @@
 #include <kernel/block_io.h>
 #include <stddef.h>
 #include <kernel/ata.h>
+#include <kernel/ahci.h>
+#include <kernel/virtio_blk.h>
+#include <kernel/nvme.h>
+#include <kernel/ramdisk.h>
 #include <kernel/panic.h>
 #include <kernel/heap.h>
 #include <kernel/lock.h>
+#include <kernel/process.h>
+#include <kernel/errno.h>
+#include <string.h>
 
-#define MAX_STORAGE_DEV_COUNT 8
+// Largest transfer made by merging adjacent requests
+#define BLOCK_QUEUE_MAX_MERGE_BLOCKS 256
+// A request passed over by this many dispatches is served next regardless of the elevator
+#define BLOCK_QUEUE_MAX_WAIT 32
+// Most asynchronous transfers outstanding per device, whatever the depth of the driver
+#define BLOCK_QUEUE_MAX_DEPTH 32
+
+// An asynchronous transfer handed to the driver
+typedef struct block_xfer {
+    block_request req; // first member, so the completion callback finds the transfer
+    block_request* reqs; // requests served, NULL if the transfer is free
+    bool failed; // waits to be retried synchronously
+} block_xfer;
+
+// Pending requests of a device, dispatched in C-LOOK (one-way elevator) order
+// with adjacent requests of the same direction merged into one transfer
+//
+// Devices with asynchronous access (dev_submit) are fed from completion interrupts,
+// keeping up to storage->queue_depth transfers outstanding, so submitters need not wait.
+// A transfer overlapping an outstanding one, either of them being a write, waits for it,
+// so that such transfers are still done in dispatch order.
+// A failed asynchronous transfer is retried once through the synchronous driver routines
+// (PIO for ATA), which cannot run in interrupt context, by the next process waiting on the queue.
+// For other devices there is no I/O thread, the first process finding the queue idle drains it
+// (serving requests of other processes as well) until its own requests are done
+typedef struct block_queue {
+    yield_lock lk;
+    block_request* pending; // sorted by LBA
+    uint32_t next_LBA; // where the last transfer dispatched ends
+    uint32_t seq; // number of dispatches
+    bool dispatching; // a synchronous transfer is at the device
+    uint32_t inflight; // asynchronous transfers outstanding, failed ones included until retried
+    block_xfer xfers[BLOCK_QUEUE_MAX_DEPTH];
+} block_queue;
 
 typedef struct ata_storage_info {
-    bool is_slave;
+    uint8_t drive; // 0 to 3, primary master/slave then secondary master/slave
+    bool use_dma;
+    ATA_DMA_request dma_req; // asynchronous transfer in progress
 } ata_storage_info;
 
 static struct {
     uint32_t next_block_dev_id;
     block_storage storage_list[MAX_STORAGE_DEV_COUNT];
+    block_queue queues[MAX_STORAGE_DEV_COUNT]; // queue of the storage in the same slot
     yield_lock lk;
 } blk;
 
@@ -24,7 +67,11 @@ static int64_t read_blocks_ata(block_storage* storage, void* buff,  uint32_t LBA
     if(LBA >= storage->block_count || LBA + block_count >= storage->block_count) {
         return -1;
     }
-    read_sectors_ATA_PIO(info->is_slave, buff, LBA, block_count);
+    if(info->use_dma && read_sectors_ATA_DMA(info->drive, buff, LBA, block_count) == 0) {
+        return 512 * block_count;
+    }
+    // PIO as fallback
+    read_sectors_ATA_PIO(info->drive, buff, LBA, block_count);
     return 512 * block_count;
 }
 
@@ -35,14 +82,238 @@ static int64_t write_blocks_ata(block_storage* storage, uint32_t LBA, uint32_t b
     if(LBA >= storage->block_count || LBA + block_count >= storage->block_count) {
         return -1;
     }
-    write_sectors_ATA_PIO(info->is_slave, buff, LBA, block_count);
+    if(info->use_dma && write_sectors_ATA_DMA(info->drive, buff, LBA, block_count) == 0) {
+        return 512 * block_count;
+    }
+    // PIO as fallback
+    write_sectors_ATA_PIO(info->drive, buff, LBA, block_count);
     return 512 * block_count;
 }
 
+static void ata_dma_done(ATA_DMA_request* dma_req, int result)
+{
+    block_request* req = (block_request*) dma_req->ctx;
+    req->result = result == 0 ? (int64_t) dma_req->sector_count*512 : -EIO;
+    req->callback(req);
+}
+
+// Start a bus master DMA transfer, completed from the IRQ of the drive's channel
+static int submit_blocks_ata(block_storage* storage, block_request* req)
+{
+    ata_storage_info* info = (ata_storage_info*) storage->internal_info;
+    info->dma_req = (ATA_DMA_request) {
+        .drive = info->drive,
+        .is_write = req->is_write,
+        .buf = req->buff,
+        .LBA = req->LBA,
+        .sector_count = req->block_count,
+        .done = ata_dma_done,
+        .ctx = req
+    };
+    return submit_sectors_ATA_DMA(&info->dma_req);
+}
+
+typedef struct ahci_storage_info {
+    uint32_t drive;
+    ahci_request reqs[BLOCK_QUEUE_MAX_DEPTH]; // asynchronous transfers in progress, free if ctx is NULL
+} ahci_storage_info;
+
+static int64_t read_blocks_ahci(block_storage* storage, void* buff,  uint32_t LBA, uint32_t block_count)
+{
+    ahci_storage_info* info = (ahci_storage_info*) storage->internal_info;
+    if(ahci_read_sectors(info->drive, buff, LBA, block_count) != 0) {
+        return -1;
+    }
+    return storage->block_size * block_count;
+}
+
+static int64_t write_blocks_ahci(block_storage* storage, uint32_t LBA, uint32_t block_count, const void* buff)
+{
+    ahci_storage_info* info = (ahci_storage_info*) storage->internal_info;
+    if(ahci_write_sectors(info->drive, buff, LBA, block_count) != 0) {
+        return -1;
+    }
+    return storage->block_size * block_count;
+}
+
+static void ahci_done(ahci_request* ahci_req, int result)
+{
+    block_request* req = (block_request*) ahci_req->ctx;
+    ahci_req->ctx = NULL;
+    req->result = result == 0 ? (int64_t) ahci_req->sector_count*512 : -EIO;
+    req->callback(req);
+}
+
+// Issue the transfer in NCQ (or DMA) commands, completed from the IRQ of the controller
+static int submit_blocks_ahci(block_storage* storage, block_request* req)
+{
+    ahci_storage_info* info = (ahci_storage_info*) storage->internal_info;
+    // the queue has no more transfers outstanding than requests here
+    ahci_request* ahci_req = &info->reqs[0];
+    while(ahci_req->ctx != NULL) {
+        ahci_req++;
+    }
+    *ahci_req = (ahci_request) {
+        .drive = info->drive,
+        .is_write = req->is_write,
+        .buf = req->buff,
+        .LBA = req->LBA,
+        .sector_count = req->block_count,
+        .done = ahci_done,
+        .ctx = req
+    };
+    int res = ahci_submit_sectors(ahci_req);
+    if(res < 0) {
+        ahci_req->ctx = NULL;
+    }
+    return res;
+}
+
+typedef struct virtio_blk_storage_info {
+    uint32_t drive;
+    virtio_blk_request reqs[BLOCK_QUEUE_MAX_DEPTH]; // asynchronous transfers in progress, free if ctx is NULL
+} virtio_blk_storage_info;
+
+static int64_t read_blocks_virtio_blk(block_storage* storage, void* buff,  uint32_t LBA, uint32_t block_count)
+{
+    virtio_blk_storage_info* info = (virtio_blk_storage_info*) storage->internal_info;
+    if(virtio_blk_read_sectors(info->drive, buff, LBA, block_count) != 0) {
+        return -1;
+    }
+    return storage->block_size * block_count;
+}
+
+static int64_t write_blocks_virtio_blk(block_storage* storage, uint32_t LBA, uint32_t block_count, const void* buff)
+{
+    virtio_blk_storage_info* info = (virtio_blk_storage_info*) storage->internal_info;
+    if(virtio_blk_write_sectors(info->drive, buff, LBA, block_count) != 0) {
+        return -1;
+    }
+    return storage->block_size * block_count;
+}
+
+static void virtio_blk_done(virtio_blk_request* vreq, int result)
+{
+    block_request* req = (block_request*) vreq->ctx;
+    vreq->ctx = NULL;
+    req->result = result == 0 ? (int64_t) vreq->sector_count*512 : -EIO;
+    req->callback(req);
+}
+
+// Add the transfer to the virtqueue, completed from the IRQ of the device
+static int submit_blocks_virtio_blk(block_storage* storage, block_request* req)
+{
+    virtio_blk_storage_info* info = (virtio_blk_storage_info*) storage->internal_info;
+    // the queue has no more transfers outstanding than requests here
+    virtio_blk_request* vreq = &info->reqs[0];
+    while(vreq->ctx != NULL) {
+        vreq++;
+    }
+    *vreq = (virtio_blk_request) {
+        .is_write = req->is_write,
+        .buf = req->buff,
+        .LBA = req->LBA,
+        .sector_count = req->block_count,
+        .done = virtio_blk_done,
+        .ctx = req
+    };
+    int res = virtio_blk_submit_sectors(info->drive, vreq);
+    if(res < 0) {
+        vreq->ctx = NULL;
+    }
+    return res;
+}
+
+typedef struct nvme_storage_info {
+    uint32_t ns;
+    nvme_request reqs[BLOCK_QUEUE_MAX_DEPTH]; // asynchronous transfers in progress, free if ctx is NULL
+} nvme_storage_info;
+
+static int64_t read_blocks_nvme(block_storage* storage, void* buff,  uint32_t LBA, uint32_t block_count)
+{
+    nvme_storage_info* info = (nvme_storage_info*) storage->internal_info;
+    if(nvme_read_sectors(info->ns, buff, LBA, block_count) != 0) {
+        return -1;
+    }
+    return storage->block_size * block_count;
+}
+
+static int64_t write_blocks_nvme(block_storage* storage, uint32_t LBA, uint32_t block_count, const void* buff)
+{
+    nvme_storage_info* info = (nvme_storage_info*) storage->internal_info;
+    if(nvme_write_sectors(info->ns, buff, LBA, block_count) != 0) {
+        return -1;
+    }
+    return storage->block_size * block_count;
+}
+
+static void nvme_done(nvme_request* nreq, int result)
+{
+    block_request* req = (block_request*) nreq->ctx;
+    nreq->ctx = NULL;
+    req->result = result == 0 ? (int64_t) nreq->sector_count*512 : -EIO;
+    req->callback(req);
+}
+
+// Submit the transfer to the I/O queue, completed from the IRQ of the controller
+static int submit_blocks_nvme(block_storage* storage, block_request* req)
+{
+    nvme_storage_info* info = (nvme_storage_info*) storage->internal_info;
+    // the queue has no more transfers outstanding than requests here
+    nvme_request* nreq = &info->reqs[0];
+    while(nreq->ctx != NULL) {
+        nreq++;
+    }
+    *nreq = (nvme_request) {
+        .is_write = req->is_write,
+        .buf = req->buff,
+        .LBA = req->LBA,
+        .sector_count = req->block_count,
+        .done = nvme_done,
+        .ctx = req
+    };
+    int res = nvme_submit_sectors(info->ns, nreq);
+    if(res < 0) {
+        nreq->ctx = NULL;
+    }
+    return res;
+}
+
+typedef struct ramdisk_storage_info {
+    uint32_t disk;
+} ramdisk_storage_info;
+
+static int64_t read_blocks_ramdisk(block_storage* storage, void* buff,  uint32_t LBA, uint32_t block_count)
+{
+    ramdisk_storage_info* info = (ramdisk_storage_info*) storage->internal_info;
+    if(ramdisk_read_sectors(info->disk, buff, LBA, block_count) != 0) {
+        return -1;
+    }
+    return storage->block_size * block_count;
+}
+
+static int64_t write_blocks_ramdisk(block_storage* storage, uint32_t LBA, uint32_t block_count, const void* buff)
+{
+    ramdisk_storage_info* info = (ramdisk_storage_info*) storage->internal_info;
+    if(ramdisk_write_sectors(info->disk, buff, LBA, block_count) != 0) {
+        return -1;
+    }
+    return storage->block_size * block_count;
+}
+
 static void add_block_storage(block_storage* storage)
 {
     acquire(&blk.lk);
     storage->device_id = blk.next_block_dev_id++;
+    // Route all access through the buffer cache, except for RAM disks which are memory already
+    storage->dev_read_blocks = storage->read_blocks;
+    storage->dev_write_blocks = storage->write_blocks;
+    if(storage->type != BLK_STORAGE_TYP_RAMDISK) {
+        storage->read_blocks = block_cache_read_blocks;
+        storage->write_blocks = block_cache_write_blocks;
+    }
+    storage->read_blocks_vec = block_cache_read_blocks_vec;
+    storage->write_blocks_vec = block_cache_write_blocks_vec;
     for(uint32_t i=0; i<MAX_STORAGE_DEV_COUNT; i++) {
         if(blk.storage_list[i].device_id == 0) {
             //id == 0 means unused slot
@@ -64,43 +335,564 @@ block_storage* get_block_storage(uint32_t device_id)
     return NULL;
 }
 
-void initialize_block_storage()
+// Slot of the storage in the storage list, per-device state elsewhere (e.g. the buffer cache) is indexed by it
+// Unlike device ids, which are never reused and skip reserved ones, slots stay below MAX_STORAGE_DEV_COUNT
+uint32_t get_block_storage_slot(block_storage* storage)
 {
-    blk.next_block_dev_id = 1; //ID starts from 1, 0 means unused
+    PANIC_ASSERT(storage >= blk.storage_list && storage < blk.storage_list + MAX_STORAGE_DEV_COUNT);
+    return storage - blk.storage_list;
+}
+
+// Storage in the slot, NULL if unused
+block_storage* get_block_storage_at(uint32_t slot)
+{
+    if(slot >= MAX_STORAGE_DEV_COUNT || blk.storage_list[slot].device_id == 0) {
+        return NULL;
+    }
+    return &blk.storage_list[slot];
+}
+
+static block_queue* get_block_queue(uint32_t device_id)
+{
+    for(uint32_t i=0; i<MAX_STORAGE_DEV_COUNT; i++) {
+        if(blk.storage_list[i].device_id == device_id) {
+            return &blk.queues[i];
+        }
+    }
+    return NULL;
+}
+
+static void queue_insert(block_queue* q, block_request* req)
+{
+    block_request** pp = &q->pending;
+    while(*pp != NULL && (*pp)->LBA <= req->LBA) {
+        pp = &(*pp)->next;
+    }
+    req->next = *pp;
+    *pp = req;
+}
 
-    // Add master/slave IDE devices
-    
-    int32_t total_block_count = get_total_28bit_sectors(false);
-    PANIC_ASSERT(total_block_count > 0);
+// Choose the request to be dispatched next
+static block_request* queue_pick(block_queue* q)
+{
+    for(block_request* r = q->pending; r != NULL; r = r->next) {
+        if(q->seq - r->seq > BLOCK_QUEUE_MAX_WAIT) {
+            return r;
+        }
+    }
+    for(block_request* r = q->pending; r != NULL; r = r->next) {
+        if(r->LBA >= q->next_LBA) {
+            return r;
+        }
+    }
+    // wrap around to the lowest LBA
+    return q->pending;
+}
+
+// The last request merged into a transfer starting from first, adjacent requests
+// of the same direction are merged
+//
+// return: the last request, *total is set to the total block count
+static block_request* queue_merge(block_request* first, uint32_t* total)
+{
+    block_request* last = first;
+    *total = first->block_count;
+    while(last->next != NULL && last->next->LBA == last->LBA + last->block_count
+        && last->next->is_write == first->is_write
+        && *total + last->next->block_count <= BLOCK_QUEUE_MAX_MERGE_BLOCKS) {
+        last = last->next;
+        *total += last->block_count;
+    }
+    return last;
+}
+
+// Whether a transfer shall wait for an outstanding one it overlaps, either of them being a write
+static bool queue_conflicts(block_queue* q, uint32_t LBA, uint32_t total, bool is_write)
+{
+    for(uint32_t i=0; i<BLOCK_QUEUE_MAX_DEPTH; i++) {
+        block_request* x = &q->xfers[i].req;
+        if(q->xfers[i].reqs != NULL && (is_write || x->is_write)
+            && LBA < x->LBA + x->block_count && x->LBA < LBA + total) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Detach the next transfer from the queue: the picked request followed by adjacent
+// requests of the same direction, linked by their next field
+//
+// return: the first request, *total is set to the total block count,
+//         NULL if it conflicts with an outstanding transfer
+static block_request* queue_take(block_queue* q, uint32_t* total)
+{
+    block_request* first = queue_pick(q);
+    block_request* last = queue_merge(first, total);
+    if(queue_conflicts(q, first->LBA, *total, first->is_write)) {
+        return NULL;
+    }
+    q->next_LBA = first->LBA + *total;
+    q->seq++;
+
+    // [first, last] are consecutive in the list
+    block_request** pp = &q->pending;
+    while(*pp != first) {
+        pp = &(*pp)->next;
+    }
+    *pp = last->next;
+    last->next = NULL;
+    return first;
+}
 
-    ata_storage_info* master_info = kmalloc(sizeof(ata_storage_info));
-    master_info->is_slave = false;
-    block_storage master_storage = (block_storage) {
-        .type=BLK_STORAGE_TYP_ATA_HARD_DRIVE, 
+// Buffer for a transfer, merged transfers gather into a temporary buffer
+static uint8_t* queue_xfer_buff(block_storage* storage, block_request* first, uint32_t total)
+{
+    if(first->next == NULL) {
+        return first->buff;
+    }
+    uint8_t* merged = kmalloc(total*storage->block_size);
+    if(first->is_write) {
+        uint8_t* ptr = merged;
+        for(block_request* r = first; r != NULL; r = r->next) {
+            memmove(ptr, r->buff, r->block_count*storage->block_size);
+            ptr += r->block_count*storage->block_size;
+        }
+    }
+    return merged;
+}
+
+// Report the result of a transfer to the requests it served, q->lk shall be held
+// The lock is dropped while running the callbacks, so that they can submit further requests
+static void queue_finish(block_storage* storage, block_queue* q, block_request* first, uint32_t total, uint8_t* buff, int64_t res)
+{
+    bool success = res == (int64_t) total*storage->block_size;
+    if(first->next != NULL) {
+        if(!first->is_write && success) {
+            uint8_t* ptr = buff;
+            for(block_request* r = first; r != NULL; r = r->next) {
+                memmove(r->buff, ptr, r->block_count*storage->block_size);
+                ptr += r->block_count*storage->block_size;
+            }
+        }
+        kfree(buff);
+    }
+
+    release(&q->lk);
+    block_request* r = first;
+    while(r != NULL) {
+        block_request* next = r->next;
+        r->next = NULL;
+        r->result = success ? (int64_t) r->block_count*storage->block_size : -EIO;
+        if(r->callback != NULL) {
+            r->callback(r);
+        }
+        r->done = true;
+        r = next;
+    }
+    wakeup(q);
+    acquire(&q->lk);
+}
+
+// Dispatch the next transfer and wait for it, q->lk is released while the device works
+static void queue_dispatch(block_storage* storage, block_queue* q)
+{
+    uint32_t total;
+    block_request* first = queue_take(q, &total);
+    // no asynchronous transfer is outstanding to conflict with
+    PANIC_ASSERT(first != NULL);
+    uint8_t* buff = queue_xfer_buff(storage, first, total);
+    release(&q->lk);
+
+    int64_t res;
+    if(first->is_write) {
+        res = storage->dev_write_blocks(storage, first->LBA, total, buff);
+    } else {
+        res = storage->dev_read_blocks(storage, buff, first->LBA, total);
+    }
+
+    acquire(&q->lk);
+    queue_finish(storage, q, first, total, buff, res);
+}
+
+// Put the requests of a transfer not dispatched back into the queue
+static void queue_put_back(block_queue* q, block_request* first)
+{
+    while(first != NULL) {
+        block_request* next = first->next;
+        queue_insert(q, first);
+        first = next;
+    }
+}
+
+static void queue_start_async(block_storage* storage, block_queue* q);
+
+// Completion of an asynchronous transfer, called by the driver in interrupt context
+static void queue_xfer_done(block_request* req)
+{
+    block_xfer* xfer = (block_xfer*) req;
+    block_queue* q = (block_queue*) req->private;
+    block_storage* storage = &blk.storage_list[q - blk.queues];
+    acquire(&q->lk);
+    if(req->result != (int64_t) req->block_count*storage->block_size) {
+        // leave it to a process, see queue_retry_failed()
+        xfer->failed = true;
+        release(&q->lk);
+        wakeup(q);
+        return;
+    }
+    block_request* first = xfer->reqs;
+    uint32_t total = req->block_count;
+    uint8_t* buff = req->buff;
+    int64_t res = req->result;
+    xfer->reqs = NULL;
+    q->inflight--;
+    queue_finish(storage, q, first, total, buff, res);
+    // keep the device busy with the next transfer
+    queue_start_async(storage, q);
+    release(&q->lk);
+}
+
+static uint32_t queue_depth(block_storage* storage)
+{
+    if(storage->queue_depth == 0) {
+        return 1;
+    }
+    return storage->queue_depth < BLOCK_QUEUE_MAX_DEPTH ? storage->queue_depth : BLOCK_QUEUE_MAX_DEPTH;
+}
+
+// Hand transfers to the driver without waiting for them, until the device queue is full, q->lk shall be held
+// Further transfers are started from their completions
+static void queue_start_async(block_storage* storage, block_queue* q)
+{
+    while(q->pending != NULL && q->inflight < queue_depth(storage)) {
+        uint32_t total;
+        block_request* first = queue_take(q, &total);
+        if(first == NULL) {
+            // started once the transfer it overlaps is done
+            return;
+        }
+        block_xfer* xfer = &q->xfers[0];
+        while(xfer->reqs != NULL) {
+            xfer++;
+        }
+        xfer->reqs = first;
+        xfer->failed = false;
+        xfer->req = (block_request) {
+            .LBA = first->LBA,
+            .block_count = total,
+            .is_write = first->is_write,
+            .buff = queue_xfer_buff(storage, first, total),
+            .callback = queue_xfer_done,
+            .private = q
+        };
+        q->inflight++;
+        int res = storage->dev_submit(storage, &xfer->req);
+        if(res == 0) {
+            continue;
+        }
+        xfer->reqs = NULL;
+        q->inflight--;
+        if(res == -EAGAIN && q->inflight > 0) {
+            // no room in the driver, submitted again once an outstanding transfer is done
+            if(first->next != NULL) {
+                kfree(xfer->req.buff);
+            }
+            queue_put_back(q, first);
+            return;
+        }
+        queue_finish(storage, q, first, total, xfer->req.buff, -EIO);
+    }
+}
+
+// A failed asynchronous transfer waiting to be retried, NULL if none
+static block_xfer* queue_failed(block_queue* q)
+{
+    for(uint32_t i=0; i<BLOCK_QUEUE_MAX_DEPTH; i++) {
+        if(q->xfers[i].reqs != NULL && q->xfers[i].failed) {
+            return &q->xfers[i];
+        }
+    }
+    return NULL;
+}
+
+// Retry a failed asynchronous transfer through the synchronous driver routines, then carry on with the queue
+// Called from process context with q->lk held, the lock is released while the device works
+static void queue_retry_failed(block_storage* storage, block_queue* q, block_xfer* xfer)
+{
+    block_request* first = xfer->reqs;
+    uint32_t total = xfer->req.block_count;
+    uint8_t* buff = xfer->req.buff;
+    xfer->failed = false;
+    release(&q->lk);
+
+    int64_t res;
+    if(first->is_write) {
+        res = storage->dev_write_blocks(storage, first->LBA, total, buff);
+    } else {
+        res = storage->dev_read_blocks(storage, buff, first->LBA, total);
+    }
+
+    acquire(&q->lk);
+    xfer->reqs = NULL;
+    q->inflight--;
+    queue_finish(storage, q, first, total, buff, res);
+    queue_start_async(storage, q);
+}
+
+static bool batch_done(block_request* reqs, uint32_t count)
+{
+    for(uint32_t i=0; i<count; i++) {
+        if(!reqs[i].done) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Queue a batch of requests to the device and return without waiting for them,
+// if the device supports asynchronous transfer (otherwise they are done on return)
+//
+// Each request is marked done once finished, after its callback (if any) has been called,
+// possibly from interrupt context; see block_io_poll() and block_io_wait()
+// Requests and their buffers shall stay valid until done
+//
+// return: zero = all queued, otherwise some requests are invalid (done with error already)
+int block_io_submit_async(block_storage* storage, block_request* reqs, uint32_t count)
+{
+    block_queue* q = get_block_queue(storage->device_id);
+    PANIC_ASSERT(q != NULL);
+
+    int res = 0;
+    acquire(&q->lk);
+    for(uint32_t i=0; i<count; i++) {
+        reqs[i].next = NULL;
+        if(reqs[i].LBA >= storage->block_count || reqs[i].LBA + reqs[i].block_count > storage->block_count) {
+            reqs[i].result = -EINVAL;
+            reqs[i].done = true;
+            res = -EINVAL;
+            continue;
+        }
+        reqs[i].result = 0;
+        reqs[i].done = false;
+        reqs[i].seq = q->seq;
+        queue_insert(q, &reqs[i]);
+    }
+
+    if(storage->dev_submit != NULL && curr_proc() != NULL) {
+        block_xfer* failed = queue_failed(q);
+        if(failed != NULL) {
+            queue_retry_failed(storage, q, failed);
+        }
+        queue_start_async(storage, q);
+        release(&q->lk);
+        return res;
+    }
+
+    // Synchronous device, or no process to sleep during kernel initialization
+    while(!batch_done(reqs, count)) {
+        if(q->dispatching) {
+            sleep(q, &q->lk);
+            continue;
+        }
+        q->dispatching = true;
+        while(!batch_done(reqs, count)) {
+            queue_dispatch(storage, q);
+        }
+        q->dispatching = false;
+        // let a waiting process take over the rest of the queue
+        wakeup(q);
+    }
+    release(&q->lk);
+    return res;
+}
+
+// Check if a submitted request is done
+bool block_io_poll(block_request* req)
+{
+    return req->done;
+}
+
+// Wait for a batch of submitted requests to be done
+//
+// return: zero = all succeeded, otherwise failed (check result of each request)
+int block_io_wait(block_storage* storage, block_request* reqs, uint32_t count)
+{
+    block_queue* q = get_block_queue(storage->device_id);
+    PANIC_ASSERT(q != NULL);
+
+    acquire(&q->lk);
+    while(!batch_done(reqs, count)) {
+        block_xfer* failed = queue_failed(q);
+        if(failed != NULL) {
+            queue_retry_failed(storage, q, failed);
+            continue;
+        }
+        if(q->inflight > 0 || q->dispatching) {
+            sleep(q, &q->lk);
+            continue;
+        }
+        PANIC_ASSERT(q->pending != NULL);
+        queue_start_async(storage, q);
+    }
+    release(&q->lk);
+
+    for(uint32_t i=0; i<count; i++) {
+        if(reqs[i].result != (int64_t) reqs[i].block_count*storage->block_size) {
+            return -EIO;
+        }
+    }
+    return 0;
+}
+
+// Queue a batch of requests to the device and wait for all of them to finish
+//
+// return: zero = all succeeded, otherwise failed (check result of each request)
+int block_io_submit(block_storage* storage, block_request* reqs, uint32_t count)
+{
+    block_io_submit_async(storage, reqs, count);
+    return block_io_wait(storage, reqs, count);
+}
+
+// Read through the device queue, bypassing the buffer cache
+int64_t block_io_read(block_storage* storage, void* buff, uint32_t LBA, uint32_t block_count)
+{
+    block_request req = {.LBA = LBA, .block_count = block_count, .is_write = false, .buff = buff};
+    block_io_submit(storage, &req, 1);
+    return req.result;
+}
+
+// Write through the device queue, bypassing the buffer cache
+int64_t block_io_write(block_storage* storage, uint32_t LBA, uint32_t block_count, const void* buff)
+{
+    block_request req = {.LBA = LBA, .block_count = block_count, .is_write = true, .buff = (void*) buff};
+    block_io_submit(storage, &req, 1);
+    return req.result;
+}
+
+// Create a RAM disk and add it as a block storage, usable at runtime
+//
+// return: device_id of the new storage, negative on error
+int add_ramdisk_storage(uint32_t block_count)
+{
+    acquire(&blk.lk);
+    bool has_free_slot = false;
+    for(uint32_t i=0; i<MAX_STORAGE_DEV_COUNT; i++) {
+        if(blk.storage_list[i].device_id == 0) {
+            has_free_slot = true;
+        }
+    }
+    release(&blk.lk);
+    if(!has_free_slot) {
+        return -ENOSPC;
+    }
+
+    int disk = ramdisk_create(block_count);
+    if(disk < 0) {
+        return disk;
+    }
+    ramdisk_storage_info* ramdisk_info = kmalloc(sizeof(ramdisk_storage_info));
+    ramdisk_info->disk = disk;
+    block_storage ramdisk_storage = (block_storage) {
+        .type=BLK_STORAGE_TYP_RAMDISK, 
         .block_size=512, 
-        .block_count=total_block_count, 
-        .read_blocks=read_blocks_ata,
-        .write_blocks=write_blocks_ata,
-        .internal_info=master_info
+        .block_count=ramdisk_sector_count(disk), 
+        .read_blocks=read_blocks_ramdisk,
+        .write_blocks=write_blocks_ramdisk,
+        .internal_info=ramdisk_info
     };
-    add_block_storage(&master_storage);
-    assert(master_storage.device_id == IDE_MASTER_DRIVE);
-
-    int32_t slave_total_block_count = get_total_28bit_sectors(true);
-    if(slave_total_block_count > 0) {
-        // if slave IDE drive exist
-        ata_storage_info* slave_info = kmalloc(sizeof(ata_storage_info));
-        slave_info->is_slave = true;
-        block_storage slave_storage = (block_storage) {
+    add_block_storage(&ramdisk_storage);
+    return ramdisk_storage.device_id;
+}
+
+void initialize_block_storage()
+{
+    blk.next_block_dev_id = 1; //ID starts from 1, 0 means unused
+
+    // Add IDE drives, primary master/slave then secondary master/slave
+    // Each channel has its own lock and DMA queue, so drives on different channels transfer concurrently
+    for(uint8_t drive=0; drive<ATA_DRIVE_COUNT; drive++) {
+        int32_t total_block_count = get_total_28bit_sectors(drive);
+        if(total_block_count <= 0) {
+            // the primary master holds the kernel and shall exist
+            PANIC_ASSERT(drive != 0);
+            if(drive == 1) {
+                // keep IDE_SLAVE_DRIVE for the primary slave, so a secondary drive is not mounted in its place
+                blk.next_block_dev_id++;
+            }
+            continue;
+        }
+        ata_storage_info* ata_info = kmalloc(sizeof(ata_storage_info));
+        ata_info->drive = drive;
+        ata_info->use_dma = ATA_DMA_supported(drive);
+        block_storage ata_storage = (block_storage) {
             .type=BLK_STORAGE_TYP_ATA_HARD_DRIVE, 
             .block_size=512, 
-            .block_count=slave_total_block_count, 
+            .block_count=total_block_count, 
             .read_blocks=read_blocks_ata,
             .write_blocks=write_blocks_ata,
-            .internal_info=slave_info
+            .dev_submit=ata_info->use_dma ? submit_blocks_ata : NULL,
+            .internal_info=ata_info
+        };
+        add_block_storage(&ata_storage);
+        assert(drive != 0 || ata_storage.device_id == IDE_MASTER_DRIVE);
+        assert(drive != 1 || ata_storage.device_id == IDE_SLAVE_DRIVE);
+    }
+
+    // Add SATA drives found on the AHCI controller
+    for(uint32_t drive=0; drive<ahci_drive_count(); drive++) {
+        uint64_t sector_count = ahci_sector_count(drive);
+        ahci_storage_info* ahci_info = kmalloc(sizeof(ahci_storage_info));
+        memset(ahci_info, 0, sizeof(ahci_storage_info));
+        ahci_info->drive = drive;
+        block_storage ahci_storage = (block_storage) {
+            .type=BLK_STORAGE_TYP_AHCI_SATA, 
+            .block_size=512, 
+            .block_count=sector_count > 0xFFFFFFFF ? 0xFFFFFFFF : sector_count, 
+            .read_blocks=read_blocks_ahci,
+            .write_blocks=write_blocks_ahci,
+            .dev_submit=submit_blocks_ahci,
+            .queue_depth=ahci_queue_depth(drive),
+            .internal_info=ahci_info
+        };
+        add_block_storage(&ahci_storage);
+    }
+
+    // Add virtio block devices
+    for(uint32_t drive=0; drive<virtio_blk_drive_count(); drive++) {
+        uint64_t sector_count = virtio_blk_sector_count(drive);
+        virtio_blk_storage_info* virtio_info = kmalloc(sizeof(virtio_blk_storage_info));
+        memset(virtio_info, 0, sizeof(virtio_blk_storage_info));
+        virtio_info->drive = drive;
+        block_storage virtio_storage = (block_storage) {
+            .type=BLK_STORAGE_TYP_VIRTIO_BLK, 
+            .block_size=512, 
+            .block_count=sector_count > 0xFFFFFFFF ? 0xFFFFFFFF : sector_count, 
+            .read_blocks=read_blocks_virtio_blk,
+            .write_blocks=write_blocks_virtio_blk,
+            .dev_submit=submit_blocks_virtio_blk,
+            .queue_depth=virtio_blk_queue_depth(drive),
+            .internal_info=virtio_info
+        };
+        add_block_storage(&virtio_storage);
+    }
+
+    // Add NVMe namespaces
+    for(uint32_t ns=0; ns<nvme_namespace_count(); ns++) {
+        uint64_t sector_count = nvme_sector_count(ns);
+        nvme_storage_info* nvme_info = kmalloc(sizeof(nvme_storage_info));
+        memset(nvme_info, 0, sizeof(nvme_storage_info));
+        nvme_info->ns = ns;
+        block_storage nvme_storage = (block_storage) {
+            .type=BLK_STORAGE_TYP_NVME, 
+            .block_size=512, 
+            .block_count=sector_count > 0xFFFFFFFF ? 0xFFFFFFFF : sector_count, 
+            .read_blocks=read_blocks_nvme,
+            .write_blocks=write_blocks_nvme,
+            .dev_submit=submit_blocks_nvme,
+            .queue_depth=nvme_queue_depth(),
+            .internal_info=nvme_info
         };
-        add_block_storage(&slave_storage);
-        assert(slave_storage.device_id == IDE_SLAVE_DRIVE);
+        add_block_storage(&nvme_storage);
     }
 
 }
\ No newline at end of file
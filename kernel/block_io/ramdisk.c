@@ -0,0 +1,75 @@
+#include <string.h>
+#include <kernel/ramdisk.h>
+#include <kernel/paging.h>
+#include <kernel/lock.h>
+#include <kernel/errno.h>
+#include <kernel/panic.h>
+
+// RAM disk backed by kernel pages
+//
+// Transfers are plain memory copies done by the caller, so there is no queue, no interrupt,
+// and the buffer may be user memory. The pages are never freed.
+
+typedef struct ramdisk {
+    uint8_t* data;
+    uint32_t sector_count;
+} ramdisk;
+
+static struct {
+    yield_lock lk;
+    ramdisk disks[RAMDISK_MAX_DISKS];
+    uint32_t disk_count;
+} rd;
+
+// Create a zero filled RAM disk
+//
+// return: index of the disk, negative on error
+int ramdisk_create(uint32_t sector_count)
+{
+    if(sector_count == 0) {
+        return -EINVAL;
+    }
+    acquire(&rd.lk);
+    if(rd.disk_count == RAMDISK_MAX_DISKS) {
+        release(&rd.lk);
+        return -ENOSPC;
+    }
+    uint32_t disk = rd.disk_count++;
+    release(&rd.lk);
+
+    uint32_t pages = PAGE_COUNT_FROM_BYTES(sector_count*512);
+    uint8_t* data = (uint8_t*) alloc_pages(curr_page_dir(), pages, true, true);
+    memset(data, 0, pages*PAGE_SIZE);
+    rd.disks[disk] = (ramdisk) {.data = data, .sector_count = sector_count};
+    return disk;
+}
+
+uint32_t ramdisk_sector_count(uint32_t disk)
+{
+    PANIC_ASSERT(disk < rd.disk_count);
+    return rd.disks[disk].sector_count;
+}
+
+// return: zero = success, otherwise failed
+int ramdisk_read_sectors(uint32_t disk, void* buf, uint32_t LBA, uint32_t sector_count)
+{
+    PANIC_ASSERT(disk < rd.disk_count);
+    ramdisk* d = &rd.disks[disk];
+    if(LBA >= d->sector_count || sector_count > d->sector_count - LBA) {
+        return -1;
+    }
+    memmove(buf, d->data + LBA*512, sector_count*512);
+    return 0;
+}
+
+// return: zero = success, otherwise failed
+int ramdisk_write_sectors(uint32_t disk, const void* buf, uint32_t LBA, uint32_t sector_count)
+{
+    PANIC_ASSERT(disk < rd.disk_count);
+    ramdisk* d = &rd.disks[disk];
+    if(LBA >= d->sector_count || sector_count > d->sector_count - LBA) {
+        return -1;
+    }
+    memmove(d->data + LBA*512, buf, sector_count*512);
+    return 0;
+}
@@ -88,6 +88,119 @@ static fat_cluster_status fat32_interpret_fat_entry(uint32_t entry)
     return FAT_CLUSTER_RESERVED;
 }
 
+static inline uint fat32_entries_per_sector(fat32_meta* meta)
+{
+    return meta->bootsector->bytes_per_sector / sizeof(uint32_t);
+}
+
+// Write a FAT sector held in memory to FAT number fat_idx (0 = main FAT)
+static int fat32_write_fat_sector(fat32_meta* meta, fat32_fat_sector* slot, uint fat_idx)
+{
+    fat32_bootsector* bs = meta->bootsector;
+    uint lba = bs->hidden_sector_count + bs->reserved_sector_count + fat_idx*bs->table_sector_size_32 + slot->sector;
+    int64_t bytes_written = meta->storage->write_blocks(meta->storage, lba, 1, slot->entries);
+    if(bytes_written != bs->bytes_per_sector) {
+        return -1;
+    }
+    return 0;
+}
+
+// Whether slot a is a better pick than slot b for holding another sector:
+//   unused slots first, then clean ones, least recently used first
+static bool fat32_fat_sector_evict_before(const fat32_fat_sector* a, const fat32_fat_sector* b)
+{
+    int rank_a = a->entries == NULL ? 0 : (a->dirty ? 2 : 1);
+    int rank_b = b->entries == NULL ? 0 : (b->dirty ? 2 : 1);
+    if(rank_a != rank_b) {
+        return rank_a < rank_b;
+    }
+    return a->last_used < b->last_used;
+}
+
+// Get the in-memory copy of a sector of the main FAT, reading it in if needed
+// The least recently used clean sector makes room for it; a dirty one is written back to every FAT first
+// Return: the slot holding the sector, NULL if it could not be read
+static fat32_fat_sector* fat32_get_fat_sector(fat32_meta* meta, uint sector)
+{
+    fat32_fat_sector* slot = &meta->fat_cache[meta->fat_cache_last];
+    if(slot->entries == NULL || slot->sector != sector) {
+        fat32_fat_sector* victim = NULL;
+        slot = NULL;
+        for(uint i = 0; i < FAT32_FAT_CACHE_SECTORS; i++) {
+            fat32_fat_sector* candidate = &meta->fat_cache[i];
+            if(candidate->entries != NULL && candidate->sector == sector) {
+                slot = candidate;
+                break;
+            }
+            if(victim == NULL || fat32_fat_sector_evict_before(candidate, victim)) {
+                victim = candidate;
+            }
+        }
+        if(slot == NULL) {
+            fat32_bootsector* bs = meta->bootsector;
+            if(victim->entries != NULL && victim->dirty) {
+                for(uint fat_idx = 0; fat_idx < bs->table_count; fat_idx++) {
+                    if(fat32_write_fat_sector(meta, victim, fat_idx) < 0) {
+                        return NULL;
+                    }
+                }
+                victim->dirty = false;
+                meta->fat_dirty_count--;
+            }
+            if(victim->entries == NULL) {
+                victim->entries = malloc(bs->bytes_per_sector);
+            }
+            int64_t bytes_read = meta->storage->read_blocks(meta->storage, victim->entries, bs->hidden_sector_count + bs->reserved_sector_count + sector, 1);
+            if(bytes_read != bs->bytes_per_sector) {
+                free(victim->entries);
+                victim->entries = NULL;
+                return NULL;
+            }
+            victim->sector = sector;
+            slot = victim;
+        }
+        meta->fat_cache_last = slot - meta->fat_cache;
+    }
+    slot->last_used = ++meta->fat_cache_clock;
+    return slot;
+}
+
+// Read the FAT entry of cluster_number
+// An entry that cannot be read shows as a bad cluster, so it is neither followed nor allocated
+static uint32_t fat32_get_fat_entry(fat32_meta* meta, uint cluster_number)
+{
+    fat32_fat_sector* slot = fat32_get_fat_sector(meta, cluster_number / fat32_entries_per_sector(meta));
+    if(slot == NULL) {
+        return 0x0FFFFFF7;
+    }
+    return slot->entries[cluster_number % fat32_entries_per_sector(meta)];
+}
+
+// Change the FAT entry of cluster_number in memory, the sector goes to disk with the next flush
+// Return: 0 if success, -EIO if the sector could not be brought in
+static int fat32_set_fat_entry(fat32_meta* meta, uint cluster_number, uint32_t entry)
+{
+    fat32_fat_sector* slot = fat32_get_fat_sector(meta, cluster_number / fat32_entries_per_sector(meta));
+    if(slot == NULL) {
+        return -EIO;
+    }
+    slot->entries[cluster_number % fat32_entries_per_sector(meta)] = entry;
+    if(!slot->dirty) {
+        slot->dirty = true;
+        meta->fat_dirty_count++;
+    }
+    return 0;
+}
+
+static void fat32_free_fat_cache(fat32_meta* meta)
+{
+    for(uint i = 0; i < FAT32_FAT_CACHE_SECTORS; i++) {
+        free(meta->fat_cache[i].entries);
+    }
+    free(meta->fat_cache);
+    meta->fat_cache = NULL;
+}
+
 static int fat32_get_meta(fat32_meta* meta)
 {
     block_storage* storage = meta->storage;
@@ -144,41 +257,58 @@ static int fat32_get_meta(fat32_meta* meta)
     if(!good){
         goto free_fs_info;
     }
-    // Read FAT
+    // The FAT is read on demand, only its first sector is checked here
     if(meta->bootsector->table_count == 0) {
         goto free_fs_info;
     }
-    uint fat_byte_size = meta->bootsector->table_sector_size_32 * meta->bootsector->bytes_per_sector;
-    meta->fat = malloc(fat_byte_size);
-    bytes_read = storage->read_blocks(storage, (uint8_t*) meta->fat, meta->bootsector->hidden_sector_count +  meta->bootsector->reserved_sector_count, meta->bootsector->table_sector_size_32);
-    if(bytes_read != fat_byte_size) {
+    meta->fat_cache = malloc(FAT32_FAT_CACHE_SECTORS*sizeof(fat32_fat_sector));
+    memset(meta->fat_cache, 0, FAT32_FAT_CACHE_SECTORS*sizeof(fat32_fat_sector));
+    meta->fat_dirty_count = 0;
+    fat32_fat_sector* first_fat_sector = fat32_get_fat_sector(meta, 0);
+    if(first_fat_sector == NULL) {
         goto free_fat;
     }
-    good = good & ((meta->fat[0] & 0x0FFFFFFF) >= 0x0FFFFFF0) & ((meta->fat[0] & 0x0FFFFFFF) <= 0x0FFFFFFF); // check cluster 0 (FAT ID)
-    good = good & ((meta->fat[1] & 0x0FFFFFFF) == 0x0FFFFFFF); // check cluster 1 (End of Cluster Mark)
+    good = good & ((first_fat_sector->entries[0] & 0x0FFFFFFF) >= 0x0FFFFFF0) & ((first_fat_sector->entries[0] & 0x0FFFFFFF) <= 0x0FFFFFFF); // check cluster 0 (FAT ID)
+    good = good & ((first_fat_sector->entries[1] & 0x0FFFFFFF) == 0x0FFFFFFF); // check cluster 1 (End of Cluster Mark)
     if(!good){
         goto free_fat;
     }
-    // Ensure all FAT are the same
-    uint32_t* alternative_fat = malloc(fat_byte_size);
+    // Ensure all FAT start the same
+    uint32_t* alternative_fat = malloc(meta->bootsector->bytes_per_sector);
     for(uint32_t fat_idx = 1; fat_idx < meta->bootsector->table_count; fat_idx++){
-        bytes_read = storage->read_blocks(storage, (uint8_t*) alternative_fat, meta->bootsector->hidden_sector_count + meta->bootsector->reserved_sector_count + fat_idx*meta->bootsector->table_sector_size_32, meta->bootsector->table_sector_size_32);
-        if(bytes_read != fat_byte_size) {
+        bytes_read = storage->read_blocks(storage, (uint8_t*) alternative_fat, meta->bootsector->hidden_sector_count + meta->bootsector->reserved_sector_count + fat_idx*meta->bootsector->table_sector_size_32, 1);
+        if(bytes_read != meta->bootsector->bytes_per_sector) {
             goto free_alternative_fat;
         }
-        if(memcmp(alternative_fat, meta->fat, fat_byte_size) != 0) {
+        if(memcmp(alternative_fat, first_fat_sector->entries, meta->bootsector->bytes_per_sector) != 0) {
             goto free_alternative_fat;
         }
     }
+    free(alternative_fat);
 
     meta->file_table = malloc(sizeof(*meta->file_table)*FAT32_N_OPEN_FILE);
+    memset(meta->file_table, 0, sizeof(*meta->file_table)*FAT32_N_OPEN_FILE);
+
+    // The free cluster bitmap is filled in as FAT sectors are looked at, only clusters backed by the data area are considered
+    uint data_sectors = meta->bootsector->total_sectors_32 - meta->bootsector->reserved_sector_count - meta->bootsector->table_count*meta->bootsector->table_sector_size_32;
+    meta->cluster_limit = data_sectors / meta->bootsector->sectors_per_cluster + 2;
+    if(meta->cluster_limit > meta->bootsector->table_sector_size_32 * fat32_entries_per_sector(meta)) {
+        meta->cluster_limit = meta->bootsector->table_sector_size_32 * fat32_entries_per_sector(meta);
+    }
+    uint free_map_words = (meta->cluster_limit + 31) / 32;
+    meta->free_map = malloc(free_map_words*sizeof(*meta->free_map));
+    memset(meta->free_map, 0, free_map_words*sizeof(*meta->free_map));
+    meta->free_map_pending = (meta->cluster_limit + fat32_entries_per_sector(meta) - 1) / fat32_entries_per_sector(meta);
+    meta->free_map_loaded = malloc((meta->free_map_pending + 7) / 8);
+    memset(meta->free_map_loaded, 0, (meta->free_map_pending + 7) / 8);
+    meta->free_map_free_count = 0;
 
     return 0;
 
 free_alternative_fat:
     free(alternative_fat);
 free_fat:
-    free(meta->fat);
+    fat32_free_fat_cache(meta);
 free_fs_info:
     free(meta->fs_info);
 free_bootsector:
@@ -198,9 +328,10 @@ static fat_cluster_status fat32_get_cluster_info(fat32_meta* meta, uint cluster_
         return FAT_CLUSTER_RESERVED;
     }
     
-    fat_cluster_status status = fat32_interpret_fat_entry(meta->fat[cluster_number]);
+    uint32_t entry = fat32_get_fat_entry(meta, cluster_number);
+    fat_cluster_status status = fat32_interpret_fat_entry(entry);
     if(status == FAT_CLUSTER_USED) {
-        cluster->next = meta->fat[cluster_number] & 0x0FFFFFFF;
+        cluster->next = entry & 0x0FFFFFFF;
     } else {
         cluster->next = 0;
     }
@@ -209,13 +340,21 @@ static fat_cluster_status fat32_get_cluster_info(fat32_meta* meta, uint cluster_
     return status;
 }
 
+static fat_cluster_status fat32_get_cluster_info_locked(fat32_meta* meta, uint cluster_number, fat_cluster* cluster)
+{
+    acquire_sleep(&meta->fat_lk);
+    fat_cluster_status status = fat32_get_cluster_info(meta, cluster_number, cluster);
+    release_sleep(&meta->fat_lk);
+    return status;
+}
+
 static uint count_clusters(fat32_meta* meta, uint cluster_number)
 {
     fat_cluster cluster;
     cluster.next = cluster_number;
     uint total_cluster_count = 0;
     while(1) {
-        fat32_get_cluster_info(meta, cluster.next, &cluster);
+        fat32_get_cluster_info_locked(meta, cluster.next, &cluster);
         total_cluster_count++;
         if(cluster.next == 0) {
             return total_cluster_count;
@@ -245,146 +384,442 @@ static uint fat32_index_cluster_chain(fat32_meta* meta, uint cluster_number, int
         if(cluster.next == 0) {
             return 0;
         }
-        fat32_get_cluster_info(meta, cluster.next, &cluster);
+        fat32_get_cluster_info_locked(meta, cluster.next, &cluster);
         index--;
     }
     return cluster.next;
 }
 
-static int fat32_write_meta(fat32_meta* meta, fat32_meta* new_meta)
+// Write the dirty FAT sectors back to the main FAT and then to each backup
+// The main FAT is complete on the disk before any backup is touched, and FS Info is written last;
+//   the block cache is synced after each FAT, so writes issued after the flush (e.g. a dir entry) land after it
+// FS Info is information only, so it is left to sync points unless with_fs_info is set
+//
+// return: zero = success, otherwise failed and the sectors (or FS Info) stay dirty for the next flush
+static int fat32_flush_fat(fat32_meta* meta, bool with_fs_info)
 {
-    uint fat_byte_size = meta->bootsector->table_sector_size_32*meta->bootsector->bytes_per_sector;
-    // Write new FAT to main FAT and backups
-    uint fat_idx;
-    uint bytes_written;
-    for(fat_idx = 0; fat_idx < meta->bootsector->table_count; fat_idx++){
-        uint lba = meta->bootsector->hidden_sector_count + meta->bootsector->reserved_sector_count + fat_idx*meta->bootsector->table_sector_size_32;
-        bytes_written = meta->storage->write_blocks(meta->storage, lba, meta->bootsector->table_sector_size_32, (uint8_t*) new_meta->fat);
-        if(bytes_written != fat_byte_size) {
-            break;
+    fat32_bootsector* bs = meta->bootsector;
+    if(meta->fat_dirty_count > 0) {
+        for(uint fat_idx = 0; fat_idx < bs->table_count; fat_idx++) {
+            for(uint i = 0; i < FAT32_FAT_CACHE_SECTORS; i++) {
+                fat32_fat_sector* slot = &meta->fat_cache[i];
+                if(slot->entries != NULL && slot->dirty && fat32_write_fat_sector(meta, slot, fat_idx) < 0) {
+                    return -1;
+                }
+            }
+            if(block_cache_sync(meta->storage->device_id) < 0) {
+                return -1;
+            }
         }
-    }
-    // If failed
-    if(fat_idx != meta->bootsector->table_count) {
-        // FAT corrupted!
-        // Try restore back to the original FAT
-        for(uint fat_idx_recover = 0; fat_idx_recover <= fat_idx; fat_idx_recover++){
-            uint lba = meta->bootsector->hidden_sector_count + meta->bootsector->reserved_sector_count + fat_idx_recover*meta->bootsector->table_sector_size_32;
-            bytes_written = meta->storage->write_blocks(meta->storage, lba, meta->bootsector->table_sector_size_32, (uint8_t*) meta->fat);
-            // If recover attempt failed, panic
-            assert(bytes_written != fat_byte_size);
+        for(uint i = 0; i < FAT32_FAT_CACHE_SECTORS; i++) {
+            meta->fat_cache[i].dirty = false;
         }
-        return -1;
+        meta->fat_dirty_count = 0;
+        meta->fat_alloc_pending = false;
     }
-    
-    // FS Info is information only, so no rollback and return 0 even if error
-    uint fsinfo_sector_size = 1 + (sizeof(fat32_fsinfo) - 1) / new_meta->storage->block_size;
-    bytes_written = new_meta->storage->write_blocks(new_meta->storage, meta->bootsector->hidden_sector_count + new_meta->bootsector->fs_info_sector, fsinfo_sector_size, (uint8_t*) new_meta->fs_info);
-    // if(bytes_written != new_meta->storage->block_size*fsinfo_sector_size) {
-    //     return -1;
-    // }
 
+    if(with_fs_info && meta->fs_info_dirty) {
+        uint fsinfo_sector_size = 1 + (sizeof(fat32_fsinfo) - 1) / meta->storage->block_size;
+        int64_t bytes_written = meta->storage->write_blocks(meta->storage, bs->hidden_sector_count + bs->fs_info_sector, fsinfo_sector_size, (uint8_t*) meta->fs_info);
+        if(bytes_written != fsinfo_sector_size*meta->storage->block_size) {
+            return -1;
+        }
+        meta->fs_info_dirty = false;
+    }
 
     return 0;
 }
 
-static void fat32_copy_meta(fat32_meta* new_meta, fat32_meta* meta)
+static int fat32_flush_fat_locked(fat32_meta* meta, bool with_fs_info)
+{
+    acquire_sleep(&meta->fat_lk);
+    int res = fat32_flush_fat(meta, with_fs_info);
+    release_sleep(&meta->fat_lk);
+    return res;
+}
+
+// Changed FAT sectors are batched across operations, flush them once enough piled up
+// A failed flush keeps them dirty, the error surfaces at the next directory write or sync point
+static void fat32_commit_fat(fat32_meta* meta)
+{
+    meta->fs_info_dirty = true;
+    if(meta->free_map_pending == 0) {
+        // FS Info count is only a hint, correct it once the whole FAT has been looked at
+        meta->fs_info->free_cluster_count = meta->free_map_free_count;
+    }
+    if(meta->fat_dirty_count >= FAT32_FAT_DIRTY_LIMIT) {
+        fat32_flush_fat(meta, true);
+    }
+}
+
+// A directory entry about to be written may point into clusters allocated since the last flush,
+//   so the chain has to reach the disk first; freed clusters alone can wait
+static int fat32_flush_fat_for_dir_write(fat32_meta* meta)
+{
+    int res = 0;
+    acquire_sleep(&meta->fat_lk);
+    if(meta->fat_alloc_pending) {
+        res = fat32_flush_fat(meta, false);
+    }
+    release_sleep(&meta->fat_lk);
+    return res;
+}
+
+#define FAT32_TXN_INITIAL_CAPACITY 16
+
+// Reflect the clusters of a FAT sector in the free cluster bitmap, unless done already
+static void fat32_load_free_map(fat32_meta* meta, uint sector)
+{
+    if(meta->free_map_loaded[sector / 8] & (1u << (sector % 8))) {
+        return;
+    }
+    fat32_fat_sector* slot = fat32_get_fat_sector(meta, sector);
+    if(slot == NULL) {
+        // clusters stay marked as used, try again next time
+        return;
+    }
+    uint entries_per_sector = fat32_entries_per_sector(meta);
+    for(uint i = 0; i < entries_per_sector; i++) {
+        uint cluster_number = sector*entries_per_sector + i;
+        if(cluster_number < 2 || cluster_number >= meta->cluster_limit) {
+            continue;
+        }
+        if(fat32_interpret_fat_entry(slot->entries[i]) == FAT_CLUSTER_FREE) {
+            meta->free_map[cluster_number / 32] |= 1u << (cluster_number % 32);
+            meta->free_map_free_count++;
+        }
+    }
+    meta->free_map_loaded[sector / 8] |= 1u << (sector % 8);
+    meta->free_map_pending--;
+}
+
+// Reflect FAT sectors in the free cluster bitmap until it counts min_free free clusters,
+//   or every sector is reflected and free_map_free_count is exact
+// Return: whether free_map_free_count reached min_free
+static bool fat32_load_free_map_until(fat32_meta* meta, uint min_free)
+{
+    uint sector_count = (meta->cluster_limit + fat32_entries_per_sector(meta) - 1) / fat32_entries_per_sector(meta);
+    for(uint sector = 0; sector < sector_count && meta->free_map_pending > 0 && meta->free_map_free_count < min_free; sector++) {
+        fat32_load_free_map(meta, sector);
+    }
+    return meta->free_map_free_count >= min_free;
+}
+
+// Word word_idx of the free cluster bitmap, with its clusters reflected
+static uint32_t fat32_free_map_word(fat32_meta* meta, uint word_idx)
+{
+    // a FAT sector holds a whole number of words
+    fat32_load_free_map(meta, word_idx*32 / fat32_entries_per_sector(meta));
+    return meta->free_map[word_idx];
+}
+
+static bool fat32_is_cluster_free(fat32_meta* meta, uint cluster_number)
 {
+    return (fat32_free_map_word(meta, cluster_number / 32) >> (cluster_number % 32)) & 1;
+}
 
-    uint fat_byte_size = meta->bootsector->table_sector_size_32*meta->bootsector->bytes_per_sector;
-    if(new_meta->fat == NULL) {
-        new_meta->fat = malloc(fat_byte_size);
+// Sync the free cluster bitmap with the in-memory FAT entry of cluster_number
+static void fat32_update_free_map(fat32_meta* meta, uint cluster_number)
+{
+    if(cluster_number >= meta->cluster_limit) {
+        return;
     }
-    memmove(new_meta->fat, meta->fat, fat_byte_size);
+    uint sector = cluster_number / fat32_entries_per_sector(meta);
+    if(!(meta->free_map_loaded[sector / 8] & (1u << (sector % 8)))) {
+        // picked up from the FAT when the sector gets reflected
+        return;
+    }
+    uint32_t bit = 1u << (cluster_number % 32);
+    bool was_free = meta->free_map[cluster_number / 32] & bit;
+    if(fat32_interpret_fat_entry(fat32_get_fat_entry(meta, cluster_number)) == FAT_CLUSTER_FREE) {
+        meta->free_map[cluster_number / 32] |= bit;
+        meta->free_map_free_count += !was_free;
+    } else {
+        meta->free_map[cluster_number / 32] &= ~bit;
+        meta->free_map_free_count -= was_free;
+    }
+}
 
-    if(new_meta->fs_info == NULL) {
-        new_meta->fs_info = malloc(sizeof(*meta->fs_info));
+// Find the first run of free clusters starting in [from, to)
+// Return: first cluster of the run and its length in *run_length, or 0 if none
+static uint fat32_next_free_run(fat32_meta* meta, uint from, uint to, uint* run_length)
+{
+    uint cluster_number = from;
+    while(cluster_number < to) {
+        if(cluster_number % 32 == 0 && fat32_free_map_word(meta, cluster_number / 32) == 0) {
+            // skip a whole word of used clusters
+            cluster_number += 32;
+            continue;
+        }
+        if(!fat32_is_cluster_free(meta, cluster_number)) {
+            cluster_number++;
+            continue;
+        }
+        uint run_end = cluster_number + 1;
+        while(run_end < meta->cluster_limit) {
+            if(run_end % 32 == 0 && run_end + 32 <= meta->cluster_limit && fat32_free_map_word(meta, run_end / 32) == 0xFFFFFFFF) {
+                run_end += 32;
+            } else if(fat32_is_cluster_free(meta, run_end)) {
+                run_end++;
+            } else {
+                break;
+            }
+        }
+        *run_length = run_end - cluster_number;
+        return cluster_number;
     }
-    memmove(new_meta->fs_info, meta->fs_info, sizeof(*meta->fs_info));
+    return 0;
+}
 
-    if(new_meta->bootsector == NULL) {
-        new_meta->bootsector = malloc(sizeof(*meta->bootsector));
+// Pick a free extent for up to cluster_count clusters
+// Prefer the first run starting from hint that fits the whole request, otherwise the largest run
+// Return: first cluster of the extent and its length in *extent_length, or 0 if the disk is full
+static uint fat32_find_free_extent(fat32_meta* meta, uint hint, uint cluster_count, uint* extent_length)
+{
+    if(hint < 2 || hint >= meta->cluster_limit) {
+        hint = 2;
+    }
+    uint largest_start = 0, largest_length = 0;
+    // two passes: [hint, end) then [2, hint)
+    for(uint pass = 0; pass < 2; pass++) {
+        uint from = pass == 0 ? hint : 2;
+        uint to = pass == 0 ? meta->cluster_limit : hint;
+        uint run_length = 0;
+        uint run_start;
+        while((run_start = fat32_next_free_run(meta, from, to, &run_length)) != 0) {
+            if(run_length >= cluster_count) {
+                *extent_length = cluster_count;
+                return run_start;
+            }
+            if(run_length > largest_length) {
+                largest_start = run_start;
+                largest_length = run_length;
+            }
+            from = run_start + run_length;
+        }
     }
-    memmove(new_meta->bootsector, meta->bootsector, sizeof(*meta->bootsector));
+    *extent_length = largest_length;
+    return largest_start;
+}
 
-    if(new_meta->file_table == NULL) {
-        new_meta->file_table = malloc(sizeof(*new_meta->file_table)*FAT32_N_OPEN_FILE);
+// Set the FAT entry of cluster_number within a transaction, keeping the reserved high 4 bits
+// The in-memory FAT is updated in place, the old entry is logged so that it can be rolled back
+// Return: 0 if success, -EIO if the FAT sector could not be read or made room for, nothing is logged then
+static int fat32_txn_set(fat32_meta* meta, fat32_fat_txn* txn, uint cluster_number, uint32_t value)
+{
+    if(txn->count == txn->capacity) {
+        uint new_capacity = txn->capacity == 0 ? FAT32_TXN_INITIAL_CAPACITY : txn->capacity * 2;
+        fat32_fat_change* changes = malloc(new_capacity*sizeof(*changes));
+        if(txn->changes != NULL) {
+            memmove(changes, txn->changes, txn->count*sizeof(*changes));
+            free(txn->changes);
+        }
+        txn->changes = changes;
+        txn->capacity = new_capacity;
+    }
+    fat32_fat_sector* slot = fat32_get_fat_sector(meta, cluster_number / fat32_entries_per_sector(meta));
+    if(slot == NULL) {
+        return -EIO;
+    }
+    uint32_t old_entry = slot->entries[cluster_number % fat32_entries_per_sector(meta)];
+    int r = fat32_set_fat_entry(meta, cluster_number, (old_entry & 0xF0000000) | (value & 0x0FFFFFFF));
+    if(r < 0) {
+        return r;
     }
-    memmove(new_meta->file_table, meta->file_table, sizeof(*new_meta->file_table)*FAT32_N_OPEN_FILE);
+    txn->changes[txn->count++] = (fat32_fat_change) {.cluster = cluster_number, .old_entry = old_entry};
+    fat32_update_free_map(meta, cluster_number);
+    return 0;
+}
 
-    new_meta->storage = meta->storage;
+// Keep the logged changes, their sectors are already dirty and go to disk with the next flush
+static void fat32_txn_commit(fat32_meta* meta, fat32_fat_txn* txn)
+{
+    (void) meta;
+    free(txn->changes);
+    *txn = (fat32_fat_txn) {0};
 }
 
-static void fat32_free_meta(fat32_meta* meta)
+// Undo the logged changes, newest first so that an entry changed twice ends up at its original value
+// An entry whose sector cannot be brought back in any more keeps its new value, the disk then needs a check
+static void fat32_txn_rollback(fat32_meta* meta, fat32_fat_txn* txn)
 {
-    free(meta->bootsector);
-    meta->bootsector = NULL;
-    free(meta->fs_info);
-    meta->fs_info = NULL;
-    free(meta->fat);
-    meta->fat = NULL;
-    meta->storage = NULL;
+    for(uint i = txn->count; i > 0; i--) {
+        fat32_set_fat_entry(meta, txn->changes[i - 1].cluster, txn->changes[i - 1].old_entry);
+        fat32_update_free_map(meta, txn->changes[i - 1].cluster);
+    }
+    free(txn->changes);
+    *txn = (fat32_fat_txn) {0};
 }
 
+// Allocate clusters and append them to the chain ending at prev_cluster_number (0 for a new chain)
+// Clusters are taken as contiguous extents: first right after prev_cluster_number to keep the file in one piece,
+//   then the first free run that fits the rest, falling back to the largest runs when the disk is fragmented
 // Return: Cluster number of the first newly allocated cluster
 static uint fat32_allocate_cluster(fat32_meta* meta, uint prev_cluster_number, uint cluster_count_to_allocate)
 {
-    uint cluster_number = meta->fs_info->next_free_cluster;
-    if(cluster_number == 0xFFFFFFFF) {
-        cluster_number = 2;
+    // Buffered writes reserve against the free clusters reflected so far, look further into the FAT
+    //   until this allocation fits besides them, so that it does not take the reserved ones
+    if(meta->write_reserved_clusters > 0) {
+        fat32_load_free_map_until(meta, cluster_count_to_allocate + meta->write_reserved_clusters);
+    }
+    // Only the fully loaded free map gives an exact count, the FS Info one may be stale
+    //   and the search below finds out anyway when the disk is really full
+    if(meta->free_map_pending == 0 && meta->free_map_free_count < cluster_count_to_allocate + meta->write_reserved_clusters) {
+        // disk is full, counting the clusters promised to buffered writes
+        return 0;
     }
-    uint cluster_number_first_tried = cluster_number;
-    uint max_cluster_number = meta->bootsector->table_sector_size_32*meta->bootsector->bytes_per_sector / 4 - 1;
+
+    uint hint = meta->fs_info->next_free_cluster;
     uint allocated = 0, first_new_cluster_number = 0;
-    
-    fat32_meta new_meta = {0};
-    fat32_copy_meta(&new_meta, meta);
-    
+    fat32_fat_txn txn = {0};
+
     while(allocated < cluster_count_to_allocate) {
-        fat_cluster_status status = fat32_interpret_fat_entry(new_meta.fat[cluster_number]);
-        if(status == FAT_CLUSTER_FREE) {
+        uint extent_start, extent_length;
+        if(prev_cluster_number != 0 && prev_cluster_number + 1 < meta->cluster_limit && fat32_is_cluster_free(meta, prev_cluster_number + 1)) {
+            // grow the chain in place
+            extent_start = prev_cluster_number + 1;
+            extent_length = 1;
+            while(allocated + extent_length < cluster_count_to_allocate && extent_start + extent_length < meta->cluster_limit && fat32_is_cluster_free(meta, extent_start + extent_length)) {
+                extent_length++;
+            }
+        } else {
+            extent_start = fat32_find_free_extent(meta, hint, cluster_count_to_allocate - allocated, &extent_length);
+            if(extent_start == 0) {
+                // free cluster count was off, no free entry left
+                fat32_txn_rollback(meta, &txn);
+                return 0;
+            }
+        }
+
+        for(uint cluster_number = extent_start; cluster_number < extent_start + extent_length; cluster_number++) {
             if(prev_cluster_number != 0) {
-                fat_cluster_status prev_status = fat32_interpret_fat_entry(new_meta.fat[prev_cluster_number]);
+                fat_cluster_status prev_status = fat32_interpret_fat_entry(fat32_get_fat_entry(meta, prev_cluster_number));
                 assert(prev_status == FAT_CLUSTER_EOC);
-                new_meta.fat[prev_cluster_number] = (new_meta.fat[prev_cluster_number] & 0xF0000000) | (cluster_number & 0x0FFFFFFF);
+                if(fat32_txn_set(meta, &txn, prev_cluster_number, cluster_number) < 0) {
+                    fat32_txn_rollback(meta, &txn);
+                    return 0;
+                }
             }
-            new_meta.fat[cluster_number] = (new_meta.fat[cluster_number] & 0xF0000000) | (FAT_CLUSTER_EOC & 0x0FFFFFFF);
-            prev_cluster_number = cluster_number;
-            if(allocated == 0) {
-                first_new_cluster_number = cluster_number;
+            if(fat32_txn_set(meta, &txn, cluster_number, FAT_CLUSTER_EOC) < 0) {
+                fat32_txn_rollback(meta, &txn);
+                return 0;
             }
-            allocated++;
-        }
-        if(cluster_number == max_cluster_number) {
-            cluster_number = 2;
-        } else {
-            cluster_number++;
+            prev_cluster_number = cluster_number;
         }
-        if(cluster_number == cluster_number_first_tried && allocated < cluster_count_to_allocate) {
-            // all FAT entries tested, no free entry, disk is full
-            fat32_free_meta(&new_meta);
-            return 0;
+        if(allocated == 0) {
+            first_new_cluster_number = extent_start;
         }
+        allocated += extent_length;
+        hint = extent_start + extent_length;
     }
 
     if(meta->fs_info->free_cluster_count != 0xFFFFFFFF) {
-        meta->fs_info->free_cluster_count -= allocated;
+        // a stale count may be lower than what was just found, commit_fat corrects it once the free map is loaded
+        meta->fs_info->free_cluster_count = meta->fs_info->free_cluster_count > allocated ? meta->fs_info->free_cluster_count - allocated : 0;
     }
-    meta->fs_info->next_free_cluster = cluster_number; // not a free cluster, but a good place to start looking for one
+    meta->fs_info->next_free_cluster = hint; // not necessarily a free cluster, but a good place to start looking for one
 
-    int res = fat32_write_meta(meta, &new_meta);
-    if(res == 0) {
-        // Update memory cache
-        fat32_copy_meta(meta, &new_meta);
-        fat32_free_meta(&new_meta);
+    // The dirty sectors reach the disk no later than the next directory entry write
+    fat32_txn_commit(meta, &txn);
+    meta->fat_alloc_pending = true;
+    fat32_commit_fat(meta);
 
-        return first_new_cluster_number;
-    } else {
-        fat32_free_meta(&new_meta);
-        return 0;
+    return first_new_cluster_number;
+}
+
+
+static void fat32_extent_map_reset(fat32_extent_map* map, uint first_cluster)
+{
+    map->count = 0;
+    map->cluster_count = 0;
+    map->first_cluster = first_cluster;
+}
+
+// Whether open file table entry opened refers to the file whose dir entries file_entry points at
+// Dir entries identify a file, a new or empty one has no cluster yet
+static bool fat32_is_same_file(const fat32_file_entry* opened, const fat32_file_entry* file_entry)
+{
+    return opened->dir_entry_count > 0 && opened->dir_cluster == file_entry->dir_cluster
+        && opened->first_dir_entry_idx == file_entry->first_dir_entry_idx;
+}
+
+// Drop the extent maps of the open handles of file_entry whose chain contains cluster_number
+// Maps of other files are left alone, they may be in use under their own file lock
+static void fat32_invalidate_extent_maps(fat32_meta* meta, fat32_file_entry* file_entry, uint cluster_number)
+{
+    for(uint i = 0; i < FAT32_N_OPEN_FILE; i++) {
+        fat32_extent_map* map = meta->file_table[i].extent_map;
+        if(map == NULL || !fat32_is_same_file(&meta->file_table[i], file_entry)) {
+            continue;
+        }
+        for(uint e = 0; e < map->count; e++) {
+            if(cluster_number >= map->extents[e].physical && cluster_number < map->extents[e].physical + map->extents[e].length) {
+                fat32_extent_map_reset(map, 0);
+                break;
+            }
+        }
+    }
+}
+
+static void fat32_free_dir_index(fat32_dir_index* index)
+{
+    for(uint i = 0; i < index->bucket_count; i++) {
+        fat32_dir_index_node* node = index->buckets[i];
+        while(node != NULL) {
+            fat32_dir_index_node* next = node->next;
+            free(node);
+            node = next;
+        }
     }
+    free(index->buckets);
+    free(index->clusters);
+    memset(index, 0, sizeof(*index));
 }
 
+// Drop the name index of the dir starting at cluster_number, if any
+static void fat32_drop_dir_index(fat32_meta* meta, uint cluster_number)
+{
+    for(uint i = 0; i < FAT32_N_DIR_INDEX; i++) {
+        if(meta->dir_indexes[i].dir_cluster == cluster_number) {
+            fat32_free_dir_index(&meta->dir_indexes[i]);
+        }
+    }
+}
+
+#define FAT32_DIR_INDEX_MIN_BUCKETS 64
+#define FAT32_DIR_INDEX_MIN_CLUSTERS 8
+
+// Get the name index of the dir starting at dir_cluster, the dir lock shall be held
+// Only the index slots behind the dir's lock are used, so indexes of dirs under other locks are never touched
+// create: set up an empty index if there is none, recycling the least recently used slot
+// Return: the index, NULL if there is none and create is false
+static fat32_dir_index* fat32_get_dir_index(fat32_meta* meta, uint dir_cluster, bool create)
+{
+    const uint ways = FAT32_N_DIR_INDEX / FAT32_N_DIR_LOCK;
+    uint first_slot = (dir_cluster % FAT32_N_DIR_LOCK) * ways;
+    fat32_dir_index* victim = NULL;
+    for(uint i = first_slot; i < first_slot + ways; i++) {
+        fat32_dir_index* index = &meta->dir_indexes[i];
+        if(index->dir_cluster == dir_cluster) {
+            index->last_used = ++meta->dir_index_clock;
+            return index;
+        }
+        if(victim == NULL || (victim->dir_cluster != 0 && (index->dir_cluster == 0 || index->last_used < victim->last_used))) {
+            victim = index;
+        }
+    }
+    if(!create) {
+        return NULL;
+    }
+
+    fat32_free_dir_index(victim);
+    victim->dir_cluster = dir_cluster;
+    victim->last_used = ++meta->dir_index_clock;
+    victim->bucket_count = FAT32_DIR_INDEX_MIN_BUCKETS;
+    victim->buckets = malloc(victim->bucket_count*sizeof(fat32_dir_index_node*));
+    memset(victim->buckets, 0, victim->bucket_count*sizeof(fat32_dir_index_node*));
+    return victim;
+}
 
 // cluster_count_to_free = 0 means free to the end of the chain
 static int fat32_free_cluster(fat32_meta* meta, uint prev_cluster_number, uint cluster_number, uint cluster_count_to_free)
@@ -393,24 +828,31 @@ static int fat32_free_cluster(fat32_meta* meta, uint prev_cluster_number, uint c
         return 0;
     }
 
-    fat32_meta new_meta = {0};
-    fat32_copy_meta(&new_meta, meta);
+    fat32_fat_txn txn = {0};
     
     uint cluster_freed = 0;
     fat_cluster cluster = {.next = cluster_number};
     while(cluster.next && (cluster_freed < cluster_count_to_free || cluster_count_to_free == 0)) {
         fat_cluster_status status = fat32_get_cluster_info(meta, cluster.next, &cluster);
-        assert(status == FAT_CLUSTER_USED || status == FAT_CLUSTER_EOC);
+        if(status != FAT_CLUSTER_USED && status != FAT_CLUSTER_EOC) {
+            // chain unreadable or broken, leave it as it was
+            fat32_txn_rollback(meta, &txn);
+            return -EIO;
+        }
         // set as free cluster
-        new_meta.fat[cluster.curr] = (new_meta.fat[cluster.curr] & 0xF0000000) | (FAT_CLUSTER_FREE & 0x0FFFFFFF);
-        if(prev_cluster_number != 0) {
+        int r = fat32_txn_set(meta, &txn, cluster.curr, FAT_CLUSTER_FREE);
+        if(r == 0 && prev_cluster_number != 0) {
             if(cluster.next != 0) {
                 // if removing cluster in the middle of the chain, connect prev and next cluster
-                new_meta.fat[prev_cluster_number] = (new_meta.fat[prev_cluster_number] & 0xF0000000) | (cluster.next & 0x0FFFFFFF);
+                r = fat32_txn_set(meta, &txn, prev_cluster_number, cluster.next);
             } else {
-                new_meta.fat[prev_cluster_number] = (new_meta.fat[prev_cluster_number] & 0xF0000000) | (FAT_CLUSTER_EOC & 0x0FFFFFFF);
+                r = fat32_txn_set(meta, &txn, prev_cluster_number, FAT_CLUSTER_EOC);
             }   
         }
+        if(r < 0) {
+            fat32_txn_rollback(meta, &txn);
+            return r;
+        }
         cluster_freed++;
     }
 
@@ -418,67 +860,284 @@ static int fat32_free_cluster(fat32_meta* meta, uint prev_cluster_number, uint c
         meta->fs_info->free_cluster_count += cluster_freed;
     }
 
-    int res = fat32_write_meta(meta, &new_meta);
-    if(res == 0) {
-        // Update memory cache
-        fat32_copy_meta(meta, &new_meta);
-        fat32_free_meta(&new_meta);
+    // Freed clusters may stay dirty until a later flush,
+    //   by which time no directory entry on disk refers to them any more
+    fat32_txn_commit(meta, &txn);
+    fat32_commit_fat(meta);
 
-        return 0;
-    } else {
-        fat32_free_meta(&new_meta);
+    return 0;
+}
+
+static uint fat32_allocate_cluster_locked(fat32_meta* meta, uint prev_cluster_number, uint cluster_count_to_allocate)
+{
+    acquire_sleep(&meta->fat_lk);
+    uint res = fat32_allocate_cluster(meta, prev_cluster_number, cluster_count_to_allocate);
+    release_sleep(&meta->fat_lk);
+    return res;
+}
+
+static int fat32_free_cluster_locked(fat32_meta* meta, uint prev_cluster_number, uint cluster_number, uint cluster_count_to_free)
+{
+    acquire_sleep(&meta->fat_lk);
+    int res = fat32_free_cluster(meta, prev_cluster_number, cluster_number, cluster_count_to_free);
+    release_sleep(&meta->fat_lk);
+    return res;
+}
+
+// Transfer size bytes at offset into a run of physically contiguous clusters
+// The untouched bytes of the run are skipped, so the whole run goes out as one scatter-gather request
+//   straight from/to buff, partial sectors at both ends of it are handled by the block layer
+static int64_t fat32_transfer_run(fat32_meta* meta, uint run_start, uint run_count, uint offset, uint size, uint8_t* buff, bool is_write)
+{
+    uint bytes_per_cluster = meta->bootsector->sectors_per_cluster*meta->bootsector->bytes_per_sector;
+    uint data_lba = meta->bootsector->hidden_sector_count + meta->bootsector->reserved_sector_count + meta->bootsector->table_sector_size_32*meta->bootsector->table_count;
+
+    // skipped head, the bytes in buff, skipped tail
+    block_segment segs[3];
+    uint seg_count = 0;
+    if(offset > 0) {
+        segs[seg_count++] = (block_segment) {.buff = NULL, .size = offset};
+    }
+    segs[seg_count++] = (block_segment) {.buff = buff, .size = size};
+    if(offset + size < run_count*bytes_per_cluster) {
+        segs[seg_count++] = (block_segment) {.buff = NULL, .size = run_count*bytes_per_cluster - offset - size};
+    }
+    // the cluster 0 and 1 are not of size sectors_per_cluster
+    uint lba = data_lba + (run_start - 2)*meta->bootsector->sectors_per_cluster;
+    int64_t res = is_write ? meta->storage->write_blocks_vec(meta->storage, lba, segs, seg_count) : meta->storage->read_blocks_vec(meta->storage, segs, seg_count, lba);
+    if(res < 0) {
         return -EIO;
     }
+    return size;
+}
+
+// Transfer bytes [offset, offset + size) of the cluster chain starting from first_cluster from/to buff
+// Physically contiguous clusters are coalesced into runs, each run issued as one request
+//
+// return: bytes transferred, negative on error
+static int64_t fat32_transfer_chain(fat32_meta* meta, uint first_cluster, uint offset, uint size, uint8_t* buff, bool is_write)
+{
+    uint bytes_per_cluster = meta->bootsector->sectors_per_cluster*meta->bootsector->bytes_per_sector;
+
+    fat_cluster cluster = {.next = first_cluster};
+    uint run_start = 0, run_count = 0, run_offset = 0, run_size = 0;
+    uint8_t* run_buff = buff;
+    int64_t total_bytes = 0;
+    while(size > 0) {
+        fat_cluster_status cluster_status = fat32_get_cluster_info_locked(meta, cluster.next, &cluster);
+        if(cluster_status == FAT_CLUSTER_BAD || cluster_status == FAT_CLUSTER_FREE || cluster_status == FAT_CLUSTER_RESERVED) {
+            return -EIO;
+        }
+        assert(cluster_status == FAT_CLUSTER_USED || cluster_status == FAT_CLUSTER_EOC);
 
+        if(offset >= bytes_per_cluster) {
+            offset -= bytes_per_cluster;
+        } else {
+            if(run_count > 0 && cluster.curr != run_start + run_count) {
+                // the run ends here, its last cluster was covered to the end
+                if(fat32_transfer_run(meta, run_start, run_count, run_offset, run_size, run_buff, is_write) < 0) {
+                    return -EIO;
+                }
+                run_count = 0;
+            }
+            if(run_count == 0) {
+                run_start = cluster.curr;
+                run_offset = offset;
+                run_size = 0;
+                run_buff = buff;
+            }
+            uint size_in_this_cluster = size <= bytes_per_cluster - offset ? size : bytes_per_cluster - offset;
+            run_size += size_in_this_cluster;
+            buff += size_in_this_cluster;
+            size -= size_in_this_cluster;
+            total_bytes += size_in_this_cluster;
+            offset = 0;
+            run_count++;
+        }
+
+        if(size == 0) {
+            break;
+        }
+        if(cluster_status == FAT_CLUSTER_EOC) {
+            return -EIO;
+        }
+    }
+
+    if(run_count > 0) {
+        if(fat32_transfer_run(meta, run_start, run_count, run_offset, run_size, run_buff, is_write) < 0) {
+            return -EIO;
+        }
+    }
+    return total_bytes;
 }
 
+// Read/write whole clusters of the chain starting from cluster_number, see fat32_transfer_chain
 static int64_t fat32_read_clusters(fat32_meta* meta, uint cluster_number, uint clusters_to_read, uint8_t* buff) 
 {
     assert(cluster_number >= 2);
     uint cluster_byte_size = meta->bootsector->bytes_per_sector*meta->bootsector->sectors_per_cluster;
+    return fat32_transfer_chain(meta, cluster_number, 0, clusters_to_read*cluster_byte_size, buff, false);
+}
 
-    fat_cluster cluster = {.next = cluster_number};
-    int64_t total_bytes_read = 0;
-    for(uint i=0; i < clusters_to_read; i++) {
-        assert(cluster.next != 0);
-        fat_cluster_status status = fat32_get_cluster_info(meta, cluster.next, &cluster);
-        assert(status == FAT_CLUSTER_USED || (status == FAT_CLUSTER_EOC && i == clusters_to_read-1));
-        // the cluster 0 and 1 are not of size sectors_per_cluster
-        uint lba = meta->bootsector->hidden_sector_count + meta->bootsector->reserved_sector_count + meta->bootsector->table_sector_size_32*meta->bootsector->table_count + (cluster.curr-2)*meta->bootsector->sectors_per_cluster;
-        int64_t bytes_read = meta->storage->read_blocks(meta->storage, buff, lba, meta->bootsector->sectors_per_cluster);
-        if(bytes_read < 0) {
-            return bytes_read;
+static int64_t fat32_write_clusters(fat32_meta* meta, uint cluster_number, uint clusters_to_write, uint8_t* buff)
+{
+    assert(cluster_number >= 2);
+    uint cluster_byte_size = meta->bootsector->bytes_per_sector*meta->bootsector->sectors_per_cluster;
+    return fat32_transfer_chain(meta, cluster_number, 0, clusters_to_write*cluster_byte_size, buff, true);
+}
+
+static void fat32_extent_map_push(fat32_extent_map* map, uint physical)
+{
+    if(map->count > 0) {
+        fat32_extent* last = &map->extents[map->count - 1];
+        if(last->physical + last->length == physical) {
+            last->length++;
+            map->cluster_count++;
+            return;
+        }
+    }
+    if(map->count == map->capacity) {
+        uint new_capacity = map->capacity == 0 ? 8 : map->capacity * 2;
+        fat32_extent* extents = malloc(new_capacity*sizeof(*extents));
+        if(map->extents != NULL) {
+            memmove(extents, map->extents, map->count*sizeof(*extents));
+            free(map->extents);
+        }
+        map->extents = extents;
+        map->capacity = new_capacity;
+    }
+    map->extents[map->count++] = (fat32_extent) {.logical = map->cluster_count, .physical = physical, .length = 1};
+    map->cluster_count++;
+}
+
+// Make sure the extent map covers logical cluster index last_logical, or the whole chain if FAT32_EXTENT_MAP_WHOLE_CHAIN
+// The map grows lazily from its last mapped cluster, since appending only links new clusters after it;
+//   freeing clusters resets the maps referring to them (see fat32_invalidate_extent_maps)
+static int fat32_extent_map_cover(fat32_meta* meta, fat32_extent_map* map, uint first_cluster, uint last_logical)
+{
+    if(map->first_cluster != first_cluster) {
+        fat32_extent_map_reset(map, first_cluster);
+    }
+    if(map->cluster_count > last_logical) {
+        return 0;
+    }
+
+    fat_cluster cluster = {.next = first_cluster};
+    if(map->count > 0) {
+        fat32_extent* last = &map->extents[map->count - 1];
+        fat32_get_cluster_info_locked(meta, last->physical + last->length - 1, &cluster);
+    }
+    while(map->cluster_count <= last_logical) {
+        if(cluster.next == 0) {
+            // past the end of the chain
+            return last_logical == FAT32_EXTENT_MAP_WHOLE_CHAIN ? 0 : -EIO;
         }
-        total_bytes_read += bytes_read;
-        buff += cluster_byte_size;
-        lba += meta->bootsector->sectors_per_cluster;
+        fat_cluster_status status = fat32_get_cluster_info_locked(meta, cluster.next, &cluster);
+        if(status != FAT_CLUSTER_USED && status != FAT_CLUSTER_EOC) {
+            return -EIO;
+        }
+        fat32_extent_map_push(map, cluster.curr);
     }
+    return 0;
+}
 
-    return total_bytes_read;
+// Binary search the extent holding logical cluster index, which must be covered by the map
+static uint fat32_extent_map_find(fat32_extent_map* map, uint logical)
+{
+    uint lo = 0, hi = map->count - 1;
+    while(lo < hi) {
+        uint mid = (lo + hi + 1) / 2;
+        if(map->extents[mid].logical <= logical) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
 }
 
-static int64_t fat32_write_clusters(fat32_meta* meta, uint cluster_number, uint clusters_to_write, uint8_t* buff)
+// Number of clusters in the chain of a file, with its last cluster in *tail_cluster (0 if none)
+// Open files take both from the extent map, which only has to catch up with clusters appended since,
+//   so appending through a file handle does not rescan the chain
+//
+// return: cluster count, negative on error
+static int64_t fat32_file_chain_length(fat32_meta* meta, fat32_file_entry* file_entry, uint* tail_cluster)
 {
-    assert(cluster_number >= 2);
-    uint cluster_byte_size = meta->bootsector->bytes_per_sector*meta->bootsector->sectors_per_cluster;
+    uint first_cluster = file_entry->direntry.cluster_lo + (file_entry->direntry.cluster_hi << 16);
+    *tail_cluster = 0;
+    if(first_cluster == 0) {
+        return 0;
+    }
 
-    fat_cluster cluster = {.next = cluster_number};
-    int64_t total_bytes_written = 0;
-    for(uint i=0; i < clusters_to_write; i++) {
-        assert(cluster.next != 0);
-        fat_cluster_status status = fat32_get_cluster_info(meta, cluster.next, &cluster);
-        assert(status == FAT_CLUSTER_USED || (status == FAT_CLUSTER_EOC && i == clusters_to_write-1));
-        // the cluster 0 and 1 are not of size sectors_per_cluster
-        uint lba = meta->bootsector->hidden_sector_count + meta->bootsector->reserved_sector_count + meta->bootsector->table_sector_size_32*meta->bootsector->table_count + (cluster.curr-2)*meta->bootsector->sectors_per_cluster;
-        int64_t bytes_written = meta->storage->write_blocks(meta->storage, lba, meta->bootsector->sectors_per_cluster, buff);
-        if(bytes_written < 0) {
-            return bytes_written;
+    fat32_extent_map* map = file_entry->extent_map;
+    if(map == NULL) {
+        fat_cluster cluster = {.next = first_cluster};
+        uint cluster_count = 0;
+        while(cluster.next != 0) {
+            fat32_get_cluster_info_locked(meta, cluster.next, &cluster);
+            cluster_count++;
         }
-        total_bytes_written += bytes_written;
-        buff += cluster_byte_size;
-        lba += meta->bootsector->sectors_per_cluster;
+        *tail_cluster = cluster.curr;
+        return cluster_count;
     }
-    return total_bytes_written;
+
+    if(fat32_extent_map_cover(meta, map, first_cluster, FAT32_EXTENT_MAP_WHOLE_CHAIN) < 0) {
+        return -EIO;
+    }
+    fat32_extent* last = &map->extents[map->count - 1];
+    *tail_cluster = last->physical + last->length - 1;
+    return map->cluster_count;
+}
+
+// Cluster number at logical index of the chain of a file, 0 if out of the chain
+static uint fat32_file_cluster_at(fat32_meta* meta, fat32_file_entry* file_entry, uint logical)
+{
+    uint first_cluster = file_entry->direntry.cluster_lo + (file_entry->direntry.cluster_hi << 16);
+    fat32_extent_map* map = file_entry->extent_map;
+    if(map == NULL) {
+        return fat32_index_cluster_chain(meta, first_cluster, logical);
+    }
+    if(first_cluster == 0 || fat32_extent_map_cover(meta, map, first_cluster, logical) < 0) {
+        return 0;
+    }
+    fat32_extent* extent = &map->extents[fat32_extent_map_find(map, logical)];
+    return extent->physical + (logical - extent->logical);
+}
+
+// Read or write size bytes at offset of a file
+// Open files resolve their clusters through the extent map, other files walk the chain
+static int64_t fat32_transfer_file(fat32_meta* meta, fat32_file_entry* file_entry, uint offset, uint size, uint8_t* buff, bool is_write)
+{
+    uint first_cluster = file_entry->direntry.cluster_lo + (file_entry->direntry.cluster_hi << 16);
+    fat32_extent_map* map = file_entry->extent_map;
+    if(map == NULL || size == 0) {
+        return fat32_transfer_chain(meta, first_cluster, offset, size, buff, is_write);
+    }
+
+    uint bytes_per_cluster = meta->bootsector->sectors_per_cluster*meta->bootsector->bytes_per_sector;
+    if(fat32_extent_map_cover(meta, map, first_cluster, (offset + size - 1) / bytes_per_cluster) < 0) {
+        return -EIO;
+    }
+
+    int64_t total_bytes = 0;
+    uint idx = fat32_extent_map_find(map, offset / bytes_per_cluster);
+    while(size > 0) {
+        fat32_extent* extent = &map->extents[idx];
+        uint offset_in_extent = offset - extent->logical*bytes_per_cluster;
+        uint size_in_extent = size <= extent->length*bytes_per_cluster - offset_in_extent ? size : extent->length*bytes_per_cluster - offset_in_extent;
+        // only the clusters touched make up the run
+        uint skipped_clusters = offset_in_extent / bytes_per_cluster;
+        uint run_count = (offset_in_extent + size_in_extent - 1) / bytes_per_cluster - skipped_clusters + 1;
+        if(fat32_transfer_run(meta, extent->physical + skipped_clusters, run_count, offset_in_extent % bytes_per_cluster, size_in_extent, buff, is_write) < 0) {
+            return -EIO;
+        }
+        offset += size_in_extent;
+        buff += size_in_extent;
+        size -= size_in_extent;
+        total_bytes += size_in_extent;
+        idx++;
+    }
+    return total_bytes;
 }
 
 // trim leading and trailing spaces and trailing periods
@@ -550,28 +1209,100 @@ static void fat_free_dir_iterator(fat_dir_iterator* iter)
 {
     free(iter->dir_entries);
     iter->dir_entries = NULL;
-    iter->dir_entry_count = 0;
     iter->entry_per_cluster = 0;
+    iter->buffered_cluster = 0;
+    iter->buffered_cluster_idx = 0;
     fat32_reset_dir_iterator(iter);
 }
 
+// Record that cluster is the cluster_idx-th cluster of the indexed dir, following the ones known already
+static void fat32_dir_index_map_cluster(fat32_dir_index* index, uint cluster_idx, uint cluster)
+{
+    if(cluster_idx != index->cluster_count) {
+        return;
+    }
+    if(index->cluster_count == index->cluster_capacity) {
+        uint new_capacity = index->cluster_capacity == 0 ? FAT32_DIR_INDEX_MIN_CLUSTERS : index->cluster_capacity * 2;
+        uint32_t* clusters = malloc(new_capacity*sizeof(*clusters));
+        if(index->clusters != NULL) {
+            memmove(clusters, index->clusters, index->cluster_count*sizeof(*clusters));
+            free(index->clusters);
+        }
+        index->clusters = clusters;
+        index->cluster_capacity = new_capacity;
+    }
+    index->clusters[index->cluster_count++] = cluster;
+}
+
+// Get dir entry at index entry_idx, reading in the cluster holding it if not buffered
+// The chain is followed from the nearest known cluster: the buffered one when moving forward,
+//   or the one recorded in the dir's name index, so that index hits do not walk from the first cluster
+// The dir lock (or the whole mount) shall be held
+// Return: the entry in the iterator buffer, NULL if beyond the end of the dir or on error (*error set)
+static fat32_direntry_t* fat32_dir_entry_at(fat32_meta* meta, fat_dir_iterator* iter, uint entry_idx, bool* error)
+{
+    *error = false;
+    if(iter->dir_entries == NULL) {
+        uint cluster_byte_size = meta->bootsector->sectors_per_cluster * meta->bootsector->bytes_per_sector;
+        iter->dir_entries = malloc(cluster_byte_size);
+        iter->entry_per_cluster = cluster_byte_size/sizeof(fat32_direntry_t);
+        iter->buffered_cluster = 0;
+    }
+
+    uint cluster_idx = entry_idx / iter->entry_per_cluster;
+    if(iter->buffered_cluster == 0 || iter->buffered_cluster_idx != cluster_idx) {
+        uint cluster = iter->first_cluster;
+        uint idx = 0;
+        fat32_dir_index* index = fat32_get_dir_index(meta, iter->first_cluster, false);
+        if(index != NULL) {
+            fat32_dir_index_map_cluster(index, 0, iter->first_cluster);
+            idx = cluster_idx < index->cluster_count ? cluster_idx : index->cluster_count - 1;
+            cluster = index->clusters[idx];
+        }
+        if(iter->buffered_cluster != 0 && iter->buffered_cluster_idx < cluster_idx && iter->buffered_cluster_idx > idx) {
+            cluster = iter->buffered_cluster;
+            idx = iter->buffered_cluster_idx;
+        }
+        fat_cluster info;
+        for(; idx < cluster_idx; idx++) {
+            fat32_get_cluster_info_locked(meta, cluster, &info);
+            if(info.next == 0) {
+                return NULL;
+            }
+            cluster = info.next;
+            if(index != NULL) {
+                fat32_dir_index_map_cluster(index, idx + 1, cluster);
+            }
+        }
+        iter->buffered_cluster = 0;
+        int64_t read_res = fat32_read_clusters(meta, cluster, 1, (uint8_t*) iter->dir_entries);
+        if(read_res < 0) {
+            *error = true;
+            return NULL;
+        }
+        iter->buffered_cluster = cluster;
+        iter->buffered_cluster_idx = cluster_idx;
+    }
+    return &iter->dir_entries[entry_idx % iter->entry_per_cluster];
+}
+
+// Write entry_count dir entries starting at index first_entry_idx of the iterator's dir
+static int fat32_write_dir_entries(fat32_meta* meta, fat_dir_iterator* iter, uint first_entry_idx, uint entry_count, const fat32_direntry_t* entries)
+{
+    if(fat32_flush_fat_for_dir_write(meta) < 0) {
+        return -EIO;
+    }
+    // the buffered cluster may be stale now
+    iter->buffered_cluster = 0;
+    int64_t res = fat32_transfer_chain(meta, iter->first_cluster, first_entry_idx*sizeof(fat32_direntry_t), entry_count*sizeof(fat32_direntry_t), (uint8_t*) entries, true);
+    if(res < 0) {
+        return res;
+    }
+    return 0;
+}
+
 static fat_iterate_dir_status fat32_iterate_dir(fat32_meta* meta, fat_dir_iterator* iter, fat32_file_entry* file_entry)
 {
-    if(iter->dir_entries == NULL) {
-        // if buff is null, read the whole dir into memory
-        uint cluster_byte_size = meta->bootsector->sectors_per_cluster * meta->bootsector->bytes_per_sector;
-        uint dir_total_cluster_count = count_clusters(meta, iter->first_cluster);
-        iter->dir_entries = malloc(dir_total_cluster_count*cluster_byte_size);
-        int64_t read_res = fat32_read_clusters(meta, iter->first_cluster, dir_total_cluster_count, (uint8_t*) iter->dir_entries);
-        if(read_res < 0) {
-            fat_free_dir_iterator(iter);
-            return FAT_DIR_ITER_ERROR;
-        }
-        iter->entry_per_cluster = cluster_byte_size/sizeof(fat32_direntry_t);
-        iter->dir_entry_count = dir_total_cluster_count*iter->entry_per_cluster;
-        fat32_reset_dir_iterator(iter);
-    }
-
     memset(file_entry, 0, sizeof(*file_entry));
     file_entry->dir_cluster = iter->first_cluster;
 	uint lfn_entry_buffered = 0;
@@ -579,11 +1310,11 @@ static fat_iterate_dir_status fat32_iterate_dir(fat32_meta* meta, fat_dir_iterat
 
     while(1)
     {
-        if(iter->current_dir_entry_idx >= iter->dir_entry_count) {
-            return FAT_DIR_ITER_NO_MORE_ENTRY;
+        bool error;
+        fat32_direntry_t* entry = fat32_dir_entry_at(meta, iter, iter->current_dir_entry_idx, &error);
+        if(entry == NULL) {
+            return error ? FAT_DIR_ITER_ERROR : FAT_DIR_ITER_NO_MORE_ENTRY;
         }
-
-        fat32_direntry_t* entry = &iter->dir_entries[iter->current_dir_entry_idx];
         // Algo Ref: https://wiki.osdev.org/FAT#Reading_Directories
         if(entry->short_entry.attr == FAT_ATTR_LFN && entry->short_entry.nameext[0] != 0xE5){
             // Is this entry a long file name entry? If the 11'th byte of the entry equals 0x0F, then it is a long file name entry. Otherwise, it is not.
@@ -615,7 +1346,7 @@ static fat_iterate_dir_status fat32_iterate_dir(fat32_meta* meta, fat_dir_iterat
             continue;
         } else {
             // Parse the data for this entry using the table from further up on this page. It would be a good idea to save the data for later. Possibly in a virtual file system structure. goto 6
-            file_entry->direntry = iter->dir_entries[iter->current_dir_entry_idx].short_entry;
+            file_entry->direntry = entry->short_entry;
             file_entry->dir_entry_count++;
             // Is there a long file name in the temporary buffer? Yes, goto 7. No, goto 8
             // Apply the long file name to the entry that you just read and clear the temporary buffer. goto 8
@@ -673,32 +1404,147 @@ static fat_iterate_dir_status fat32_iterate_dir(fat32_meta* meta, fat_dir_iterat
 
 }
 
+static uint32_t fat32_name_hash(const char* name)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    while(*name) {
+        hash ^= (uint8_t) *name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static bool fat32_entry_has_name(fat32_file_entry* file_entry, const char* filename)
+{
+    char shortname[FAT_SHORT_NAME_LEN + FAT_SHORT_EXT_LEN + 1 + 1] = {0}; // +1 for the dot ".", +1 for \0
+    // TODO: Case insensitive matching
+    if(strcmp((char*) file_entry->filename, filename) == 0) {
+        return true;
+    }
+    fat_standardize_short_name(shortname, &file_entry->direntry);
+    return strcmp(shortname, filename) == 0;
+}
+
+// Lock guarding the dir starting at dir_cluster, see fat32_meta
+static sleep_lock* fat32_dir_lock(fat32_meta* meta, uint dir_cluster)
+{
+    return &meta->dir_lk[dir_cluster % FAT32_N_DIR_LOCK];
+}
+
+static void fat32_dir_index_insert(fat32_dir_index* index, uint32_t hash, uint first_dir_entry_idx, uint dir_entry_count)
+{
+    if(index->node_count >= index->bucket_count*2) {
+        // keep chains short as the dir grows
+        uint new_bucket_count = index->bucket_count*2;
+        fat32_dir_index_node** new_buckets = malloc(new_bucket_count*sizeof(fat32_dir_index_node*));
+        memset(new_buckets, 0, new_bucket_count*sizeof(fat32_dir_index_node*));
+        for(uint i = 0; i < index->bucket_count; i++) {
+            fat32_dir_index_node* node = index->buckets[i];
+            while(node != NULL) {
+                fat32_dir_index_node* next = node->next;
+                node->next = new_buckets[node->hash % new_bucket_count];
+                new_buckets[node->hash % new_bucket_count] = node;
+                node = next;
+            }
+        }
+        free(index->buckets);
+        index->buckets = new_buckets;
+        index->bucket_count = new_bucket_count;
+    }
+
+    fat32_dir_index_node* node = malloc(sizeof(fat32_dir_index_node));
+    *node = (fat32_dir_index_node) {
+        .hash = hash,
+        .first_dir_entry_idx = first_dir_entry_idx,
+        .dir_entry_count = dir_entry_count,
+        .next = index->buckets[hash % index->bucket_count]
+    };
+    index->buckets[hash % index->bucket_count] = node;
+    index->node_count++;
+}
+
+static void fat32_dir_index_erase(fat32_dir_index* index, uint32_t hash, uint first_dir_entry_idx)
+{
+    fat32_dir_index_node** pnode = &index->buckets[hash % index->bucket_count];
+    while(*pnode != NULL) {
+        if((*pnode)->hash == hash && (*pnode)->first_dir_entry_idx == first_dir_entry_idx) {
+            fat32_dir_index_node* node = *pnode;
+            *pnode = node->next;
+            free(node);
+            index->node_count--;
+        } else {
+            pnode = &(*pnode)->next;
+        }
+    }
+}
+
+// Index both the long and the 8.3 name of a file
+static void fat32_dir_index_add(fat32_dir_index* index, fat32_file_entry* file_entry)
+{
+    char shortname[FAT_SHORT_NAME_LEN + FAT_SHORT_EXT_LEN + 1 + 1] = {0};
+    fat_standardize_short_name(shortname, &file_entry->direntry);
+    fat32_dir_index_insert(index, fat32_name_hash(file_entry->filename), file_entry->first_dir_entry_idx, file_entry->dir_entry_count);
+    if(strcmp(shortname, file_entry->filename) != 0) {
+        fat32_dir_index_insert(index, fat32_name_hash(shortname), file_entry->first_dir_entry_idx, file_entry->dir_entry_count);
+    }
+}
+
+static void fat32_dir_index_remove(fat32_dir_index* index, fat32_file_entry* file_entry)
+{
+    char shortname[FAT_SHORT_NAME_LEN + FAT_SHORT_EXT_LEN + 1 + 1] = {0};
+    fat_standardize_short_name(shortname, &file_entry->direntry);
+    fat32_dir_index_erase(index, fat32_name_hash(file_entry->filename), file_entry->first_dir_entry_idx);
+    fat32_dir_index_erase(index, fat32_name_hash(shortname), file_entry->first_dir_entry_idx);
+}
+
+// Look up filename in the dir iterated by iter through the dir's name index
+// Names not indexed yet are found by scanning on from where the last scan stopped, indexing every file passed
 static fat_resolve_path_status fat32_dir_lookup(fat32_meta* meta, fat_dir_iterator* iter, const char *filename, fat32_file_entry* file_entry)
 {
-    char shortname[FAT_SHORT_NAME_LEN + FAT_SHORT_EXT_LEN+1];
-    fat32_reset_dir_iterator(iter);
-    while(1) {
+    fat32_dir_index* index = fat32_get_dir_index(meta, iter->first_cluster, true);
+
+    uint32_t hash = fat32_name_hash(filename);
+    for(fat32_dir_index_node* node = index->buckets[hash % index->bucket_count]; node != NULL; node = node->next) {
+        if(node->hash != hash) {
+            continue;
+        }
+        iter->current_dir_entry_idx = node->first_dir_entry_idx;
+        fat_iterate_dir_status iter_status = fat32_iterate_dir(meta, iter, file_entry);
+        if(iter_status == FAT_DIR_ITER_ERROR) {
+            return FAT_PATH_RESOLVE_ERROR;
+        }
+        if(iter_status == FAT_DIR_ITER_VALID_ENTRY && file_entry->first_dir_entry_idx == node->first_dir_entry_idx
+            && file_entry->dir_entry_count == node->dir_entry_count && fat32_entry_has_name(file_entry, filename)) {
+            return FAT_PATH_RESOLVE_FOUND;
+        }
+    }
+
+    iter->current_dir_entry_idx = index->scanned_to;
+    while(!index->complete) {
         fat_iterate_dir_status iter_status = fat32_iterate_dir(meta, iter, file_entry);
         if(iter_status == FAT_DIR_ITER_ERROR) {
             // Any error will discard all info we got
             return FAT_PATH_RESOLVE_ERROR;
         }
+        if(iter_status == FAT_DIR_ITER_NO_MORE_ENTRY || iter_status == FAT_DIR_ITER_FREE_ENTRY) {
+            index->complete = true;
+            break;
+        }
+        index->scanned_to = iter->current_dir_entry_idx;
         if(iter_status == FAT_DIR_ITER_DELETED || iter_status == FAT_DIR_ITER_DOT_ENTRY) {
             continue;
         }
-        if(iter_status == FAT_DIR_ITER_NO_MORE_ENTRY || iter_status == FAT_DIR_ITER_FREE_ENTRY) {
-            return FAT_PATH_RESOLVE_NOT_FOUND;
-        }
         assert(iter_status == FAT_DIR_ITER_VALID_ENTRY);
-        // TODO: Case insensitive matching
-        if(strcmp((char*) file_entry->filename, filename) == 0) {
-            return FAT_PATH_RESOLVE_FOUND;
-        }
-        fat_standardize_short_name(shortname, &file_entry->direntry);
-        if(strcmp((char*) shortname, filename) == 0) {
+        fat32_dir_index_add(index, file_entry);
+        if(fat32_entry_has_name(file_entry, filename)) {
             return FAT_PATH_RESOLVE_FOUND;
         }
     }
+
+    memset(file_entry, 0, sizeof(*file_entry));
+    file_entry->dir_cluster = iter->first_cluster;
+    return FAT_PATH_RESOLVE_NOT_FOUND;
 }
 
 static fat_resolve_path_status fat32_resolve_path(fat32_meta* meta, const char *path, fat32_file_entry* file_entry)
@@ -721,7 +1567,10 @@ static fat_resolve_path_status fat32_resolve_path(fat32_meta* meta, const char *
 
     fat_resolve_path_status resolve_status;
     while(1) {
+        sleep_lock* dir_lock = fat32_dir_lock(meta, iter.first_cluster);
+        acquire_sleep(dir_lock);
         resolve_status = fat32_dir_lookup(meta, &iter, filename, file_entry);
+        release_sleep(dir_lock);
         if(resolve_status != FAT_PATH_RESOLVE_FOUND) {
             // if not found or error
             break;
@@ -820,16 +1669,38 @@ static int fat32_set_short_name(fat32_file_entry* file_entry)
     return 0;
 }
 
+// Numeric tails ~1 to ~4 are tried before falling back to a hashed short name
+#define FAT32_SEQUENTIAL_NUMERIC_TAILS 4
+
 // Return: numeric tail appended for short name collision prevention
+// Only the first few tails are tried in order, after that the body is replaced by a hash of the long name
+//   (as Windows does), so that a dir full of names sharing a body is not probed through all their tails
 static int fat32_set_numeric_tail(fat32_meta* meta, fat_dir_iterator* iter, fat32_file_entry* file_entry)
 {
     char shortname[FAT_SHORT_NAME_LEN + FAT_SHORT_EXT_LEN + 1 + 1] = {0}; // +1 for the dot ".", +1 for \0
     fat32_file_entry existing_entry = {0};
     char buff[FAT_SHORT_NAME_LEN + 1] = {0};//+1 for \0, not necessary but just in case
+    uint32_t name_hash = fat32_name_hash(file_entry->filename);
 
     // Assume we always need to add numeric tail here
     // Ref: http://elm-chan.org/fsw/ff/00index_e.html
-    for (uint number_tail = 1; number_tail <= 0xFFFFFF; number_tail++) {
+    for (uint attempt = 1; attempt <= FAT32_SEQUENTIAL_NUMERIC_TAILS + 0x10000; attempt++) {
+        fat32_file_entry working_entry = *file_entry;
+        uint number_tail = attempt;
+        if(attempt > FAT32_SEQUENTIAL_NUMERIC_TAILS) {
+            // keep up to two chars of the body followed by four hex digits of the hash, then tail ~1
+            uint hash = (name_hash + attempt - FAT32_SEQUENTIAL_NUMERIC_TAILS - 1) & 0xFFFF;
+            int body_len = 0;
+            for (; body_len < 2 && working_entry.direntry.name[body_len] != ' '; body_len++);
+            for (int k = 3; k >= 0; k--) {
+                uint8_t c = (uint8_t)((hash % 16) + '0');
+                if (c > '9') c += 7;
+                working_entry.direntry.name[body_len + k] = c;
+                hash /= 16;
+            }
+            memset(&working_entry.direntry.name[body_len + 4], ' ', FAT_SHORT_NAME_LEN - body_len - 4);
+            number_tail = 1;
+        }
         uint seq = number_tail;
         int i=FAT_SHORT_NAME_LEN - 1;
         do {
@@ -840,7 +1711,6 @@ static int fat32_set_numeric_tail(fat32_meta* meta, fat_dir_iterator* iter, fat3
         } while(seq);
         buff[i] = '~';
 
-        fat32_file_entry working_entry = *file_entry;
         /* Append the number to the SFN body */
         int j = 0;
         for (; j < i && working_entry.direntry.name[j] != ' '; j++);
@@ -861,41 +1731,10 @@ static int fat32_set_numeric_tail(fat32_meta* meta, fat_dir_iterator* iter, fat3
 
 static int fat32_write_to_offset(fat32_meta* meta, uint first_cluster, uint offset, uint size, const uint8_t* buff)
 {
-    uint bytes_per_cluster = meta->bootsector->sectors_per_cluster*meta->bootsector->bytes_per_sector;
-    uint cluster_start_writing = fat32_index_cluster_chain(meta, first_cluster, offset / bytes_per_cluster);
-    uint clusters_to_write = 1 + ((offset + size - 1) / bytes_per_cluster) - (offset / bytes_per_cluster);
-    fat_cluster cluster = {.next = cluster_start_writing};
-
-    uint8_t* cluster_buff = malloc(bytes_per_cluster);
-    uint start_offset_in_cluster, end_offset_in_cluster;
-    for(uint i=0; i < clusters_to_write; i++) {
-        assert(cluster.next != 0);
-        fat_cluster_status cluster_status = fat32_get_cluster_info(meta, cluster.next, &cluster);
-        assert(cluster_status == FAT_CLUSTER_USED || cluster_status == FAT_CLUSTER_EOC);
-        int64_t read_res = fat32_read_clusters(meta, cluster.curr, 1, cluster_buff);
-        if(read_res < 0) {
-            free(cluster_buff);
-            return read_res;
-        }
-        if(i == 0) {
-            start_offset_in_cluster = offset % bytes_per_cluster;
-        } else {
-            start_offset_in_cluster = 0;
-        }
-        if(i == clusters_to_write - 1) {
-            end_offset_in_cluster = (offset + size - 1) % bytes_per_cluster;
-        } else {
-            end_offset_in_cluster = bytes_per_cluster - 1;
-        }
-        memmove(cluster_buff + start_offset_in_cluster, buff, end_offset_in_cluster - start_offset_in_cluster + 1);
-        int64_t write_res = fat32_write_clusters(meta, cluster.curr, 1, cluster_buff);
-        if(write_res < 0) {
-            free(cluster_buff);
-            return write_res;
-        }
-        buff += end_offset_in_cluster - start_offset_in_cluster + 1;
+    int64_t res = fat32_transfer_chain(meta, first_cluster, offset, size, (uint8_t*) buff, true);
+    if(res < 0) {
+        return res;
     }
-    free(cluster_buff);
     return 0;
 }
 
@@ -941,7 +1780,7 @@ static int fat32_add_file_entry(fat32_meta* meta, fat_dir_iterator* iter, fat32_
         assert(free_entry_count < dir_entry_needed);
         // if reach the end of entries and still no enough space, allocate a new cluster
         uint clusters_to_alloc = (dir_entry_needed - free_entry_count - 1) / dir_entry_per_cluster + 1;
-        uint first_new_cluster = fat32_allocate_cluster(meta, fat32_index_cluster_chain(meta, iter->first_cluster, -1), clusters_to_alloc);
+        uint first_new_cluster = fat32_allocate_cluster_locked(meta, fat32_index_cluster_chain(meta, iter->first_cluster, -1), clusters_to_alloc);
         if(first_new_cluster == 0) {
             return -EIO;
         }
@@ -953,18 +1792,17 @@ static int fat32_add_file_entry(fat32_meta* meta, fat_dir_iterator* iter, fat32_
         if(write_res < 0) {
             return -EIO;
         }
-        fat_free_dir_iterator(iter);
+        // carry on scanning into the new clusters
     }
 
-    // Reuse iterator dir buffer
-    fat32_direntry_t* dir = iter->dir_entries;
-
     // Write dir entries to the buffer
+    fat32_direntry_t* dir = malloc(dir_entry_needed*sizeof(fat32_direntry_t));
     uint remaining_char_to_copy = lfn_len;
     char* p_filename = &file_entry->filename[lfn_len];
     fat32_set_short_name(file_entry);
     int res_numtail = fat32_set_numeric_tail(meta, iter, file_entry);
     if(res_numtail < 0) {
+        free(dir);
         return -ENOSPC;
     }
     fat32_direntry_short short_entry = file_entry->direntry;
@@ -972,7 +1810,7 @@ static int fat32_add_file_entry(fat32_meta* meta, fat_dir_iterator* iter, fat32_
     for(uint idx = 0; idx < dir_entry_needed; idx++) {
         if(idx == dir_entry_needed - 1) {
             // only short entry left to write
-            dir[first_free_entry_idx + idx].short_entry = short_entry;
+            dir[idx].short_entry = short_entry;
         } else {
             // Add LFN entry
             fat32_direntry_long e = long_entry;
@@ -1019,15 +1857,30 @@ static int fat32_add_file_entry(fat32_meta* meta, fat_dir_iterator* iter, fat32_
                    e.name3[char_to_copy-(5+6)] = 0;
                }
             }
-            dir[first_free_entry_idx + idx].long_entry = e;
+            dir[idx].long_entry = e;
         }
     }
 
     // Write the dir to disk
-    int64_t res = fat32_write_to_offset(meta, iter->first_cluster, first_free_entry_idx*sizeof(fat32_direntry_t), dir_entry_needed*sizeof(fat32_direntry_t), (uint8_t*) &dir[first_free_entry_idx]);
+    int res = fat32_write_dir_entries(meta, iter, first_free_entry_idx, dir_entry_needed, dir);
+    free(dir);
     if(res < 0) {
         return res;
     }
+    // The entries may have moved, keep the caller's copy (e.g. in the open file table) pointing at them
+    file_entry->dir_cluster = iter->first_cluster;
+    file_entry->first_dir_entry_idx = first_free_entry_idx;
+    file_entry->dir_entry_count = dir_entry_needed;
+
+    // Entries not yet scanned will be indexed when the scan reaches them
+    fat32_dir_index* index = fat32_get_dir_index(meta, iter->first_cluster, false);
+    if(index != NULL && (index->complete || (uint) first_free_entry_idx < index->scanned_to)) {
+        fat32_dir_index_add(index, file_entry);
+        if(!index->complete && index->scanned_to < first_free_entry_idx + dir_entry_needed) {
+            // never resume a scan in the middle of the new entries
+            index->scanned_to = first_free_entry_idx + dir_entry_needed;
+        }
+    }
 
 
     return dir_entry_needed;
@@ -1037,23 +1890,33 @@ static int fat32_add_file_entry(fat32_meta* meta, fat_dir_iterator* iter, fat32_
 //Return: dir entries removed
 static int fat32_rm_file_entry(fat32_meta* meta, fat_dir_iterator* iter, fat32_file_entry* file_entry)
 {
-    // Reuse iterator dir buffer, need to ensure the iter is initialized
-    fat32_file_entry entry = {0};
-    fat32_iterate_dir(meta, iter, &entry);
-    fat32_direntry_t* dir = iter->dir_entries;
+    fat32_direntry_t* dir = malloc(file_entry->dir_entry_count*sizeof(fat32_direntry_t));
 
-    // Write dir entries to the buffer
+    // Read in the entries, they may span clusters
     for(uint i = 0; i < file_entry->dir_entry_count; i++) {
+        bool error;
+        fat32_direntry_t* entry = fat32_dir_entry_at(meta, iter, file_entry->first_dir_entry_idx + i, &error);
+        if(entry == NULL) {
+            free(dir);
+            return -EIO;
+        }
+        dir[i] = *entry;
         // Set dir entry as deleted
-        dir[file_entry->first_dir_entry_idx + i].short_entry.name[0] = 0xE5;
+        dir[i].short_entry.name[0] = 0xE5;
     }
 
     // Write the dir to disk
-    int64_t res = fat32_write_to_offset(meta, iter->first_cluster, file_entry->first_dir_entry_idx*sizeof(fat32_direntry_t), file_entry->dir_entry_count*sizeof(fat32_direntry_t), (uint8_t*) &dir[file_entry->first_dir_entry_idx]);
+    int res = fat32_write_dir_entries(meta, iter, file_entry->first_dir_entry_idx, file_entry->dir_entry_count, dir);
+    free(dir);
     if(res < 0) {
         return res;
     }
 
+    fat32_dir_index* index = fat32_get_dir_index(meta, iter->first_cluster, false);
+    if(index != NULL) {
+        fat32_dir_index_remove(index, file_entry);
+    }
+
     return file_entry->dir_entry_count;
 }
 
@@ -1114,22 +1977,267 @@ static int64_t fat32_create_new(fat32_meta* meta, const char *path, fat32_dirent
 }
 
 
+// Rewrite the dir entries of a file, under the dir lock so that lookups never miss it in between
 static int fat32_update_file_entry(fat32_meta* meta, fat32_file_entry* file_entry)
 {
     fat_dir_iterator iter = {.first_cluster = file_entry->dir_cluster};
+    fat32_file_entry old_entry = *file_entry;
+    sleep_lock* dir_lock = fat32_dir_lock(meta, iter.first_cluster);
+    acquire_sleep(dir_lock);
     int dir_res = fat32_rm_file_entry(meta, &iter, file_entry);
-    if(dir_res<0) {
-        return dir_res;
+    if(dir_res >= 0) {
+        dir_res = fat32_add_file_entry(meta, &iter, file_entry);
+    }
+    release_sleep(dir_lock);
+    if(dir_res >= 0 && file_entry->first_dir_entry_idx != old_entry.first_dir_entry_idx) {
+        // The entries may land in an earlier free slot, other handles of the file follow them there
+        for(uint i = 0; i < FAT32_N_OPEN_FILE; i++) {
+            if(&meta->file_table[i] != file_entry && fat32_is_same_file(&meta->file_table[i], &old_entry)) {
+                meta->file_table[i].first_dir_entry_idx = file_entry->first_dir_entry_idx;
+            }
+        }
     }
-    dir_res = fat32_add_file_entry(meta, &iter, file_entry);
+    fat_free_dir_iterator(&iter);
     if(dir_res<0) {
         return dir_res;
     }
-    fat_free_dir_iterator(&iter);
     return 0;
 }
 
 
+// Allocate the clusters backing [offset, offset + size) of a file, update its dir entry and write buff there
+static int fat32_write_file(fat32_meta* meta, fat32_file_entry* file_entry, uint offset, uint size, const uint8_t* buff)
+{
+    uint first_cluster = file_entry->direntry.cluster_lo + (file_entry->direntry.cluster_hi << 16);
+
+    uint tail_cluster;
+    int64_t cluster_count = fat32_file_chain_length(meta, file_entry, &tail_cluster);
+    if(cluster_count < 0) {
+        return cluster_count;
+    }
+    uint bytes_per_cluster = meta->bootsector->sectors_per_cluster*meta->bootsector->bytes_per_sector;
+    uint allocated_size = bytes_per_cluster * cluster_count;
+    if(offset + size > allocated_size) {
+        uint clusters_to_allocate = ((offset + size) - allocated_size - 1) / bytes_per_cluster + 1;
+        uint first_allocated_cluster = fat32_allocate_cluster_locked(meta, tail_cluster, clusters_to_allocate);
+        if(first_allocated_cluster == 0) {
+            return -EIO;
+        }
+        if(first_cluster == 0) {
+            first_cluster = first_allocated_cluster;
+            file_entry->direntry.cluster_lo = first_allocated_cluster & 0x0000FFFF;
+            file_entry->direntry.cluster_hi = first_allocated_cluster >> 16;
+        }
+    }
+
+    if(offset + size > file_entry->direntry.size) {
+        file_entry->direntry.size = offset + size;
+    }
+
+    uint16_t date, time;
+    fat32_set_timestamp(&date, &time);
+    file_entry->direntry.mtime_time = time;
+    file_entry->direntry.mtime_date = date;
+
+    int dir_res = fat32_update_file_entry(meta, file_entry);
+    if(dir_res < 0) {
+        return dir_res;
+    }
+    file_entry->entry_dirty = false;
+
+    if(size == 0) {
+        return 0;
+    }
+
+    int64_t write_res = fat32_transfer_file(meta, file_entry, offset, size, (uint8_t*) buff, true);
+    if(write_res < 0) {
+        return write_res;
+    }
+
+    return size;
+}
+
+// Write back the buffered data and the deferred dir entry update of open file fh
+// Clusters for the whole buffered range are allocated at once, so they come out contiguous where possible
+static int fat32_flush_file(fat32_meta* meta, uint fh)
+{
+    fat32_file_entry* file_entry = &meta->file_table[fh];
+    if(!file_entry->entry_dirty) {
+        return 0;
+    }
+    fat32_write_buffer* wb = file_entry->write_buffer;
+    int res;
+    if(wb != NULL && wb->size > 0) {
+        // The reservation turns into a real allocation now
+        acquire_sleep(&meta->fat_lk);
+        meta->write_reserved_clusters -= wb->reserved_clusters;
+        release_sleep(&meta->fat_lk);
+        wb->reserved_clusters = 0;
+        res = fat32_write_file(meta, file_entry, wb->offset, wb->size, wb->data);
+        if(res >= 0) {
+            acquire_sleep(&meta->fat_lk);
+            meta->write_buffered_bytes -= wb->size;
+            release_sleep(&meta->fat_lk);
+            wb->size = 0;
+        }
+    } else {
+        res = fat32_update_file_entry(meta, file_entry);
+    }
+    // A failed write back keeps the data and the pending update, so that fsync or close reports it and tries again
+    file_entry->entry_dirty = res < 0;
+    return res < 0 ? res : 0;
+}
+
+// Give up the buffered writes of open file fh and what they hold of the write behind limit and free clusters
+static void fat32_discard_write_buffer(fat32_meta* meta, uint fh)
+{
+    fat32_write_buffer* wb = meta->file_table[fh].write_buffer;
+    if(wb == NULL) {
+        return;
+    }
+    acquire_sleep(&meta->fat_lk);
+    meta->write_reserved_clusters -= wb->reserved_clusters;
+    meta->write_buffered_bytes -= wb->size;
+    release_sleep(&meta->fat_lk);
+    free(wb->data);
+    free(wb);
+    meta->file_table[fh].write_buffer = NULL;
+}
+
+// Write back the buffered writes of all open files
+static int fat32_flush_files(fat32_meta* meta)
+{
+    int res = 0;
+    for(uint i = 0; i < FAT32_N_OPEN_FILE; i++) {
+        if(meta->file_table[i].dir_entry_count > 0) {
+            int flush_res = fat32_flush_file(meta, i);
+            if(flush_res < 0 && res == 0) {
+                res = flush_res;
+            }
+        }
+    }
+    return res;
+}
+
+static bool fat32_has_pending_writes(fat32_meta* meta)
+{
+    for(uint i = 0; i < FAT32_N_OPEN_FILE; i++) {
+        if(meta->file_table[i].entry_dirty) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Whether the file behind open file fh is also opened through another file handle
+static bool fat32_is_file_shared(fat32_meta* meta, uint fh)
+{
+    fat32_file_entry* file_entry = &meta->file_table[fh];
+    for(uint i = 0; i < FAT32_N_OPEN_FILE; i++) {
+        if(i != fh && fat32_is_same_file(&meta->file_table[i], file_entry)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool fat32_is_file_opened(fat32_meta* meta, fat32_file_entry* file_entry)
+{
+    for(uint i = 0; i < FAT32_N_OPEN_FILE; i++) {
+        if(fat32_is_same_file(&meta->file_table[i], file_entry)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Write back the buffered writes of the open handles of file_entry, leaving other files alone
+// return: number of handles written back, <0 - error
+static int fat32_flush_opened_file(fat32_meta* meta, fat32_file_entry* file_entry)
+{
+    int flushed = 0;
+    for(uint i = 0; i < FAT32_N_OPEN_FILE; i++) {
+        if(meta->file_table[i].entry_dirty && fat32_is_same_file(&meta->file_table[i], file_entry)) {
+            int res = fat32_flush_file(meta, i);
+            if(res < 0) {
+                return res;
+            }
+            flushed++;
+        }
+    }
+    return flushed;
+}
+
+// Append a write to the write buffer of open file fh, deferring cluster allocation and the dir entry update
+// Only files opened once are buffered, so every other handle keeps seeing the data on disk
+// return: 1 - buffered, 0 - caller shall write it through, <0 - error
+static int fat32_buffer_write(fat32_meta* meta, uint fh, uint offset, uint size, const uint8_t* buff)
+{
+    fat32_file_entry* file_entry = &meta->file_table[fh];
+    fat32_write_buffer* wb = file_entry->write_buffer;
+    if(wb == NULL || size == 0 || size > FAT32_WRITE_BUFFER_SIZE || offset + size < offset || fat32_is_file_shared(meta, fh)) {
+        return 0;
+    }
+
+    int res;
+    if(wb->size > 0 && (offset != wb->offset + wb->size || wb->size + size > FAT32_WRITE_BUFFER_SIZE)) {
+        // Only one contiguous range is buffered per file
+        res = fat32_flush_file(meta, fh);
+        if(res < 0) {
+            return res;
+        }
+    }
+
+    uint bytes_per_cluster = meta->bootsector->sectors_per_cluster*meta->bootsector->bytes_per_sector;
+    if(wb->size == 0) {
+        uint tail_cluster;
+        int64_t cluster_count = fat32_file_chain_length(meta, file_entry, &tail_cluster);
+        if(cluster_count < 0) {
+            return cluster_count;
+        }
+        wb->offset = offset;
+        wb->allocated_size = bytes_per_cluster * cluster_count;
+    }
+
+    // Reserve the clusters the buffered range will need, so that the write back cannot run out of space
+    uint end = wb->offset + wb->size + size;
+    uint clusters_needed = end > wb->allocated_size ? (end - wb->allocated_size - 1) / bytes_per_cluster + 1 : 0;
+    uint more = clusters_needed > wb->reserved_clusters ? clusters_needed - wb->reserved_clusters : 0;
+    acquire_sleep(&meta->fat_lk);
+    // The buffers of other files cannot be written back from here, they are under their own file lock
+    // Reserve against the free clusters of the FAT sectors reflected so far, a lower bound that needs no FAT reads
+    //   under fat_lk (the FS Info count may be stale); when short, the write goes through and its allocation reads further
+    bool accepted = meta->write_buffered_bytes + size <= FAT32_WRITE_BEHIND_LIMIT
+        && meta->free_map_free_count >= meta->write_reserved_clusters + more;
+    if(accepted) {
+        meta->write_reserved_clusters += more;
+        meta->write_buffered_bytes += size;
+    }
+    release_sleep(&meta->fat_lk);
+    if(!accepted) {
+        // Write it through, which also reports the disk being full
+        return 0;
+    }
+    wb->reserved_clusters += more;
+
+    if(wb->data == NULL) {
+        wb->data = malloc(FAT32_WRITE_BUFFER_SIZE);
+    }
+    memmove(wb->data + wb->size, buff, size);
+    wb->size += size;
+
+    if(offset + size > file_entry->direntry.size) {
+        file_entry->direntry.size = offset + size;
+    }
+    uint16_t date, time;
+    fat32_set_timestamp(&date, &time);
+    file_entry->direntry.mtime_time = time;
+    file_entry->direntry.mtime_date = date;
+    file_entry->entry_dirty = true;
+
+    return 1;
+}
+
 static int fat32_readdir(struct fs_mount_point* mount_point, const char * path, uint offset, struct fs_dir_filler_info* info, fs_dir_filler filler)
 {
     fat32_meta* meta = (fat32_meta*) mount_point->fs_meta;
@@ -1159,19 +2267,21 @@ static int fat32_readdir(struct fs_mount_point* mount_point, const char * path,
         iter.first_cluster = file_entry.direntry.cluster_lo + (file_entry.direntry.cluster_hi << 16);
     }
 
+    sleep_lock* dir_lock = fat32_dir_lock(meta, iter.first_cluster);
+    acquire_sleep(dir_lock);
+    int res = 0;
     while(1) {
         iter_status = fat32_iterate_dir(meta, &iter, &file_entry);
         if(iter_status == FAT_DIR_ITER_ERROR) {
             // Any error will discard all info we got
-            fat_free_dir_iterator(&iter);
-            return -EIO;
+            res = -EIO;
+            break;
         }
         if(iter_status == FAT_DIR_ITER_DELETED) {
             continue;
         }
         if(iter_status == FAT_DIR_ITER_NO_MORE_ENTRY || iter_status == FAT_DIR_ITER_FREE_ENTRY) {
-            fat_free_dir_iterator(&iter);
-            return 0;
+            break;
         }
         assert(iter_status == FAT_DIR_ITER_VALID_ENTRY || iter_status == FAT_DIR_ITER_DOT_ENTRY);
         if(HAS_ATTR(file_entry.direntry.attr, FAT_ATTR_VOLUME_ID)) {
@@ -1182,13 +2292,16 @@ static int fat32_readdir(struct fs_mount_point* mount_point, const char * path,
         if(offset == 0) {
             if(filler(info, (char*) file_entry.filename, NULL) != 0) {
                 // if filler's internal buffer is full, return
-                return 0;
+                break;
             }
         } else {
             offset--;
         }
         
     }
+    release_sleep(dir_lock);
+    fat_free_dir_iterator(&iter);
+    return res;
 }
 
 
@@ -1227,6 +2340,16 @@ static int fat32_getattr(struct fs_mount_point* mount_point, const char * path,
     }
 
     if(status == FAT_PATH_RESOLVE_FOUND) {
+        for(uint i = 0; i < FAT32_N_OPEN_FILE; i++) {
+            fat32_file_entry* opened = &meta->file_table[i];
+            if(opened->entry_dirty && fat32_is_same_file(opened, &file_entry)) {
+                // Report the size and mtime of the buffered writes not yet in the dir entry
+                acquire_sleep(&meta->file_lk[i]);
+                file_entry.direntry = opened->direntry;
+                release_sleep(&meta->file_lk[i]);
+                break;
+            }
+        }
         if(HAS_ATTR(file_entry.direntry.attr, FAT_ATTR_READ_ONLY)) {
             st->mode = S_IRUSR | S_IRGRP | S_IROTH;
         } else {
@@ -1258,6 +2381,14 @@ static int fat32_read(struct fs_mount_point* mount_point, const char * path, cha
 
     fat32_meta* meta = (fat32_meta*) mount_point->fs_meta;
 
+    if(fi != NULL) {
+        // Read what was written so far, the buffers of other files are written back by fat32_read_locked
+        int flush_res = fat32_flush_file(meta, fi->fh);
+        if(flush_res < 0) {
+            return flush_res;
+        }
+    }
+
     fat32_file_entry file_entry = {0};
     if(fi != NULL) {
         file_entry = meta->file_table[fi->fh];
@@ -1271,72 +2402,29 @@ static int fat32_read(struct fs_mount_point* mount_point, const char * path, cha
         if(status == FAT_PATH_RESOLVE_INVALID_PATH) {
             return -ENOENT;
         }
-        if(status == FAT_PATH_RESOLVE_ERROR) {
-            return -EIO;
-        }
-        if(status == FAT_PATH_RESOLVE_NOT_FOUND) {
-            return -ENOENT;
-        }
-
-        assert(status == FAT_PATH_RESOLVE_FOUND);
-    }
-
-    if(HAS_ATTR(file_entry.direntry.attr, FAT_ATTR_DIRECTORY)) {
-        return -EISDIR;
-    }
-
-    if(offset >= file_entry.direntry.size) {
-        return 0;
-    }
-
-    if(offset + size > file_entry.direntry.size) {
-        size = file_entry.direntry.size - offset;
-    }
-
-    fat_cluster cluster;
-    cluster.next = file_entry.direntry.cluster_lo + (file_entry.direntry.cluster_hi << 16);
-    uint bytes_per_cluster = meta->bootsector->sectors_per_cluster*meta->bootsector->bytes_per_sector;
-    uint8_t* cluster_buffer = malloc(bytes_per_cluster);
-    uint size_in_this_cluster;
-    int64_t total_bytes_read = 0;
-    while(1) {
-        fat_cluster_status cluster_status = fat32_get_cluster_info(meta, cluster.next, &cluster);
-
-        if(cluster_status == FAT_CLUSTER_BAD || cluster_status == FAT_CLUSTER_FREE || cluster_status == FAT_CLUSTER_RESERVED) {
-            free(cluster_buffer);
-            return -EIO;
-        }
-        assert(cluster_status == FAT_CLUSTER_USED || cluster_status == FAT_CLUSTER_EOC);
-
-        if(offset < bytes_per_cluster) {
-            int64_t read_res = fat32_read_clusters(meta, cluster.curr, 1, cluster_buffer);
-            if(read_res < 0) {
-                free(cluster_buffer);
-                return read_res;
-            }
-            if(size <= bytes_per_cluster - offset) {
-                size_in_this_cluster = size;
-            } else {
-                size_in_this_cluster = bytes_per_cluster - offset;
-            }
-            memmove(buf, cluster_buffer + offset, size_in_this_cluster);
-            buf += size_in_this_cluster;
-            offset = 0;
-            size -= size_in_this_cluster;
-            total_bytes_read += size_in_this_cluster;
-        } else {
-            offset -= bytes_per_cluster;
-        }
-
-        if(size == 0) {
-            free(cluster_buffer);
-            return total_bytes_read;
-        }
-
-        if(cluster_status == FAT_CLUSTER_EOC) {
+        if(status == FAT_PATH_RESOLVE_ERROR) {
             return -EIO;
         }
+        if(status == FAT_PATH_RESOLVE_NOT_FOUND) {
+            return -ENOENT;
+        }
+
+        assert(status == FAT_PATH_RESOLVE_FOUND);
+    }
+
+    if(HAS_ATTR(file_entry.direntry.attr, FAT_ATTR_DIRECTORY)) {
+        return -EISDIR;
+    }
+
+    if(offset >= file_entry.direntry.size) {
+        return 0;
     }
+
+    if(offset + size > file_entry.direntry.size) {
+        size = file_entry.direntry.size - offset;
+    }
+
+    return fat32_transfer_file(meta, &file_entry, offset, size, (uint8_t*) buf, false);
 }
 
 static int fat32_mknod(struct fs_mount_point* mount_point, const char * path, uint mode)
@@ -1360,7 +2448,7 @@ static int fat32_mkdir(struct fs_mount_point* mount_point, const char * path, ui
     fat32_meta* meta = (fat32_meta*) mount_point->fs_meta;
     
     fat32_direntry_short short_dir_entry = {.attr = FAT_ATTR_DIRECTORY};
-    uint first_new_cluster = fat32_allocate_cluster(meta, 0, 1);
+    uint first_new_cluster = fat32_allocate_cluster_locked(meta, 0, 1);
     if(first_new_cluster == 0) {
         return -EIO;
     }
@@ -1392,20 +2480,6 @@ static int fat32_mkdir(struct fs_mount_point* mount_point, const char * path, ui
     return 0;
 }
 
-static int fat32_is_cluster_opened(fat32_meta* meta, uint cluster)
-{
-    if(cluster <= 1) {
-        return 0;
-    }
-    for(int i=0;i<FAT32_N_OPEN_FILE;i++) {
-        uint opened_cluster =  meta->file_table[i].direntry.cluster_lo + (meta->file_table[i].direntry.cluster_hi << 16);
-        if(cluster == opened_cluster) {
-            return 1;
-        }
-    }
-    return 0;
-}
-
 //return: 0 - not empty, 1 - empty, <0 - error
 static int fat32_is_dir_empty(fat32_meta* meta, fat_dir_iterator* iter)
 {
@@ -1455,7 +2529,7 @@ static int fat32_rm(fat32_meta* meta, const char * path, enum fat32_rm_type rm_t
     assert(status == FAT_PATH_RESOLVE_FOUND);
 
     uint cluster = file_entry.direntry.cluster_lo + (file_entry.direntry.cluster_hi << 16);
-    if(fat32_is_cluster_opened(meta, cluster)) {
+    if(fat32_is_file_opened(meta, &file_entry)) {
         // shall not delete opened file
         return -EPERM;
     }
@@ -1486,8 +2560,12 @@ static int fat32_rm(fat32_meta* meta, const char * path, enum fat32_rm_type rm_t
         return res;
     }
 
+    if(HAS_ATTR(file_entry.direntry.attr, FAT_ATTR_DIRECTORY)) {
+        fat32_drop_dir_index(meta, cluster);
+    }
+
     // Free data clusters
-    res = fat32_free_cluster(meta, 0, cluster, 0); // free the whole cluster chain
+    res = fat32_free_cluster_locked(meta, 0, cluster, 0); // free the whole cluster chain
     if(res < 0) {
         return res;
     }
@@ -1513,84 +2591,66 @@ static int fat32_write(struct fs_mount_point* mount_point, const char * path, co
 {
     fat32_meta* meta = (fat32_meta*) mount_point->fs_meta;
 
-    fat32_file_entry file_entry = {0};
     if(fi != NULL) {
-        file_entry = meta->file_table[fi->fh];
-        assert(file_entry.dir_entry_count > 0);
-    } else {
-        fat_resolve_path_status status = fat32_resolve_path(meta, path, &file_entry);
-
-        if(status == FAT_PATH_RESOLVE_ROOT_DIR) {
+        fat32_file_entry* file_entry = &meta->file_table[fi->fh];
+        assert(file_entry->dir_entry_count > 0);
+        if(HAS_ATTR(file_entry->direntry.attr, FAT_ATTR_DIRECTORY)) {
             return -EISDIR;
         }
-        if(status == FAT_PATH_RESOLVE_INVALID_PATH) {
-            return -ENOENT;
+        int res = fat32_buffer_write(meta, fi->fh, offset, size, (const uint8_t*) buf);
+        if(res < 0) {
+            return res;
         }
-        if(status == FAT_PATH_RESOLVE_ERROR) {
-            return -EIO;
+        if(res == 1) {
+            return size;
         }
-        if(status == FAT_PATH_RESOLVE_NOT_FOUND) {
-            return -ENOENT;
+        res = fat32_flush_file(meta, fi->fh);
+        if(res < 0) {
+            return res;
         }
-
-        assert(status == FAT_PATH_RESOLVE_FOUND);
+        return fat32_write_file(meta, file_entry, offset, size, (const uint8_t*) buf);
     }
 
-    if(HAS_ATTR(file_entry.direntry.attr, FAT_ATTR_DIRECTORY)) {
-        return -EISDIR;
+    int flush_res = fat32_flush_files(meta);
+    if(flush_res < 0) {
+        return flush_res;
     }
 
-    uint first_cluster = file_entry.direntry.cluster_lo + (file_entry.direntry.cluster_hi << 16);
+    fat32_file_entry file_entry = {0};
+    fat_resolve_path_status status = fat32_resolve_path(meta, path, &file_entry);
 
-    uint cluster_count = first_cluster == 0 ? 0 : count_clusters(meta, first_cluster);
-    uint bytes_per_cluster = meta->bootsector->sectors_per_cluster*meta->bootsector->bytes_per_sector;
-    uint allocated_size = bytes_per_cluster * cluster_count;
-    if(offset + size > allocated_size) {
-        uint clusters_to_allocate = ((offset + size) - allocated_size - 1) / bytes_per_cluster + 1;
-        uint first_allocated_cluster = fat32_allocate_cluster(meta, fat32_index_cluster_chain(meta, first_cluster, -1), clusters_to_allocate);
-        if(first_allocated_cluster == 0) {
-            return -EIO;
-        }
-        if(first_cluster == 0) {
-            first_cluster = first_allocated_cluster;
-            file_entry.direntry.cluster_lo = first_allocated_cluster & 0x0000FFFF;
-            file_entry.direntry.cluster_hi = first_allocated_cluster >> 16;
-        }
+    if(status == FAT_PATH_RESOLVE_ROOT_DIR) {
+        return -EISDIR;
     }
-
-    if(offset + size > file_entry.direntry.size) {
-        file_entry.direntry.size = offset + size;
+    if(status == FAT_PATH_RESOLVE_INVALID_PATH) {
+        return -ENOENT;
     }
-
-    uint16_t date, time;
-    fat32_set_timestamp(&date, &time);
-    file_entry.direntry.mtime_time = time;
-    file_entry.direntry.mtime_date = date;
-
-    int dir_res = fat32_update_file_entry(meta, &file_entry);
-    if(dir_res < 0) {
-        return dir_res;
+    if(status == FAT_PATH_RESOLVE_ERROR) {
+        return -EIO;
     }
-    if(fi != NULL) {
-        meta->file_table[fi->fh] = file_entry;
+    if(status == FAT_PATH_RESOLVE_NOT_FOUND) {
+        return -ENOENT;
     }
 
-    if(size == 0) {
-        return 0;
-    }
+    assert(status == FAT_PATH_RESOLVE_FOUND);
 
-    int write_res = fat32_write_to_offset(meta, first_cluster, offset, size, (uint8_t*) buf);
-    if(write_res < 0) {
-        return write_res;
+    if(HAS_ATTR(file_entry.direntry.attr, FAT_ATTR_DIRECTORY)) {
+        return -EISDIR;
     }
 
-    return size;
+    return fat32_write_file(meta, &file_entry, offset, size, (const uint8_t*) buf);
 }
 
 static int fat32_truncate(struct fs_mount_point* mount_point, const char * path, uint size, struct fs_file_info *fi)
 {
     fat32_meta* meta = (fat32_meta*) mount_point->fs_meta;
     
+    // Work on the file as it is meant to be, with the buffered writes in place
+    int flush_res = fi != NULL ? fat32_flush_file(meta, fi->fh) : fat32_flush_files(meta);
+    if(flush_res < 0) {
+        return flush_res;
+    }
+
     fat32_file_entry file_entry = {0};
     if(fi != NULL) {
         file_entry = meta->file_table[fi->fh];
@@ -1626,12 +2686,16 @@ static int fat32_truncate(struct fs_mount_point* mount_point, const char * path,
     uint first_cluster = file_entry.direntry.cluster_lo + (file_entry.direntry.cluster_hi << 16);
     uint orig_size = file_entry.direntry.size;
 
-    uint cluster_count = first_cluster == 0 ? 0 : count_clusters(meta, first_cluster);
+    uint tail_cluster;
+    int64_t cluster_count = fat32_file_chain_length(meta, &file_entry, &tail_cluster);
+    if(cluster_count < 0) {
+        return cluster_count;
+    }
     uint bytes_per_cluster = meta->bootsector->sectors_per_cluster*meta->bootsector->bytes_per_sector;
     uint allocated_size = bytes_per_cluster * cluster_count;
     if(size > allocated_size) {
         uint clusters_to_allocate = (size - allocated_size - 1) / bytes_per_cluster + 1;
-        uint first_allocated_cluster = fat32_allocate_cluster(meta, fat32_index_cluster_chain(meta, first_cluster, -1), clusters_to_allocate);
+        uint first_allocated_cluster = fat32_allocate_cluster_locked(meta, tail_cluster, clusters_to_allocate);
         if(first_allocated_cluster == 0) {
             return -EIO;
         }
@@ -1641,17 +2705,18 @@ static int fat32_truncate(struct fs_mount_point* mount_point, const char * path,
             file_entry.direntry.cluster_hi = first_allocated_cluster >> 16;
         }
     } else if(allocated_size - size >= bytes_per_cluster){
-        int clusters_to_free = (allocated_size - size) / bytes_per_cluster;
-        uint first_cluster_to_free = fat32_index_cluster_chain(meta, first_cluster, -clusters_to_free);
+        uint clusters_to_free = (allocated_size - size) / bytes_per_cluster;
+        uint first_cluster_to_free = fat32_file_cluster_at(meta, &file_entry, cluster_count - clusters_to_free);
         uint last_remaining_cluster;
         if(first_cluster_to_free == first_cluster) {
             last_remaining_cluster = 0;
             file_entry.direntry.cluster_lo = 0;
             file_entry.direntry.cluster_hi = 0;
         } else {
-            last_remaining_cluster = fat32_index_cluster_chain(meta, first_cluster, -clusters_to_free - 1);
+            last_remaining_cluster = fat32_file_cluster_at(meta, &file_entry, cluster_count - clusters_to_free - 1);
         }
-        int free_res = fat32_free_cluster(meta, last_remaining_cluster, first_cluster_to_free, 0);
+        fat32_invalidate_extent_maps(meta, &file_entry, first_cluster_to_free);
+        int free_res = fat32_free_cluster_locked(meta, last_remaining_cluster, first_cluster_to_free, 0);
         if(free_res < 0) {
             return free_res;
         }
@@ -1688,6 +2753,82 @@ static int fat32_truncate(struct fs_mount_point* mount_point, const char * path,
     return 0;
 }
 
+// Reserve clusters backing [offset, offset + len) of a file without changing its size,
+//   so that a file whose size is known up front gets laid out in as few extents as possible
+// Reserved clusters past the file size are reused by later writes and released by truncate
+static int fat32_fallocate(struct fs_mount_point* mount_point, const char * path, uint offset, uint len, struct fs_file_info *fi)
+{
+    fat32_meta* meta = (fat32_meta*) mount_point->fs_meta;
+
+    if(offset + len < offset) {
+        return -EFBIG;
+    }
+
+    // Work on the file as it is meant to be, with the buffered writes in place
+    int flush_res = fi != NULL ? fat32_flush_file(meta, fi->fh) : fat32_flush_files(meta);
+    if(flush_res < 0) {
+        return flush_res;
+    }
+
+    fat32_file_entry file_entry = {0};
+    if(fi != NULL) {
+        file_entry = meta->file_table[fi->fh];
+        assert(file_entry.dir_entry_count > 0);
+    } else {
+        fat_resolve_path_status status = fat32_resolve_path(meta, path, &file_entry);
+
+        if(status == FAT_PATH_RESOLVE_ROOT_DIR) {
+            return -EISDIR;
+        }
+        if(status == FAT_PATH_RESOLVE_INVALID_PATH) {
+            return -ENOENT;
+        }
+        if(status == FAT_PATH_RESOLVE_ERROR) {
+            return -EIO;
+        }
+        if(status == FAT_PATH_RESOLVE_NOT_FOUND) {
+            return -ENOENT;
+        }
+
+        assert(status == FAT_PATH_RESOLVE_FOUND);
+    }
+
+    if(HAS_ATTR(file_entry.direntry.attr, FAT_ATTR_DIRECTORY)) {
+        return -EISDIR;
+    }
+
+    uint first_cluster = file_entry.direntry.cluster_lo + (file_entry.direntry.cluster_hi << 16);
+    uint tail_cluster;
+    int64_t cluster_count = fat32_file_chain_length(meta, &file_entry, &tail_cluster);
+    if(cluster_count < 0) {
+        return cluster_count;
+    }
+    uint bytes_per_cluster = meta->bootsector->sectors_per_cluster*meta->bootsector->bytes_per_sector;
+    uint allocated_size = bytes_per_cluster * cluster_count;
+    if(offset + len <= allocated_size) {
+        return 0;
+    }
+
+    uint clusters_to_allocate = ((offset + len) - allocated_size - 1) / bytes_per_cluster + 1;
+    uint first_allocated_cluster = fat32_allocate_cluster_locked(meta, tail_cluster, clusters_to_allocate);
+    if(first_allocated_cluster == 0) {
+        return -ENOSPC;
+    }
+    if(first_cluster == 0) {
+        file_entry.direntry.cluster_lo = first_allocated_cluster & 0x0000FFFF;
+        file_entry.direntry.cluster_hi = first_allocated_cluster >> 16;
+        int dir_res = fat32_update_file_entry(meta, &file_entry);
+        if(dir_res < 0) {
+            return dir_res;
+        }
+        if(fi != NULL) {
+            meta->file_table[fi->fh] = file_entry;
+        }
+    }
+
+    return 0;
+}
+
 static int fat32_rename(struct fs_mount_point* mount_point, const char * from, const char * to, uint flags)
 {
     fat32_meta* meta = (fat32_meta*) mount_point->fs_meta;
@@ -1716,9 +2857,8 @@ static int fat32_rename(struct fs_mount_point* mount_point, const char * from, c
 
     assert(from_status == FAT_PATH_RESOLVE_FOUND);
 
-    uint from_file_content_cluster_number = from_file_entry.direntry.cluster_lo + (from_file_entry.direntry.cluster_hi << 16);
-    // Shall not rename file opened
-    if(fat32_is_cluster_opened(meta, from_file_content_cluster_number)) {
+    // Shall not rename file opened, so it has no buffered writes either
+    if(fat32_is_file_opened(meta, &from_file_entry)) {
         return -EBUSY;
     }
 
@@ -1750,6 +2890,17 @@ static int fat32_open(struct fs_mount_point* mount_point, const char * path, str
 
     fat32_file_entry file_entry = {0};
     fat_resolve_path_status status = fat32_resolve_path(meta, path, &file_entry);
+    if(status == FAT_PATH_RESOLVE_FOUND) {
+        // A file opened again shall see what was written through its other handles
+        int flush_res = fat32_flush_opened_file(meta, &file_entry);
+        if(flush_res < 0) {
+            return flush_res;
+        }
+        if(flush_res > 0) {
+            // rewriting the dir entries may have moved them
+            status = fat32_resolve_path(meta, path, &file_entry);
+        }
+    }
 
     if(status == FAT_PATH_RESOLVE_ROOT_DIR) {
         return -EISDIR;
@@ -1800,6 +2951,14 @@ static int fat32_open(struct fs_mount_point* mount_point, const char * path, str
     for(i=0; i<FAT32_N_OPEN_FILE; i++) {
         if(meta->file_table[i].dir_entry_count == 0) {
             meta->file_table[i] = file_entry;
+            if(!HAS_ATTR(file_entry.direntry.attr, FAT_ATTR_DIRECTORY)) {
+                fat32_extent_map* map = malloc(sizeof(*map));
+                memset(map, 0, sizeof(*map));
+                meta->file_table[i].extent_map = map;
+                fat32_write_buffer* wb = malloc(sizeof(*wb));
+                memset(wb, 0, sizeof(*wb));
+                meta->file_table[i].write_buffer = wb;
+            }
             break;
         }
         if(i == FAT32_N_OPEN_FILE-1) {
@@ -1820,10 +2979,72 @@ static int fat32_release(struct fs_mount_point* mount_point, const char * path,
     fat32_meta* meta = (fat32_meta*) mount_point->fs_meta;
 
     assert(meta->file_table[fi->fh].dir_entry_count > 0);
+    // Closing a file writes back its buffered writes, whatever could not be written is lost with the handle
+    int res = fat32_flush_file(meta, fi->fh);
+    fat32_discard_write_buffer(meta, fi->fh);
+
     // Clear file table entry
+    fat32_extent_map* map = meta->file_table[fi->fh].extent_map;
+    if(map != NULL) {
+        free(map->extents);
+        free(map);
+    }
     memset(&meta->file_table[fi->fh], 0, sizeof(fat32_file_entry));
 
-	return 0;
+    // Closing a file is a sync point for the batched FAT updates
+    if(fat32_flush_fat_locked(meta, true) < 0) {
+        return -EIO;
+    }
+    // A file written to is also written from the block cache to the disk, rather than left there until eviction
+    if((HAS_ATTR(fi->flags, O_WRONLY) || HAS_ATTR(fi->flags, O_RDWR)) && block_cache_sync(meta->storage->device_id) < 0) {
+        return -EIO;
+    }
+
+	return res;
+}
+
+// Write back the buffered writes of open file fi, or of all files if fi is NULL
+static int fat32_fsync(struct fs_mount_point* mount_point, const char * path, int datasync, struct fs_file_info *fi)
+{
+    (void) path;
+    (void) datasync;
+
+    fat32_meta* meta = (fat32_meta*) mount_point->fs_meta;
+
+    int res = fi != NULL ? fat32_flush_file(meta, fi->fh) : fat32_flush_files(meta);
+    if(fat32_flush_fat_locked(meta, true) < 0) {
+        return -EIO;
+    }
+    // Then get them out of the block cache onto the disk
+    if(block_cache_sync(meta->storage->device_id) < 0) {
+        return -EIO;
+    }
+    return res;
+}
+
+// Lock open file fi for an operation through its handle
+// A file opened through a single handle only needs its own lock, one shared with other handles locks the whole mount
+// Return: whether the whole mount was locked, to be passed on to fat32_finish_file_op
+static bool fat32_start_file_op(fat32_meta* meta, struct fs_file_info *fi)
+{
+    start_reading(&meta->rw_lk);
+    if(!fat32_is_file_shared(meta, fi->fh)) {
+        acquire_sleep(&meta->file_lk[fi->fh]);
+        return false;
+    }
+    finish_reading(&meta->rw_lk);
+    start_writing(&meta->rw_lk);
+    return true;
+}
+
+static void fat32_finish_file_op(fat32_meta* meta, struct fs_file_info *fi, bool exclusive)
+{
+    if(exclusive) {
+        finish_writing(&meta->rw_lk);
+        return;
+    }
+    release_sleep(&meta->file_lk[fi->fh]);
+    finish_reading(&meta->rw_lk);
 }
 
 static int fat32_release_locked(struct fs_mount_point* mount_point, const char * path, struct fs_file_info *fi)
@@ -1856,9 +3077,28 @@ static int fat32_getattr_locked(struct fs_mount_point* mount_point, const char *
 static int fat32_read_locked(struct fs_mount_point* mount_point, const char * path, char *buf, uint size, uint offset, struct fs_file_info *fi)
 {
     fat32_meta* meta = (fat32_meta*) mount_point->fs_meta;
+    if(fi != NULL) {
+        bool exclusive = fat32_start_file_op(meta, fi);
+        int res = fat32_read(mount_point, path, buf, size, offset, fi);
+        fat32_finish_file_op(meta, fi, exclusive);
+        return res;
+    }
+
     start_reading(&meta->rw_lk);
-    int res = fat32_read(mount_point, path, buf, size, offset, fi);
+    if(!fat32_has_pending_writes(meta)) {
+        int res = fat32_read(mount_point, path, buf, size, offset, fi);
+        finish_reading(&meta->rw_lk);
+        return res;
+    }
     finish_reading(&meta->rw_lk);
+
+    // Buffered writes have to reach the disk before reading
+    start_writing(&meta->rw_lk);
+    int res = fat32_flush_files(meta);
+    if(res >= 0) {
+        res = fat32_read(mount_point, path, buf, size, offset, fi);
+    }
+    finish_writing(&meta->rw_lk);
     return res;
 }
 
@@ -1901,6 +3141,12 @@ static int fat32_rmdir_locked(struct fs_mount_point* mount_point, const char * p
 static int fat32_write_locked(struct fs_mount_point* mount_point, const char * path, const char *buf, uint size, uint offset, struct fs_file_info * fi)
 {
     fat32_meta* meta = (fat32_meta*) mount_point->fs_meta;
+    if(fi != NULL) {
+        bool exclusive = fat32_start_file_op(meta, fi);
+        int res = fat32_write(mount_point, path, buf, size, offset, fi);
+        fat32_finish_file_op(meta, fi, exclusive);
+        return res;
+    }
     start_writing(&meta->rw_lk);
     int res = fat32_write(mount_point, path, buf, size, offset, fi);
     finish_writing(&meta->rw_lk);
@@ -1910,12 +3156,33 @@ static int fat32_write_locked(struct fs_mount_point* mount_point, const char * p
 static int fat32_truncate_locked(struct fs_mount_point* mount_point, const char * path, uint size, struct fs_file_info *fi)
 {
     fat32_meta* meta = (fat32_meta*) mount_point->fs_meta;
+    if(fi != NULL) {
+        bool exclusive = fat32_start_file_op(meta, fi);
+        int res = fat32_truncate(mount_point, path, size, fi);
+        fat32_finish_file_op(meta, fi, exclusive);
+        return res;
+    }
     start_writing(&meta->rw_lk);
     int res = fat32_truncate(mount_point, path, size, fi);
     finish_writing(&meta->rw_lk);
     return res;
 }
 
+static int fat32_fallocate_locked(struct fs_mount_point* mount_point, const char * path, uint offset, uint len, struct fs_file_info *fi)
+{
+    fat32_meta* meta = (fat32_meta*) mount_point->fs_meta;
+    if(fi != NULL) {
+        bool exclusive = fat32_start_file_op(meta, fi);
+        int res = fat32_fallocate(mount_point, path, offset, len, fi);
+        fat32_finish_file_op(meta, fi, exclusive);
+        return res;
+    }
+    start_writing(&meta->rw_lk);
+    int res = fat32_fallocate(mount_point, path, offset, len, fi);
+    finish_writing(&meta->rw_lk);
+    return res;
+}
+
 static int fat32_rename_locked(struct fs_mount_point* mount_point, const char * from, const char * to, uint flags)
 {
     fat32_meta* meta = (fat32_meta*) mount_point->fs_meta;
@@ -1934,6 +3201,21 @@ static int fat32_open_locked(struct fs_mount_point* mount_point, const char * pa
     return res;
 }
 
+static int fat32_fsync_locked(struct fs_mount_point* mount_point, const char * path, int datasync, struct fs_file_info *fi)
+{
+    fat32_meta* meta = (fat32_meta*) mount_point->fs_meta;
+    if(fi != NULL) {
+        bool exclusive = fat32_start_file_op(meta, fi);
+        int res = fat32_fsync(mount_point, path, datasync, fi);
+        fat32_finish_file_op(meta, fi, exclusive);
+        return res;
+    }
+    start_writing(&meta->rw_lk);
+    int res = fat32_fsync(mount_point, path, datasync, fi);
+    finish_writing(&meta->rw_lk);
+    return res;
+}
+
 static int fat32_mount(fs_mount_point* mount_point, void* option)
 {
     fat_mount_option* opt = (fat_mount_option*) option;
@@ -1953,7 +3235,9 @@ static int fat32_mount(fs_mount_point* mount_point, void* option)
         .rename = fat32_rename_locked,
         .rmdir = fat32_rmdir_locked,
         .unlink = fat32_unlink_locked,
-        .truncate = fat32_truncate_locked
+        .truncate = fat32_truncate_locked,
+        .fallocate = fat32_fallocate_locked,
+        .fsync = fat32_fsync_locked
     };
 
     meta->storage = opt->storage;
@@ -1968,10 +3252,143 @@ static int fat32_mount(fs_mount_point* mount_point, void* option)
 
 static int fat32_unmount(fs_mount_point* mount_point)
 {
+    fat32_meta* meta = (fat32_meta*) mount_point->fs_meta;
+    if(fat32_flush_files(meta) < 0) {
+        return -EIO;
+    }
+    if(meta->fat_cache != NULL && fat32_flush_fat_locked(meta, true) < 0) {
+        return -EIO;
+    }
+    fat32_free_fat_cache(meta);
+    free(meta->free_map);
+    free(meta->free_map_loaded);
+    for(uint i = 0; i < FAT32_N_DIR_INDEX; i++) {
+        fat32_free_dir_index(&meta->dir_indexes[i]);
+    }
     free(mount_point->fs_meta);
     return 0;
 }
 
+// Create an empty FAT32 file system spanning the whole storage, without partition table
+// Ref: http://download.microsoft.com/download/1/6/1/161ba512-40e2-4cc9-843a-923143f3456c/fatgen103.doc
+//
+// return: zero = success, -ENOSPC if the storage cannot hold FAT32_MIN_CLUSTERS clusters, otherwise failed
+int fat32_format(block_storage* storage)
+{
+    if(storage->block_size != sizeof(fat32_bootsector)) {
+        return -EINVAL;
+    }
+    uint32_t total_sectors = storage->block_count;
+    uint32_t reserved_sectors = 32;
+    // cluster size by volume size, as in the DskTableFAT32 of fatgen103 (for 512-byte sectors)
+    uint8_t sectors_per_cluster;
+    if(total_sectors <= 532480) {
+        sectors_per_cluster = 1;    // up to 260MiB
+    } else if(total_sectors <= 16777216) {
+        sectors_per_cluster = 8;    // up to 8GiB
+    } else if(total_sectors <= 33554432) {
+        sectors_per_cluster = 16;   // up to 16GiB
+    } else if(total_sectors <= 67108864) {
+        sectors_per_cluster = 32;   // up to 32GiB
+    } else {
+        sectors_per_cluster = 64;
+    }
+    uint32_t entries_per_sector = storage->block_size / sizeof(uint32_t);
+    uint32_t fat_sectors = ((total_sectors - reserved_sectors) / sectors_per_cluster + 2 + entries_per_sector - 1) / entries_per_sector;
+    if(total_sectors <= reserved_sectors + 2*fat_sectors + sectors_per_cluster) {
+        return -ENOSPC;
+    }
+    uint32_t cluster_count = (total_sectors - reserved_sectors - 2*fat_sectors) / sectors_per_cluster;
+    if(cluster_count < FAT32_MIN_CLUSTERS) {
+        // too small to be a FAT32 volume (about 32.5MiB at least)
+        return -ENOSPC;
+    }
+    uint16_t fs_info_sector = 1, backup_sector = 6;
+    uint8_t media_type = 0xF8; // fixed disk
+
+    // one sector buffer reused for every structure written
+    uint8_t* buff = malloc(storage->block_size);
+    int res = -EIO;
+
+    // Boot sector and its backup
+    fat32_bootsector* bs = (fat32_bootsector*) buff;
+    *bs = (fat32_bootsector) {
+        .bootjmp = {0xEB, 0x58, 0x90},
+        .oem_name = {'S', 'I', 'M', 'P', 'L', 'E', 'O', 'S'},
+        .bytes_per_sector = storage->block_size,
+        .sectors_per_cluster = sectors_per_cluster,
+        .reserved_sector_count = reserved_sectors,
+        .table_count = 2,
+        .media_type = media_type,
+        .sectors_per_track = 32,
+        .head_side_count = 64,
+        .total_sectors_32 = total_sectors,
+        .table_sector_size_32 = fat_sectors,
+        .root_cluster = 2,
+        .fs_info_sector = fs_info_sector,
+        .backup_BS_sector = backup_sector,
+        .drive_number = 0x80,
+        .boot_signature = 0x29,
+        .volume_id = storage->device_id,
+        .volume_label = {'N', 'O', ' ', 'N', 'A', 'M', 'E', ' ', ' ', ' ', ' '},
+        .fat_type_label = {'F', 'A', 'T', '3', '2', ' ', ' ', ' '},
+        .mbr_signature = 0xAA55
+    };
+    if(storage->write_blocks(storage, 0, 1, buff) != storage->block_size
+        || storage->write_blocks(storage, backup_sector, 1, buff) != storage->block_size) {
+        goto ret;
+    }
+
+    // FS Info and its backup
+    fat32_fsinfo* fs_info = (fat32_fsinfo*) buff;
+    memset(fs_info, 0, sizeof(*fs_info));
+    fs_info->lead_signature = 0x41615252;
+    fs_info->structure_signature = 0x61417272;
+    fs_info->free_cluster_count = cluster_count - 1; // the root dir takes one
+    fs_info->next_free_cluster = 3;
+    fs_info->trailing_signature = 0xAA550000;
+    if(storage->write_blocks(storage, fs_info_sector, 1, buff) != storage->block_size
+        || storage->write_blocks(storage, backup_sector + fs_info_sector, 1, buff) != storage->block_size) {
+        goto ret;
+    }
+
+    // FATs, entries past the last cluster are marked bad so they are never allocated
+    uint32_t* entries = (uint32_t*) buff;
+    for(uint32_t sector = 0; sector < fat_sectors; sector++) {
+        for(uint32_t i=0; i<entries_per_sector; i++) {
+            uint32_t cluster = sector*entries_per_sector + i;
+            if(cluster == 0) {
+                entries[i] = 0x0FFFFF00 | media_type;
+            } else if(cluster == 1 || cluster == 2) {
+                // End of Cluster Mark, and the root dir
+                entries[i] = 0x0FFFFFFF;
+            } else if(cluster < cluster_count + 2) {
+                entries[i] = 0;
+            } else {
+                entries[i] = 0x0FFFFFF7;
+            }
+        }
+        for(uint32_t fat_idx = 0; fat_idx < 2; fat_idx++) {
+            if(storage->write_blocks(storage, reserved_sectors + fat_idx*fat_sectors + sector, 1, buff) != storage->block_size) {
+                goto ret;
+            }
+        }
+    }
+
+    // Empty root dir
+    memset(buff, 0, storage->block_size);
+    for(uint32_t sector = 0; sector < sectors_per_cluster; sector++) {
+        if(storage->write_blocks(storage, reserved_sectors + 2*fat_sectors + sector, 1, buff) != storage->block_size) {
+            goto ret;
+        }
+    }
+    res = 0;
+
+ret:
+    free(buff);
+    return res;
+}
+
 int fat32_init(struct file_system* fs)
 {
     fs->mount = fat32_mount;
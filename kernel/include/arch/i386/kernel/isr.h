@@ -128,6 +128,7 @@ void isr_install();
 
 typedef void (*interrupt_handler)(trapframe*);
 void register_interrupt_handler(uint8_t n, interrupt_handler handler);
+void register_shared_irq_handler(uint8_t irq_no, interrupt_handler handler);
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,34 @@
+#ifndef _KERNEL_AHCI_H
+#define _KERNEL_AHCI_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Maximum number of SATA drives driven
+#define AHCI_MAX_DRIVES 4
+
+// An asynchronous transfer, see ahci_submit_sectors()
+typedef struct ahci_request {
+    uint32_t drive;
+    bool is_write;
+    void* buf;
+    uint64_t LBA;
+    uint32_t sector_count;
+    void (*done)(struct ahci_request* req, int result); // called from interrupt context
+    void* ctx; // for the caller
+    // internal
+    uint32_t issued; // sectors issued
+    uint32_t slots; // command slots outstanding
+    bool failed;
+    bool flushing; // the drive cache is being flushed after non-queued writes
+} ahci_request;
+
+void init_ahci(uint8_t bus, uint8_t device, uint8_t function);
+uint32_t ahci_drive_count();
+uint64_t ahci_sector_count(uint32_t drive);
+int ahci_read_sectors(uint32_t drive, void* buf, uint64_t LBA, uint32_t sector_count);
+int ahci_write_sectors(uint32_t drive, const void* buf, uint64_t LBA, uint32_t sector_count);
+uint32_t ahci_queue_depth(uint32_t drive);
+int ahci_submit_sectors(ahci_request* req);
+
+#endif
@@ -4,8 +4,36 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-void read_sectors_ATA_PIO(bool slave, void* buf, uint32_t LBA, uint32_t sector_count);
-void write_sectors_ATA_PIO(bool slave, const void* buf, uint32_t LBA, uint32_t sector_count);
-int32_t get_total_28bit_sectors(bool slave);
+// Drives are numbered 0 to 3: primary master/slave, then secondary master/slave
+#define ATA_DRIVE_COUNT 4
+
+// A bus master DMA transfer, see submit_sectors_ATA_DMA()
+typedef struct ATA_DMA_request {
+    uint8_t drive;
+    bool is_write;
+    void* buf;
+    uint32_t LBA;
+    uint32_t sector_count;
+    void (*done)(struct ATA_DMA_request* req, int result); // optional, called from interrupt context
+    void* ctx; // for the caller
+    // internal
+    volatile bool finished;
+    int result;
+    uint32_t progress; // sectors transferred
+    struct ATA_DMA_request* next;
+} ATA_DMA_request;
+
+void read_sectors_ATA_PIO(uint8_t drive, void* buf, uint32_t LBA, uint32_t sector_count);
+void write_sectors_ATA_PIO(uint8_t drive, const void* buf, uint32_t LBA, uint32_t sector_count);
+int32_t get_total_28bit_sectors(uint8_t drive);
+int8_t ATA_Identify(uint8_t drive, uint16_t* target);
+
+void init_ata();
+void init_ata_dma(uint8_t bus, uint8_t device, uint8_t function);
+bool ATA_DMA_supported(uint8_t drive);
+int read_sectors_ATA_DMA(uint8_t drive, void* buf, uint32_t LBA, uint32_t sector_count);
+int write_sectors_ATA_DMA(uint8_t drive, const void* buf, uint32_t LBA, uint32_t sector_count);
+int submit_sectors_ATA_DMA(ATA_DMA_request* req);
+int wait_sectors_ATA_DMA(ATA_DMA_request* req);
 
 #endif
\ No newline at end of file
@@ -2,16 +2,32 @@
 #define _KERNEL_BLOCK_IO_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <assert.h>
 
-// device_id for IDE master/slave drives
+// device_id for the primary IDE master/slave drives, secondary channel drives follow
 #define IDE_MASTER_DRIVE 1
 #define IDE_SLAVE_DRIVE 2
 
+#define MAX_STORAGE_DEV_COUNT 8
+
 typedef enum block_storage_type {
-    BLK_STORAGE_TYP_ATA_HARD_DRIVE
+    BLK_STORAGE_TYP_ATA_HARD_DRIVE,
+    BLK_STORAGE_TYP_AHCI_SATA,
+    BLK_STORAGE_TYP_VIRTIO_BLK,
+    BLK_STORAGE_TYP_NVME,
+    BLK_STORAGE_TYP_RAMDISK
 } block_storage_type;
 
+struct block_request;
+
+// A segment of a scatter-gather transfer
+// buff == NULL skips the bytes: discarded when reading, left as on the device when writing
+typedef struct block_segment {
+    void* buff;
+    uint32_t size; // bytes, need not be a multiple of the block size
+} block_segment;
+
 typedef struct block_storage {
     uint32_t device_id; //id == 0 means unused slot
     block_storage_type type;
@@ -19,10 +35,72 @@ typedef struct block_storage {
     uint32_t block_count; // total number of blocks
     int64_t (*read_blocks)(struct block_storage* storage, void* buff, uint32_t LBA, uint32_t block_count); // return bytes read, 0 means error
     int64_t (*write_blocks)(struct block_storage* storage, uint32_t LBA, uint32_t block_count, const void* buff); // return bytes written,  0 means error
+    // Scatter-gather access, blocks from LBA are transferred from/to the segments in order
+    // The total size of the segments shall be a multiple of the block size
+    int64_t (*read_blocks_vec)(struct block_storage* storage, const block_segment* segs, uint32_t seg_count, uint32_t LBA); // return bytes read, negative on error
+    int64_t (*write_blocks_vec)(struct block_storage* storage, uint32_t LBA, const block_segment* segs, uint32_t seg_count); // return bytes written, negative on error
     void* internal_info; // internal data structure for the specfic storage type
+    // Device driver access, read_blocks/write_blocks above are routed through the buffer cache once the storage is added (except for RAM disks)
+    int64_t (*dev_read_blocks)(struct block_storage* storage, void* buff, uint32_t LBA, uint32_t block_count);
+    int64_t (*dev_write_blocks)(struct block_storage* storage, uint32_t LBA, uint32_t block_count, const void* buff);
+    // Optional asynchronous device driver access: start the transfer and return zero,
+    // then set req->result and call req->callback (from interrupt context) when it finishes
+    // -EAGAIN means the driver is out of resources, the transfer is submitted again once another one finished
+    int (*dev_submit)(struct block_storage* storage, struct block_request* req);
+    uint32_t queue_depth; // transfers dev_submit takes at once, 0 means 1
 } block_storage;
 
+// A request in the per-device queue, buff shall be kernel memory
+// since the request may be dispatched by another process or in interrupt context
+typedef struct block_request {
+    uint32_t LBA;
+    uint32_t block_count;
+    bool is_write;
+    void* buff;
+    // Optional, called when the request finishes, before done is set
+    // May run in interrupt context, so shall not sleep
+    void (*callback)(struct block_request* req);
+    void* private; // for the submitter
+    int64_t result; // bytes transferred, negative on error
+    volatile bool done;
+    // internal
+    uint32_t seq; // queue dispatch sequence when submitted
+    struct block_request* next;
+} block_request;
+
+// Default memory budget of the block buffer cache in bytes
+#define BLOCK_CACHE_DEFAULT_BUDGET (1024*1024)
+
+typedef struct block_cache_stats {
+    uint64_t hits; // blocks read from the cache
+    uint64_t misses; // blocks read from the device
+    uint64_t evictions; // buffers recycled
+    uint64_t writebacks; // dirty buffers written to the device
+    uint64_t readahead_blocks; // blocks prefetched by readahead
+    uint64_t readahead_hits; // prefetched blocks later read
+    uint32_t readahead_window; // window of the most recent sequential stream, in blocks
+} block_cache_stats;
+
 block_storage* get_block_storage(uint32_t device_id);
+uint32_t get_block_storage_slot(block_storage* storage);
+block_storage* get_block_storage_at(uint32_t slot);
+
+int block_io_submit(block_storage* storage, block_request* reqs, uint32_t count);
+int block_io_submit_async(block_storage* storage, block_request* reqs, uint32_t count);
+bool block_io_poll(block_request* req);
+int block_io_wait(block_storage* storage, block_request* reqs, uint32_t count);
+int64_t block_io_read(block_storage* storage, void* buff, uint32_t LBA, uint32_t block_count);
+int64_t block_io_write(block_storage* storage, uint32_t LBA, uint32_t block_count, const void* buff);
+int add_ramdisk_storage(uint32_t block_count);
+
+int64_t block_cache_read_blocks(block_storage* storage, void* buff, uint32_t LBA, uint32_t block_count);
+int64_t block_cache_write_blocks(block_storage* storage, uint32_t LBA, uint32_t block_count, const void* buff);
+int64_t block_cache_read_blocks_vec(block_storage* storage, const block_segment* segs, uint32_t seg_count, uint32_t LBA);
+int64_t block_cache_write_blocks_vec(block_storage* storage, uint32_t LBA, const block_segment* segs, uint32_t seg_count);
+int block_cache_sync(uint32_t device_id);
+void block_cache_set_budget(uint32_t bytes);
+void block_cache_set_readahead(uint32_t max_window);
+void block_cache_get_stats(block_cache_stats* stats);
 
 // Shall use the this signature when implementing in kernel
 void initialize_block_storage();
@@ -0,0 +1,24 @@
+#ifndef _KERNEL_DCACHE_H
+#define _KERNEL_DCACHE_H
+
+#include <stdint.h>
+#include <fsstat.h>
+#include <kernel/file_system.h>
+
+// Entries (path components) kept in the directory entry cache
+#define DCACHE_SIZE 256
+
+// dcache_lookup results, a cached non-existing path gives -ENOENT
+#define DCACHE_MISS 0
+#define DCACHE_HIT 1
+
+uint32_t dcache_generation();
+int dcache_lookup(fs_mount_point* mp, const char* path, fs_stat* st);
+void dcache_add(fs_mount_point* mp, const char* path, const fs_stat* st, uint32_t generation);
+void dcache_forget(fs_mount_point* mp, const char* path);
+void dcache_invalidate(fs_mount_point* mp, const char* path);
+void dcache_forget_dir(fs_mount_point* mp, const char* path);
+void dcache_invalidate_dir(fs_mount_point* mp, const char* path);
+void dcache_purge(fs_mount_point* mp);
+
+#endif
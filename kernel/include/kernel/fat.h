@@ -85,6 +85,32 @@ typedef union {
     fat32_direntry_long long_entry;
 } fat32_direntry_t;
 
+// A run of physically contiguous clusters of a file
+typedef struct fat32_extent {
+	uint32_t logical; // index of the first cluster of the run within the file
+	uint32_t physical; // cluster number of the first cluster of the run
+	uint32_t length; // in clusters
+} fat32_extent;
+
+#define FAT32_EXTENT_MAP_WHOLE_CHAIN 0xFFFFFFFF
+// Extents of an open file sorted by logical index, built lazily from its cluster chain
+typedef struct fat32_extent_map {
+	fat32_extent* extents;
+	uint32_t count;
+	uint32_t capacity;
+	uint32_t first_cluster; // chain the extents were read from
+	uint32_t cluster_count; // clusters covered so far
+} fat32_extent_map;
+
+// Data written through an open file but not yet on disk, kept as one contiguous range
+typedef struct fat32_write_buffer {
+	uint8_t* data; // FAT32_WRITE_BUFFER_SIZE bytes, allocated on first use
+	uint32_t offset; // file offset of data[0]
+	uint32_t size; // bytes buffered
+	uint32_t allocated_size; // bytes backed by the cluster chain when buffering started
+	uint32_t reserved_clusters; // clusters the write back will allocate, held in fat32_meta.write_reserved_clusters
+} fat32_write_buffer;
+
 #define FAT32_MAX_LFN_ENTRY_PER_FILE 0x14
 #define FAT32_LONG_NAME_MAX_LEN_USC2 (FAT32_USC2_FILE_NAME_LEN_PER_LFN * FAT32_MAX_LFN_ENTRY_PER_FILE)
 #define FAT32_FILENAME_SIZE (FAT32_LONG_NAME_MAX_LEN_USC2*2)
@@ -96,6 +122,9 @@ typedef struct fat32_file_entry {
 	uint32_t dir_cluster; // first cluster of the dir
 	uint32_t first_dir_entry_idx; // an index into all clusters constitute the dir
 	uint32_t dir_entry_count;
+	fat32_extent_map* extent_map; // only set for entries in the open file table
+	fat32_write_buffer* write_buffer; // only set for regular files in the open file table
+	bool entry_dirty; // size/mtime in direntry changed but not yet written to the dir entry
 } fat32_file_entry;
 
 
@@ -120,16 +149,96 @@ typedef struct fat32_fsinfo {
     uint32_t trailing_signature;
 } __attribute__ ((__packed__)) fat32_fsinfo;
 
+// A name in a dir index, pointing at the dir entries (LFN entries followed by the short entry) of the file
+typedef struct fat32_dir_index_node {
+	uint32_t hash;
+	uint32_t first_dir_entry_idx;
+	uint32_t dir_entry_count;
+	struct fat32_dir_index_node* next;
+} fat32_dir_index_node;
+
+// Hash index from file names (long and 8.3) to dir entries, built while the dir is scanned
+// Entries before scanned_to are all indexed, the rest of the dir is scanned on demand
+typedef struct fat32_dir_index {
+	uint32_t dir_cluster; // first cluster of the dir, 0 if the slot is unused
+	uint32_t last_used; // for recycling the least recently used index
+	fat32_dir_index_node** buckets;
+	uint32_t bucket_count;
+	uint32_t node_count;
+	uint32_t scanned_to; // dir entry index the scan resumes at
+	bool complete; // scan reached the end of the dir
+	uint32_t* clusters; // clusters[i] is the i-th cluster of the dir, for the leading part of the chain walked so far
+	uint32_t cluster_count;
+	uint32_t cluster_capacity;
+} fat32_dir_index;
+
+// A sector of the main FAT held in memory
+typedef struct fat32_fat_sector {
+	uint32_t sector; // index of the sector within the FAT
+	uint32_t* entries; // NULL if the slot is unused
+	uint32_t last_used; // for recycling the least recently used sector
+	bool dirty; // changed in memory but not yet on disk
+} fat32_fat_sector;
+
 #define FAT32_N_OPEN_FILE 100
+// Directories with a name index kept per mount
+#define FAT32_N_DIR_INDEX 16
+// Directory locks per mount, a dir is guarded by the one picked by its first cluster
+//   together with the FAT32_N_DIR_INDEX / FAT32_N_DIR_LOCK name index slots behind that lock
+#define FAT32_N_DIR_LOCK 8
+// FAT sectors kept in memory, read on demand through the block cache
+#define FAT32_FAT_CACHE_SECTORS 128
+// Dirty FAT sectors buffered in memory before they are written back regardless of sync points
+#define FAT32_FAT_DIRTY_LIMIT 64
+// Bytes of file data buffered per open file before clusters are allocated and the data written
+#define FAT32_WRITE_BUFFER_SIZE (64*1024)
+// Bytes of file data buffered over all open files of a mount, further writes go straight to disk
+#define FAT32_WRITE_BEHIND_LIMIT (512*1024)
 typedef struct fat32_meta {
     fat32_bootsector* bootsector;
     fat32_fsinfo* fs_info;
-    uint32_t* fat;
+	fat32_fat_sector* fat_cache; // FAT32_FAT_CACHE_SECTORS slots
+	uint32_t fat_cache_clock;
+	uint32_t fat_cache_last; // slot of the most recent access
 	block_storage* storage;
 	fat32_file_entry* file_table;
+	uint32_t fat_dirty_count; // dirty sectors in fat_cache
+	bool fat_alloc_pending; // dirty sectors include allocations, flush before writing dir entries
+	bool fs_info_dirty;
+	uint32_t* free_map; // bitmap of free clusters, bit set = free
+	uint8_t* free_map_loaded; // bitmap of FAT sectors whose clusters are reflected in free_map
+	uint32_t free_map_pending; // FAT sectors not yet reflected in free_map
+	uint32_t free_map_free_count; // free clusters in the reflected sectors
+	uint32_t cluster_limit; // one past the last cluster backed by the data area
+	fat32_dir_index dir_indexes[FAT32_N_DIR_INDEX];
+	uint32_t dir_index_clock;
+	uint32_t write_buffered_bytes; // sum of the write buffers of all open files
+	uint32_t write_reserved_clusters; // free clusters promised to buffered writes
+	// Locks, always taken in this order:
+	// rw_lk: the namespace and the open file table. Written by operations on paths,
+	//   read by operations on an open file and by lookups
+	// file_lk: an open file table entry, its extent map and write buffer,
+	//   held by operations on a file opened through a single handle
+	// dir_lk: the entries and name index of a directory
+	// fat_lk: the FAT cache, the free map, FS Info and the write behind counters
 	rw_lock rw_lk;
+	sleep_lock file_lk[FAT32_N_OPEN_FILE];
+	sleep_lock dir_lk[FAT32_N_DIR_LOCK];
+	sleep_lock fat_lk;
 } fat32_meta;
 
+// A FAT entry changed by an in-flight allocation or free, with the value to roll back to
+typedef struct fat32_fat_change {
+	uint32_t cluster;
+	uint32_t old_entry;
+} fat32_fat_change;
+
+typedef struct fat32_fat_txn {
+	fat32_fat_change* changes;
+	uint32_t count;
+	uint32_t capacity;
+} fat32_fat_txn;
+
 typedef struct fat_cluster {
 	uint32_t curr;
 	uint32_t next;
@@ -143,12 +252,14 @@ typedef enum fat_cluster_status {
     FAT_CLUSTER_USED = 0x00000002
 } fat_cluster_status;
 
+// Walks a dir one cluster at a time, only reading the clusters reached
 typedef struct fat_dir_iterator {
 	uint32_t first_cluster;
-	uint32_t dir_entry_count;
 	uint32_t entry_per_cluster;
 	uint32_t current_dir_entry_idx; // an index into all clusters constitute the dir
-	fat32_direntry_t* dir_entries;
+	uint32_t buffered_cluster; // cluster held in dir_entries, 0 if none
+	uint32_t buffered_cluster_idx; // index of buffered_cluster in the dir's cluster chain
+	fat32_direntry_t* dir_entries; // entries of a single cluster
 } fat_dir_iterator;
 
 typedef enum fat_iterate_dir_status {
@@ -174,12 +285,16 @@ enum fat32_rm_type {
     FAT32_RM_ANY
 };
 
+// A volume with fewer clusters is FAT12/16 by definition (fatgen103), fat32_format() refuses to create one
+#define FAT32_MIN_CLUSTERS 65525
+
 typedef struct fat_mount_option {
 	block_storage* storage;
 } fat_mount_option;
 
 
 int fat32_init(struct file_system* fs);
+int fat32_format(block_storage* storage);
 
 // Used by make_fs
 void fat32_set_timestamp(uint16_t* date_entry, uint16_t* time_entry);
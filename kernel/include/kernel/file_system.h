@@ -75,6 +75,10 @@ typedef struct file_system_operations {
 	int (*write) (struct fs_mount_point* mount_point, const char * path, const char *buf, uint size, uint offset, struct fs_file_info *);
 	int (*release) (struct fs_mount_point* mount_point, const char * path, struct fs_file_info *);
 	int (*readdir) (struct fs_mount_point* mount_point, const char * path, uint offset, struct fs_dir_filler_info* filler_info, fs_dir_filler filler);
+	// Reserve space for [offset, offset + len) without changing the file size (FALLOC_FL_KEEP_SIZE)
+	int (*fallocate) (struct fs_mount_point* mount_point, const char * path, uint offset, uint len, struct fs_file_info *);
+	// Write back data buffered for file fi, or for the whole file system if fi is NULL
+	int (*fsync) (struct fs_mount_point* mount_point, const char * path, int datasync, struct fs_file_info *);
 } file_system_operations;
 
 ////////////////////////////////////////
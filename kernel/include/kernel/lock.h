@@ -25,6 +25,15 @@ typedef struct rw_lock {
     uint reading;
 } rw_lock;
 
+// Put the waiting process to sleep when locked, does NOT disable interrupt while holding
+// Suitable for protecting long operations like disk I/O, so the CPU can run other processes
+// Shall NOT be used in any interrupt handler
+typedef struct sleep_lock {
+    yield_lock lk; // protecting this structure
+    uint locked;
+    int holding_pid;
+} sleep_lock;
+
 
 void acquire(yield_lock* lk);
 void release(yield_lock* lk);
@@ -35,4 +44,8 @@ void finish_writing(rw_lock* lk);
 void start_reading(rw_lock* lk);
 void finish_reading(rw_lock* lk);
 
+void acquire_sleep(sleep_lock* lk);
+void release_sleep(sleep_lock* lk);
+uint holding_sleep(sleep_lock* lk);
+
 #endif
\ No newline at end of file
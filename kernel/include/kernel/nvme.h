@@ -0,0 +1,36 @@
+#ifndef _KERNEL_NVME_H
+#define _KERNEL_NVME_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Maximum number of NVMe namespaces driven
+#define NVME_MAX_NAMESPACES 4
+
+// A transfer, see nvme_submit_sectors()
+typedef struct nvme_request {
+    bool is_write;
+    uint8_t* buf;
+    uint64_t LBA;
+    uint32_t sector_count;
+    void (*done)(struct nvme_request* req, int result); // called from interrupt context, NULL if synchronous
+    void* ctx; // for the caller
+    // internal
+    uint32_t nsid;
+    uint8_t* bounce; // for a buffer not dword aligned, NULL otherwise
+    uint32_t issued; // sectors submitted
+    uint32_t pending; // commands outstanding
+    int result;
+    bool flushing; // the write cache is being flushed after the writes
+    struct nvme_request* next; // asynchronous transfers in progress
+} nvme_request;
+
+void init_nvme(uint8_t bus, uint8_t device, uint8_t function);
+uint32_t nvme_namespace_count();
+uint64_t nvme_sector_count(uint32_t ns);
+int nvme_read_sectors(uint32_t ns, void* buf, uint64_t LBA, uint32_t sector_count);
+int nvme_write_sectors(uint32_t ns, const void* buf, uint64_t LBA, uint32_t sector_count);
+uint32_t nvme_queue_depth();
+int nvme_submit_sectors(uint32_t ns, nvme_request* req);
+
+#endif
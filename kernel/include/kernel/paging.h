@@ -30,6 +30,7 @@ pde* alloc_page_dir();
 uint32_t alloc_pages(pde* page_dir, size_t page_count, bool is_kernel, bool is_writeable);
 uint32_t alloc_pages_consecutive_frames(pde* page_dir, size_t page_count, bool is_writeable, uint32_t* physical_addr);
 uint32_t change_page_rw_attr(pde* page_dir, uint32_t page_index, bool is_writeable);
+uint32_t change_page_cache_attr(pde* page_dir, uint32_t page_index, bool is_uncached);
 uint32_t alloc_pages_at(pde* page_dir, uint32_t page_index, size_t page_count, bool is_kernel, bool is_writeable);
 void dealloc_pages(pde* page_dir, uint32_t page_index, size_t page_count);
 
@@ -22,6 +22,8 @@
 struct context;
 // trapframe shall be provided by ISR
 struct trapframe;
+// defined in lock.h
+struct yield_lock;
 
 // Source: xv6/proc.h
 
@@ -54,6 +56,7 @@ typedef struct proc {
   struct handle_map handles[MAX_HANDLE_PER_PROCESS];             // Opened handles for any system resources, e.g. files
   char* cwd;                          // Current working directory
   uint no_schedule;                   // if non zero, will not be scheduled to other process
+  void* sleep_chan;                   // if non-NULL, sleeping on this channel
 } proc;
 
 proc* create_process();
@@ -62,6 +65,8 @@ void scheduler();
 proc* curr_proc();
 // void process_IRQ(uint no_schedule);
 void yield();
+void sleep(void* chan, struct yield_lock* lk);
+void wakeup(void* chan);
 int fork();
 void exit(int exit_code);
 int wait(int* wait_status);
@@ -0,0 +1,17 @@
+#ifndef _KERNEL_RAMDISK_H
+#define _KERNEL_RAMDISK_H
+
+#include <stdint.h>
+
+// Maximum number of RAM disks
+#define RAMDISK_MAX_DISKS 4
+// Size in 512-byte sectors of the RAM disk created at boot and mounted to /tmp (34MiB), 0 to disable
+// It is formatted FAT32, which needs at least FAT32_MIN_CLUSTERS clusters (66600 sectors)
+#define RAMDISK_BOOT_SECTORS 69632
+
+int ramdisk_create(uint32_t sector_count);
+uint32_t ramdisk_sector_count(uint32_t disk);
+int ramdisk_read_sectors(uint32_t disk, void* buf, uint32_t LBA, uint32_t sector_count);
+int ramdisk_write_sectors(uint32_t disk, const void* buf, uint32_t LBA, uint32_t sector_count);
+
+#endif
@@ -4,5 +4,7 @@
 #include <stdint.h>
 
 void init_timer(uint32_t freq, uint32_t tick_between_process_switch);
+uint64_t timer_ticks();
+uint32_t timer_frequency();
 
 #endif
\ No newline at end of file
@@ -22,6 +22,7 @@ int fs_rmdir(const char * path);
 int fs_link(const char* old_path, const char* new_path);
 int fs_unlink(const char * path);
 int fs_truncate(const char * path, uint size, int file_idx);
+int fs_fallocate(const char * path, uint offset, uint len, int file_idx);
 int fs_rename(const char * from, const char* to, uint flags);
 int fs_readdir(const char * path, uint entry_offset, fs_dirent* buf, uint buf_size);
 int fs_open(const char * path, int flags);
@@ -31,6 +32,7 @@ int fs_seek(int file_idx, int offset, int whence);
 int fs_tell(int file_idx);
 int fs_write(int file_idx, void *buf, uint size);
 int fs_dupfile(int file_idx);
+int fs_sync();
 
 int init_vfs();
 
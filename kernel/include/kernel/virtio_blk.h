@@ -0,0 +1,35 @@
+#ifndef _KERNEL_VIRTIO_BLK_H
+#define _KERNEL_VIRTIO_BLK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Maximum number of virtio block devices driven
+#define VIRTIO_BLK_MAX_DRIVES 4
+
+// A transfer, see virtio_blk_submit_sectors()
+typedef struct virtio_blk_request {
+    bool is_write;
+    uint8_t* buf;
+    uint64_t LBA;
+    uint32_t sector_count;
+    void (*done)(struct virtio_blk_request* req, int result); // called from interrupt context, NULL if synchronous
+    void* ctx; // for the caller
+    // internal
+    uint32_t issued; // sectors added to the virtqueue
+    uint32_t pending; // virtqueue requests outstanding
+    int result;
+    bool flushing; // the write cache is being flushed after the writes
+    struct virtio_blk_request* next; // asynchronous transfers of the drive in progress
+} virtio_blk_request;
+
+void init_virtio_blk(uint8_t bus, uint8_t device, uint8_t function);
+uint32_t virtio_blk_drive_count();
+uint64_t virtio_blk_sector_count(uint32_t drive);
+bool virtio_blk_read_only(uint32_t drive);
+int virtio_blk_read_sectors(uint32_t drive, void* buf, uint64_t LBA, uint32_t sector_count);
+int virtio_blk_write_sectors(uint32_t drive, const void* buf, uint64_t LBA, uint32_t sector_count);
+uint32_t virtio_blk_queue_depth(uint32_t drive);
+int virtio_blk_submit_sectors(uint32_t drive, virtio_blk_request* req);
+
+#endif
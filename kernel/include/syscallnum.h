@@ -45,6 +45,8 @@
 
 #define SYS_CURR_TIME_EPOCH 70
 #define SYS_GET_FILE_OFFSET 80
+#define SYS_SYNC 81
+#define SYS_FALLOCATE_FD 82
 
 #define SYS_BRK 90
 
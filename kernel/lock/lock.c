@@ -105,4 +105,40 @@ void finish_reading(rw_lock* lk)
     release(&lk->lk);
 }
 
+// Ref: xv6/sleeplock.c
+void acquire_sleep(sleep_lock* lk)
+{
+    acquire(&lk->lk);
+    proc* p = curr_proc();
+    int pid = p?p->pid:0;
+    while(lk->locked) {
+        if(lk->holding_pid == pid) {
+            PANIC("Sleep Lock Dead Lock");
+        }
+        // No process to put to sleep during kernel initialization, but nobody else can hold the lock either
+        PANIC_ASSERT(p != NULL);
+        sleep(lk, &lk->lk);
+    }
+    lk->locked = 1;
+    lk->holding_pid = pid;
+    release(&lk->lk);
+}
 
+void release_sleep(sleep_lock* lk)
+{
+    acquire(&lk->lk);
+    PANIC_ASSERT(lk->locked);
+    lk->locked = 0;
+    lk->holding_pid = 0;
+    wakeup(lk);
+    release(&lk->lk);
+}
+
+uint holding_sleep(sleep_lock* lk)
+{
+    acquire(&lk->lk);
+    proc* p = curr_proc();
+    uint r = lk->locked && lk->holding_pid == (p?p->pid:0);
+    release(&lk->lk);
+    return r;
+}
@@ -177,16 +177,19 @@ static int tar_read(struct fs_mount_point* mp, const char * path, char *buf, uin
         size = filesize - offset;
     }
 
-    int size_in_sector = ((size + (TAR_SECTOR_SIZE-1)) / TAR_SECTOR_SIZE) + 1; // plus one for the meta sector
+    // read straight into buf, skipping the rest of the first and last sectors
+    uint in_block_offset = offset % TAR_SECTOR_SIZE;
+    uint size_in_sector = (in_block_offset + size + (TAR_SECTOR_SIZE-1)) / TAR_SECTOR_SIZE;
     int LBA = content_LBA + offset / TAR_SECTOR_SIZE;
-    char* full_buf = malloc(size_in_sector*TAR_SECTOR_SIZE);
-    memset(full_buf, 0, size_in_sector*TAR_SECTOR_SIZE);
-    int res = opt->storage->read_blocks(opt->storage, full_buf, LBA, size_in_sector);
+    block_segment segs[3] = {
+        {.buff = NULL, .size = in_block_offset},
+        {.buff = buf, .size = size},
+        {.buff = NULL, .size = size_in_sector*TAR_SECTOR_SIZE - in_block_offset - size}
+    };
+    int64_t res = opt->storage->read_blocks_vec(opt->storage, segs, 3, LBA);
     if(res != size_in_sector*TAR_SECTOR_SIZE) {
         return -1;
     }
-    int in_block_offset = offset % TAR_SECTOR_SIZE;
-    memmove(buf, full_buf + in_block_offset, size);
 
     return size;
 }
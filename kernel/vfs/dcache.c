@@ -0,0 +1,394 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <kernel/errno.h>
+#include <kernel/lock.h>
+#include <kernel/dcache.h>
+#include <fs.h>
+
+// Directory entry cache for path lookups
+//
+// Each cached path component is an entry looked up by (mount point, parent entry, name)
+// through a hash table. An entry either holds the attributes of an existing file (positive),
+// records that nothing exists under that name (negative), or only serves as the parent of
+// deeper entries (unknown). Entries are recycled least recently used first, leaves only,
+// so a parent always outlives its children.
+//
+// The cache only works for file systems changed solely through the VFS, which invalidates
+// the paths it modifies. A lookup answered by the file system is only added if nothing was
+// invalidated meanwhile, as told by the generation counter.
+// Paths with "." or ".." components are never cached, as they alias other paths.
+// Where several names in a directory refer to the same file (FAT: case-insensitive names
+// and 8.3 aliases), the VFS invalidates the whole directory instead, see dcache_invalidate_dir().
+
+#define DCACHE_HASH_SIZE 128
+
+enum dentry_state {
+    DENTRY_UNKNOWN,
+    DENTRY_POSITIVE,
+    DENTRY_NEGATIVE
+};
+
+typedef struct dentry {
+    uint32_t mount_point_id;
+    struct dentry* parent; // NULL for the root of the mount point
+    char* name;
+    enum dentry_state state;
+    fs_stat st; // valid if positive
+    uint32_t child_count;
+    struct dentry* hash_next;
+    struct dentry* lru_prev; // more recently used
+    struct dentry* lru_next; // less recently used
+} dentry;
+
+static struct {
+    yield_lock lk;
+    dentry* hash[DCACHE_HASH_SIZE];
+    dentry* lru_head; // most recently used
+    dentry* lru_tail; // least recently used
+    uint32_t count;
+    uint32_t generation; // bumped on every invalidation
+} dcache;
+
+static inline uint32_t hash_idx(uint32_t mount_point_id, const dentry* parent, const char* name)
+{
+    uint32_t h = mount_point_id * 2654435761u ^ (uint32_t) parent;
+    while(*name) {
+        h = h * 31 + (uint8_t) *name++;
+    }
+    return h % DCACHE_HASH_SIZE;
+}
+
+static dentry* lookup(uint32_t mount_point_id, const dentry* parent, const char* name)
+{
+    dentry* d = dcache.hash[hash_idx(mount_point_id, parent, name)];
+    while(d != NULL) {
+        if(d->mount_point_id == mount_point_id && d->parent == parent && strcmp(d->name, name) == 0) {
+            return d;
+        }
+        d = d->hash_next;
+    }
+    return NULL;
+}
+
+static void lru_remove(dentry* d)
+{
+    if(d->lru_prev != NULL) {
+        d->lru_prev->lru_next = d->lru_next;
+    } else {
+        dcache.lru_head = d->lru_next;
+    }
+    if(d->lru_next != NULL) {
+        d->lru_next->lru_prev = d->lru_prev;
+    } else {
+        dcache.lru_tail = d->lru_prev;
+    }
+    d->lru_prev = NULL;
+    d->lru_next = NULL;
+}
+
+static void lru_push_front(dentry* d)
+{
+    d->lru_prev = NULL;
+    d->lru_next = dcache.lru_head;
+    if(dcache.lru_head != NULL) {
+        dcache.lru_head->lru_prev = d;
+    } else {
+        dcache.lru_tail = d;
+    }
+    dcache.lru_head = d;
+}
+
+static void touch(dentry* d)
+{
+    if(dcache.lru_head != d) {
+        lru_remove(d);
+        lru_push_front(d);
+    }
+}
+
+// Remove an entry without children
+static void dentry_remove(dentry* d)
+{
+    dentry** pp = &dcache.hash[hash_idx(d->mount_point_id, d->parent, d->name)];
+    while(*pp != d) {
+        pp = &(*pp)->hash_next;
+    }
+    *pp = d->hash_next;
+    lru_remove(d);
+    if(d->parent != NULL) {
+        d->parent->child_count--;
+    }
+    dcache.count--;
+    free(d->name);
+    free(d);
+}
+
+static bool is_descendant(const dentry* d, const dentry* ancestor)
+{
+    for(d = d->parent; d != NULL; d = d->parent) {
+        if(d == ancestor) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void remove_children(dentry* d)
+{
+    while(d->child_count > 0) {
+        dentry* e = dcache.lru_head;
+        while(e != NULL) {
+            dentry* next = e->lru_next;
+            if(e->child_count == 0 && is_descendant(e, d)) {
+                dentry_remove(e);
+            }
+            e = next;
+        }
+    }
+}
+
+// Add an unknown entry under parent, recycling the least recently used leaf when full
+//
+// return: NULL if no room can be made
+static dentry* insert(uint32_t mount_point_id, dentry* parent, const char* name)
+{
+    if(dcache.count >= DCACHE_SIZE) {
+        dentry* victim = dcache.lru_tail;
+        while(victim != NULL && (victim->child_count > 0 || victim == parent)) {
+            victim = victim->lru_prev;
+        }
+        if(victim == NULL) {
+            return NULL;
+        }
+        dentry_remove(victim);
+    }
+    dentry* d = malloc(sizeof(dentry));
+    *d = (dentry) {
+        .mount_point_id = mount_point_id,
+        .parent = parent,
+        .name = strdup(name),
+        .state = DENTRY_UNKNOWN
+    };
+    uint32_t idx = hash_idx(mount_point_id, parent, name);
+    d->hash_next = dcache.hash[idx];
+    dcache.hash[idx] = d;
+    lru_push_front(d);
+    if(parent != NULL) {
+        parent->child_count++;
+    }
+    dcache.count++;
+    return d;
+}
+
+// Follow path (relative to the mount point root) component by component
+// create: add missing components as unknown entries
+// clear_negative: components on the way known not to exist become unknown
+// *negative: set if a component on the way is known not to exist
+//
+// return: entry of the last component, NULL if it is not cached or the path cannot be cached
+static dentry* walk(uint32_t mount_point_id, const char* path, bool create, bool clear_negative, bool* negative)
+{
+    char name[FS_MAX_FILENAME_LEN + 1];
+    *negative = false;
+
+    dentry* d = lookup(mount_point_id, NULL, "");
+    if(d == NULL) {
+        if(!create) {
+            return NULL;
+        }
+        d = insert(mount_point_id, NULL, "");
+        if(d == NULL) {
+            return NULL;
+        }
+    }
+    touch(d);
+
+    const char* p = path;
+    while(true) {
+        while(*p == '/') {
+            p++;
+        }
+        if(*p == 0) {
+            return d;
+        }
+        if(d->state == DENTRY_NEGATIVE) {
+            if(clear_negative) {
+                d->state = DENTRY_UNKNOWN;
+            } else {
+                *negative = true;
+            }
+        }
+        uint32_t len = 0;
+        while(p[len] != 0 && p[len] != '/') {
+            len++;
+        }
+        if(len > FS_MAX_FILENAME_LEN || (len == 1 && p[0] == '.') || (len == 2 && p[0] == '.' && p[1] == '.')) {
+            return NULL;
+        }
+        memmove(name, p, len);
+        name[len] = 0;
+        p += len;
+
+        dentry* child = lookup(mount_point_id, d, name);
+        if(child == NULL) {
+            if(!create) {
+                return NULL;
+            }
+            child = insert(mount_point_id, d, name);
+            if(child == NULL) {
+                return NULL;
+            }
+        }
+        touch(child);
+        d = child;
+    }
+}
+
+uint32_t dcache_generation()
+{
+    return dcache.generation;
+}
+
+// Look up the attributes of path in mount point mp
+//
+// return: DCACHE_HIT with *st filled, -ENOENT if known not to exist, otherwise DCACHE_MISS
+int dcache_lookup(fs_mount_point* mp, const char* path, fs_stat* st)
+{
+    acquire(&dcache.lk);
+    bool negative;
+    dentry* d = walk(mp->id, path, false, false, &negative);
+    int res = DCACHE_MISS;
+    if(negative || (d != NULL && d->state == DENTRY_NEGATIVE)) {
+        res = -ENOENT;
+    } else if(d != NULL && d->state == DENTRY_POSITIVE) {
+        *st = d->st;
+        res = DCACHE_HIT;
+    }
+    release(&dcache.lk);
+    return res;
+}
+
+// Record the attributes of path, or that it does not exist if st is NULL
+// generation: dcache_generation() taken before asking the file system
+void dcache_add(fs_mount_point* mp, const char* path, const fs_stat* st, uint32_t generation)
+{
+    acquire(&dcache.lk);
+    if(generation == dcache.generation) {
+        bool negative;
+        dentry* d = walk(mp->id, path, true, false, &negative);
+        if(d != NULL && !negative) {
+            if(st != NULL) {
+                d->state = DENTRY_POSITIVE;
+                d->st = *st;
+            } else {
+                // anything cached below is gone as well
+                remove_children(d);
+                d->state = DENTRY_NEGATIVE;
+            }
+        }
+    }
+    release(&dcache.lk);
+}
+
+// Entry of the directory holding path, NULL if it is not cached
+static dentry* walk_parent(uint32_t mount_point_id, const char* path, bool clear_negative)
+{
+    uint32_t parent_len = strlen(path);
+    while(parent_len > 0 && path[parent_len - 1] == '/') {
+        parent_len--;
+    }
+    while(parent_len > 0 && path[parent_len - 1] != '/') {
+        parent_len--;
+    }
+    char* parent_path = malloc(parent_len + 1);
+    memmove(parent_path, path, parent_len);
+    parent_path[parent_len] = 0;
+    bool negative;
+    dentry* d = walk(mount_point_id, parent_path, false, clear_negative, &negative);
+    free(parent_path);
+    return d;
+}
+
+// Drop the cached attributes of path, which changed but still names the same file
+void dcache_forget(fs_mount_point* mp, const char* path)
+{
+    acquire(&dcache.lk);
+    dcache.generation++;
+    bool negative;
+    dentry* d = walk(mp->id, path, false, false, &negative);
+    if(d != NULL && d->state == DENTRY_POSITIVE) {
+        d->state = DENTRY_UNKNOWN;
+    }
+    release(&dcache.lk);
+}
+
+// Drop everything cached about path and below, after it was created, removed or renamed
+// The attributes of its parent directory are dropped too
+void dcache_invalidate(fs_mount_point* mp, const char* path)
+{
+    acquire(&dcache.lk);
+    dcache.generation++;
+    bool negative;
+    dentry* d = walk(mp->id, path, false, true, &negative);
+    if(d != NULL) {
+        remove_children(d);
+        if(d->parent != NULL) {
+            dentry_remove(d);
+        } else {
+            d->state = DENTRY_UNKNOWN;
+        }
+    }
+    // the parent may be cached even if path is not
+    d = walk_parent(mp->id, path, true);
+    if(d != NULL && d->state == DENTRY_POSITIVE) {
+        d->state = DENTRY_UNKNOWN;
+    }
+    release(&dcache.lk);
+}
+
+// Like dcache_forget(), for every name in the directory of path, as any of them may name the same file
+void dcache_forget_dir(fs_mount_point* mp, const char* path)
+{
+    acquire(&dcache.lk);
+    dcache.generation++;
+    dentry* parent = walk_parent(mp->id, path, false);
+    if(parent != NULL) {
+        for(dentry* e = dcache.lru_head; e != NULL; e = e->lru_next) {
+            if(e->parent == parent && e->state == DENTRY_POSITIVE) {
+                e->state = DENTRY_UNKNOWN;
+            }
+        }
+    }
+    release(&dcache.lk);
+}
+
+// Like dcache_invalidate(), for everything cached in the directory of path,
+// as the change may affect other names of the same file or names it collides with
+void dcache_invalidate_dir(fs_mount_point* mp, const char* path)
+{
+    acquire(&dcache.lk);
+    dcache.generation++;
+    dentry* parent = walk_parent(mp->id, path, true);
+    if(parent != NULL) {
+        remove_children(parent);
+        // known to exist now, attributes changed
+        parent->state = DENTRY_UNKNOWN;
+    }
+    release(&dcache.lk);
+}
+
+// Drop all entries of a mount point
+void dcache_purge(fs_mount_point* mp)
+{
+    acquire(&dcache.lk);
+    dcache.generation++;
+    dentry* root = lookup(mp->id, NULL, "");
+    if(root != NULL) {
+        remove_children(root);
+        dentry_remove(root);
+    }
+    release(&dcache.lk);
+}
@@ -11,10 +11,12 @@
 #include <kernel/vfs.h>
 #include <kernel/fat.h>
 #include <kernel/tar.h>
+#include <kernel/ramdisk.h>
 #include <kernel/process.h>
 #include <kernel/console.h>
 #include <kernel/pipe.h>
 #include <kernel/lock.h>
+#include <kernel/dcache.h>
 
 static const char* root_path = "/";
 
@@ -26,6 +28,32 @@ static struct {
     yield_lock lk;
 } vfs;
 
+// Whether path lookups of the mount point can be cached,
+// i.e. the file system only changes through the VFS
+static inline bool dcache_enabled(fs_mount_point* mp)
+{
+    return mp->fs->type == FILE_SYSTEM_FAT_32 || mp->fs->type == FILE_SYSTEM_US_TAR;
+}
+
+// FAT names are case-insensitive and files also go by their 8.3 alias,
+// so changing one name may change what other cached names of the directory refer to
+static void dcache_invalidate_path(fs_mount_point* mp, const char* path)
+{
+    if(mp->fs->type == FILE_SYSTEM_FAT_32) {
+        dcache_invalidate_dir(mp, path);
+    } else {
+        dcache_invalidate(mp, path);
+    }
+}
+
+static void dcache_forget_path(fs_mount_point* mp, const char* path)
+{
+    if(mp->fs->type == FILE_SYSTEM_FAT_32) {
+        dcache_forget_dir(mp, path);
+    } else {
+        dcache_forget(mp, path);
+    }
+}
 
 //////////////////////////////////////
 
@@ -167,7 +195,12 @@ int fs_unmount(const char* mount_root)
     if(res < 0) {
         return res;
     }
+    res = block_cache_sync(0);
+    if(res < 0) {
+        return res;
+    }
     //TODO: lock mount point for unmount
+    dcache_purge(mp);
     memset(mp, 0, sizeof(*mp));
     return 0;
 }
@@ -185,6 +218,9 @@ int fs_mknod(const char * path, uint mode)
     }
 
     int res = mp->operations.mknod(mp, remaining_path, mode);
+    if(res >= 0 && dcache_enabled(mp)) {
+        dcache_invalidate_path(mp, remaining_path);
+    }
     
     return res;
 }
@@ -202,6 +238,9 @@ int fs_mkdir(const char * path, uint mode)
     }
 
     int res = mp->operations.mkdir(mp, remaining_path, mode);
+    if(res >= 0 && dcache_enabled(mp)) {
+        dcache_invalidate_path(mp, remaining_path);
+    }
     
     return res;
 }
@@ -218,7 +257,15 @@ int fs_rmdir(const char * path)
         return -EPERM;
     }
 
+    if(dcache_enabled(mp) && dcache_lookup(mp, remaining_path, &(fs_stat) {0}) == -ENOENT) {
+        return -ENOENT;
+    }
+
     int res = mp->operations.rmdir(mp, remaining_path);
+    if(res >= 0 && dcache_enabled(mp)) {
+        dcache_invalidate_path(mp, remaining_path);
+        dcache_add(mp, remaining_path, NULL, dcache_generation());
+    }
     
     return res;
 }
@@ -235,7 +282,15 @@ int fs_unlink(const char * path)
         return -EPERM;
     }
 
+    if(dcache_enabled(mp) && dcache_lookup(mp, remaining_path, &(fs_stat) {0}) == -ENOENT) {
+        return -ENOENT;
+    }
+
     int res = mp->operations.unlink(mp, remaining_path);
+    if(res >= 0 && dcache_enabled(mp)) {
+        dcache_invalidate_path(mp, remaining_path);
+        dcache_add(mp, remaining_path, NULL, dcache_generation());
+    }
     
     return res;
 }
@@ -263,6 +318,9 @@ int fs_link(const char* old_path, const char* new_path)
     }
 
     int res = mp_old->operations.link(mp_old, remaining_path_old, remaining_path_new);
+    if(res >= 0 && dcache_enabled(mp_old)) {
+        dcache_invalidate_path(mp_old, remaining_path_new);
+    }
     
     return res;
 }
@@ -290,6 +348,10 @@ int fs_rename(const char * from, const char* to, uint flags)
     }
 
     int res = mp_from->operations.rename(mp_from, remaining_path_from, remaining_path_to, flags);
+    if(res >= 0 && dcache_enabled(mp_from)) {
+        dcache_invalidate_path(mp_from, remaining_path_from);
+        dcache_invalidate_path(mp_from, remaining_path_to);
+    }
     
     return res;
 }
@@ -301,6 +363,9 @@ int fs_open(const char * path, int flags)
     if(mp == NULL) {
         return -ENXIO;
     }
+    if(!(flags & O_CREAT) && dcache_enabled(mp) && dcache_lookup(mp, remaining_path, &(fs_stat) {0}) == -ENOENT) {
+        return -ENOENT;
+    }
 
     int ret = -EPERM;
     acquire(&vfs.lk);
@@ -328,6 +393,13 @@ int fs_open(const char * path, int flags)
             ret = res;
             goto end;
         }
+        if(dcache_enabled(mp)) {
+            if(flags & O_CREAT) {
+                dcache_invalidate_path(mp, remaining_path);
+            } else if(flags & O_TRUNC) {
+                dcache_forget_path(mp, remaining_path);
+            }
+        }
     } else if (mp->operations.getattr != NULL) {
         fs_stat st;
         int res = mp->operations.getattr(mp, remaining_path, &st, &fi);
@@ -431,6 +503,21 @@ int fs_getattr(const char * path, struct fs_stat * stat, int file_idx)
     }
 
     if(mp->operations.getattr == NULL) return -EPERM;
+    if(pfi == NULL && dcache_enabled(mp)) {
+        // lookup by path, the cache might know the answer
+        int res = dcache_lookup(mp, remaining_path, stat);
+        if(res != DCACHE_MISS) {
+            return res == DCACHE_HIT ? 0 : res;
+        }
+        uint32_t generation = dcache_generation();
+        res = mp->operations.getattr(mp, remaining_path, stat, pfi);
+        if(res >= 0) {
+            dcache_add(mp, remaining_path, stat, generation);
+        } else if(res == -ENOENT) {
+            dcache_add(mp, remaining_path, NULL, generation);
+        }
+        return res;
+    }
     int res = mp->operations.getattr(mp, remaining_path, stat, pfi);
     
     return res;
@@ -455,10 +542,59 @@ int fs_truncate(const char * path, uint size, int file_idx)
 
     if(mp->operations.truncate == NULL) return -EPERM;
     int res = mp->operations.truncate(mp, remaining_path, size, pfi);
+    if(res >= 0 && dcache_enabled(mp)) {
+        dcache_forget_path(mp, remaining_path);
+    }
     
     return res;
 }
 
+int fs_fallocate(const char * path, uint offset, uint len, int file_idx)
+{
+    const char* remaining_path;
+    fs_mount_point* mp;
+    struct fs_file_info fi;
+    struct fs_file_info* pfi = NULL;
+    file* opened_file = idx2file(file_idx);
+    if(opened_file) {
+        remaining_path = opened_file->path;
+        mp = opened_file->mount_point;
+        fi = (fs_file_info) {.flags = opened_file->open_flags, .fh=opened_file->inum};
+        pfi = &fi;
+    } else {
+        mp = find_mount_point(path, &remaining_path);
+        if(mp == NULL) return -ENXIO;
+    }
+
+    if(mp->operations.fallocate == NULL) return -EPERM;
+    int res = mp->operations.fallocate(mp, remaining_path, offset, len, pfi);
+    if(res >= 0 && dcache_enabled(mp)) {
+        dcache_forget_path(mp, remaining_path);
+    }
+    
+    return res;
+}
+
+// Write back the data buffered by file systems, then the block cache
+int fs_sync()
+{
+    int res = 0;
+    acquire(&vfs.lk);
+    for(int i=0;i<N_MOUNT_POINT;i++) {
+        fs_mount_point* mp = &vfs.mount_points[i];
+        if(mp->mount_target != NULL && mp->operations.fsync != NULL) {
+            int fsync_res = mp->operations.fsync(mp, root_path, 0, NULL);
+            if(fsync_res < 0 && res == 0) {
+                res = fsync_res;
+            }
+        }
+    }
+    release(&vfs.lk);
+
+    int sync_res = block_cache_sync(0);
+    return res < 0 ? res : sync_res;
+}
+
 int fs_dupfile(int file_idx)
 {
     acquire(&vfs.lk);
@@ -546,6 +682,9 @@ int fs_write(int file_idx, void *buf, uint size)
     if(res < 0) {
         return res;
     }
+    if(dcache_enabled(f->mount_point)) {
+        dcache_forget_path(f->mount_point, f->path);
+    }
     f->offset += res;
     
     return res;
@@ -623,13 +762,26 @@ int init_vfs()
 
 	// mount hdb (IDE slave drive) to be the home dir (assumed to be FAT-32 formated)
 	storage = get_block_storage(IDE_SLAVE_DRIVE);
-	if(storage != NULL) {
+	if(storage != NULL && storage->type == BLK_STORAGE_TYP_ATA_HARD_DRIVE) {
         fat_mount_option fat_opt = (fat_mount_option) {.storage = storage};
 		// the existence of /home is guaranteed by the install-reserved-path target of kernel Makefile 
         mount_res = fs_mount("/home", FILE_SYSTEM_FAT_32, mount_option, &fat_opt, &mp);
 		assert(mount_res == 0);
 	}
 
+    // mount a RAM disk to be /tmp, formatted FAT-32 on every boot
+    // the existence of /tmp is guaranteed by the install-reserved-path target of kernel Makefile 
+    if(RAMDISK_BOOT_SECTORS > 0) {
+        int ramdisk_id = add_ramdisk_storage(RAMDISK_BOOT_SECTORS);
+        assert(ramdisk_id > 0);
+        storage = get_block_storage(ramdisk_id);
+        res = fat32_format(storage);
+        assert(res == 0);
+        fat_mount_option fat_opt = (fat_mount_option) {.storage = storage};
+        mount_res = fs_mount("/tmp", FILE_SYSTEM_FAT_32, mount_option, &fat_opt, &mp);
+        assert(mount_res == 0);
+    }
+
     // mount console
     // the existence of /console is guaranteed by the install-reserved-path target of kernel Makefile 
     mount_option = (fs_mount_option) {.mode = S_IFREG | S_IRWXU | S_IRWXG | S_IRWXO};
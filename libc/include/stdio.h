@@ -28,6 +28,7 @@ size_t fwrite(const void * ptr, size_t size, size_t nitems,
 int fseek(FILE *stream, long offset, int whence);
 long ftell(FILE *stream);
 ssize_t write(int fildes, const void *buf, size_t nbyte);
+void sync();
 
 #ifdef __cplusplus
 }
@@ -11,6 +11,7 @@ static inline _syscall2(SYS_OPEN, int, sys_open, const char*, path, int, flags)
 static inline _syscall1(SYS_CLOSE, int, sys_close, int, fd)
 static inline _syscall3(SYS_SEEK, int, sys_seek, int, fd, int, offset, int, whence)
 static inline _syscall1(SYS_GET_FILE_OFFSET, int, sys_get_file_offset, int, fd)
+static inline _syscall0(SYS_SYNC, int, sys_sync)
 
 FILE* fopen(const char *pathname, const char *mode)
 {
@@ -59,3 +60,9 @@ ssize_t write(int fildes, const void *buf, size_t nbyte)
     // }
     return sys_write(fildes, buf, nbyte);
 }
+
+// Write all buffered file system data to the disks
+void sync()
+{
+    sys_sync();
+}
@@ -15,6 +15,36 @@ else
   HDB=""
 fi
 
+# Optional drives on the secondary IDE channel
+SECONDARY_IDE_ARG=""
+if [ -f hdc.img ]; then
+  SECONDARY_IDE_ARG="${SECONDARY_IDE_ARG} -drive file=hdc.img,format=raw,index=2,media=disk"
+fi
+if [ -f hdd.img ]; then
+  SECONDARY_IDE_ARG="${SECONDARY_IDE_ARG} -drive file=hdd.img,format=raw,index=3,media=disk"
+fi
+
+# Optional SATA drive on an ICH9 AHCI controller
+if [ -f sata.img ]; then
+  AHCI_ARG="-device ich9-ahci,id=ahci -drive id=sata0,file=sata.img,format=raw,if=none -device ide-hd,drive=sata0,bus=ahci.0"
+else
+  AHCI_ARG=""
+fi
+
+# Optional virtio block device
+if [ -f virtio.img ]; then
+  VIRTIO_ARG="-drive file=virtio.img,format=raw,if=virtio"
+else
+  VIRTIO_ARG=""
+fi
+
+# Optional NVMe drive
+if [ -f nvme.img ]; then
+  NVME_ARG="-drive file=nvme.img,format=raw,if=none,id=nvm0 -device nvme,serial=simpleos0,drive=nvm0"
+else
+  NVME_ARG=""
+fi
+
 # To use user mode network:
 NET_ARG="-nic user,model=rtl8139,mac=52:54:98:76:54:32"
 # To use tap network (see setup_tap.sh and cleanup_tap.sh):
@@ -22,8 +52,8 @@ NET_ARG="-nic user,model=rtl8139,mac=52:54:98:76:54:32"
 
 if grep -q Microsoft /proc/version; then
   echo "Windows Subsystem for Linux"
-  qemu-system-$(./target-triplet-to-arch.sh $HOST).exe ${DEBUG_FLAG} -hda bootable_kernel.bin ${HDB} -serial file:serial_port_output.txt ${NET_ARG}
+  qemu-system-$(./target-triplet-to-arch.sh $HOST).exe ${DEBUG_FLAG} -hda bootable_kernel.bin ${HDB} ${SECONDARY_IDE_ARG} ${AHCI_ARG} ${VIRTIO_ARG} ${NVME_ARG} -serial file:serial_port_output.txt ${NET_ARG}
 else
   echo "Native Linux"
-  qemu-system-$(./target-triplet-to-arch.sh $HOST) ${DEBUG_FLAG} -hda bootable_kernel.bin ${HDB} -serial file:serial_port_output.txt ${NET_ARG}
+  qemu-system-$(./target-triplet-to-arch.sh $HOST) ${DEBUG_FLAG} -hda bootable_kernel.bin ${HDB} ${SECONDARY_IDE_ARG} ${AHCI_ARG} ${VIRTIO_ARG} ${NVME_ARG} -serial file:serial_port_output.txt ${NET_ARG}
 fi